@@ -29,6 +29,8 @@
  *  - Shortest Job Next with Preemption
  *  - Priority
  *  - Priority with Preemption
+ *  - Gang scheduling (Ousterhout matrix) on multiple CPUs
+ *  - Hierarchical fair share over groups of jobs
  */
 
 #include <stdlib.h>
@@ -36,41 +38,245 @@
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define CACHE_LINE 64
+#define MAX_P_STATES 8
+#define MAX_C_STATES 4
+#define MAX_CPUS 256
+#define MAX_PRODUCERS 256
 
 /*
  * Constants
  */
-const int ARG_LIMIT = 6;
+const int ARG_LIMIT = 20;
+const int DEFAULT_WEIGHT = 100;
+const int64_t WEIGHT_SCALE = 1 << 20;
+const char *TASKS_ENTITY = ".";
+const long NANOS_PER_MILLI = 1000000L;
+const long REPLAY_LEAD_NANOS = 20000000L;
 const int BUFFER_SIZE = 512;
-const char *TOKENT_SPLR = ", ";
+const int FULL_SPEED = 1000;
+const int64_t MAX_TICKS_PER_UNIT = 1000000000LL;
+const int64_t NO_ARRIVAL = INT64_MAX;
+const char *TOKENT_SPLR = ", \t\r\n";
 
 /*
  * Custom Types
  */
+/*
+ * Simulated time. Job run time is kept as work, one tick at full speed
+ * being FULL_SPEED units of work, so reduced frequencies stay exact too.
+ */
+typedef int64_t Tick;
+
 typedef struct Job {
 	pid_t id;
-	float arrival_time;
-	float run_time;
+	Tick arrival_time;
+	Tick run_time;
 	int priority;
+	double energy;
+	int threads;
+	int gang;
+	int placed;
+	int running_threads;
+	Tick thread_work; // Work done on its CPUs, not yet a whole unit of run time
+	Tick start_time;
+	struct Group *group;
 } Job;
 
 typedef struct Process {
 	Job *job;
 	struct Process *prev;
 	struct Process *next;
+	_Atomic(struct Process *) submit_next;
 } Process;
 
+/*
+ * Intrusive multi-producer single-consumer queue (Vyukov style).
+ * Producers only ever exchange 'tail', the simulation thread only ever
+ * touches 'head'; both live on their own cache line to avoid false sharing.
+ */
+typedef struct SubmitQueue {
+	_Alignas(CACHE_LINE) _Atomic(Process *) tail;
+	_Alignas(CACHE_LINE) Process *head;
+	Process stub;
+	_Alignas(CACHE_LINE) atomic_int producers;
+} SubmitQueue;
+
+/*
+ * A job producer thread. Its share of the jobs is submitted in arrival
+ * order, 'next_arrival' is the arrival time of the next one it will submit
+ * (NO_ARRIVAL once done), so no job arriving earlier is still to come.
+ */
+typedef struct Producer {
+	pthread_t thread;
+	Process **processes;
+	int first;
+	int stride;
+	int count;
+	_Alignas(CACHE_LINE) _Atomic(Tick) next_arrival;
+} Producer;
+
+/*
+ * One contiguous run of a job as decided by the simulation, together with
+ * its wall-clock counterpart measured during replay (in nanoseconds).
+ */
+typedef struct Slice {
+	pid_t id;
+	Tick start;
+	Tick end;
+	long long real_start;
+	long long real_end;
+} Slice;
+
+typedef struct Worker {
+	pid_t id;
+	pid_t pid;
+	long long cpu_time;
+} Worker;
+
+/*
+ * Energy model. Run time in the job file is work at the highest frequency,
+ * one simulated time unit is taken as one millisecond, so power in watts
+ * integrates to millijoules. Frequencies are relative to FULL_SPEED.
+ */
+typedef struct PState {
+	int frequency;
+	double power;
+} PState;
+
+typedef struct CState {
+	const char *name;
+	double power;
+	Tick target_residency;
+} CState;
+
+typedef struct Cpu {
+	int pstate;
+	Tick idle_run;
+	Tick busy_until;
+	double busy_energy;
+	double idle_energy;
+	Tick pstate_residency[MAX_P_STATES];
+	Tick cstate_residency[MAX_C_STATES];
+} Cpu;
+
+typedef struct JobEnergy {
+	pid_t id;
+	double energy;
+} JobEnergy;
+
+typedef enum {
+	NO_ENERGY, RACE_TO_IDLE, SLOW_AND_STEADY
+} EnergyPolicy;
+
+/*
+ * Multi-CPU accounting, in CPU-quanta. Fragmentation counts CPUs left idle
+ * while ready threads were waiting; partial counts CPUs running a coupled
+ * job of which not every thread was scheduled.
+ */
+typedef struct CpuStats {
+	long long busy;
+	long long idle;
+	long long fragmented;
+	long long partial;
+	Tick lost_work;
+	Tick makespan;
+	int finished;
+} CpuStats;
+
+/*
+ * A node of the group hierarchy. Runnable, unthrottled children sit in a
+ * min-heap on virtual runtime, so picking the next job costs O(depth log
+ * children). Jobs of a group are queued on a hidden 'tasks' child, which
+ * competes with the group's sub-groups like any other child (weight 100).
+ * Quota and period are in ticks; a group using up its quota within a period
+ * is throttled (taken out of its parent's heap) until the period ends.
+ */
+typedef struct Group {
+	char *path;
+	struct Group *parent;
+	struct Group **children;
+	int child_count;
+	struct Group *tasks;
+	int weight;
+	Tick quota;
+	Tick period;
+	Tick usage;
+	Tick period_start;
+	int throttled;
+	Tick throttle_start;
+	Tick throttled_time;
+	Tick vruntime;
+	Tick min_vruntime;
+	int heap_index;
+	struct Group **heap;
+	int heap_size;
+	int heap_capacity;
+	Process *queue_head;
+	Process *queue_tail;
+	Tick *latencies;
+	int latency_count;
+	int latency_capacity;
+} Group;
+
 typedef enum {
-	FCFS, SJN, SJNPRE, PRI, PRIPRE
+	FCFS, SJN, SJNPRE, PRI, PRIPRE, GANG, FAIR
 } Scheduler;
 
 /*
  * Global variables
  */
-float time_quantum = 1;
+Tick time_quantum = 1;
+Tick ticks_per_unit = 1000;
+char *quantum_text = NULL;
 char *job_file = NULL;
 Scheduler scheduler = FCFS;
 Process *head_link = NULL;
+int producer_threads = 0;
+Producer *producers = NULL;
+SubmitQueue submit_queue;
+float real_unit_ms = 0;
+Slice *slices = NULL;
+int slice_count = 0, slice_capacity = 0;
+EnergyPolicy energy_policy = NO_ENERGY;
+Cpu cpus[MAX_CPUS];
+int cpu_count = 1;
+int partial_slowdown = 50;
+CpuStats cpu_stats;
+char *group_file = NULL;
+Group *root_group = NULL;
+Group **throttled_groups = NULL;
+int throttled_count = 0, throttled_capacity = 0;
+int parked_jobs = 0;
+JobEnergy *job_energy = NULL;
+// Remaining work of the jobs arrived by 'arrived_until', wherever a scheduler
+// keeps them. The job list is counted up to 'arrival_cursor', its first job
+// arriving later.
+Tick ready_work = 0;
+Tick arrived_until = -1;
+Process *arrival_cursor = NULL;
+int job_energy_count = 0, job_energy_capacity = 0;
+
+// Fastest first, power roughly follows static + dynamic * f^3
+const PState P_STATES[] = { { 1000, 15.0 }, { 800, 8.4 }, { 600, 4.4 }, {
+		400, 2.4 } };
+const int P_STATE_COUNT = sizeof(P_STATES) / sizeof(P_STATES[0]);
+// Shallowest first, an idle period enters the deepest state it can pay off.
+// Target residencies are in time units and scaled to ticks when compared.
+const CState C_STATES[] = { { "C1", 1.2, 0 }, { "C3", 0.6, 2 },
+		{ "C6", 0.1, 6 } };
+const int C_STATE_COUNT = sizeof(C_STATES) / sizeof(C_STATES[0]);
 
 /*
  * Function prototypes
@@ -84,10 +290,74 @@ void SJN_scheduler();
 void SJNPRE_scheduler();
 void PRI_scheduler();
 void PRIPRE_scheduler();
+void MULTI_scheduler();
+void GANG_scheduler();
+void FAIR_scheduler();
 
-void sort_by_arrival();
+void init_submit_queue();
+void attach_producers(int);
+void detach_producer();
+void submit_process(Process*);
+Process *pop_submission();
+int admit_jobs(Tick);
+void merge_batch(Process*);
+Tick earliest_pending();
+void join_producers();
+void *producer_main(void*);
+Process *sort_batch(Process*);
+int arrives_before(const Process*, const Process*);
+int compare_arrival(const void*, const void*);
+
+void replay_schedule();
+pid_t spawn_worker();
+Worker *find_worker(Worker*, int, pid_t);
+int compare_workers(const void*, const void*);
+long long now_nanos();
+void sleep_until(long long);
+void print_replay(Worker*, int);
+
+Tick run_quantum(Process*, Tick);
+Tick run_cpu_quantum(Cpu*, Process*, Tick);
+void account_idle();
+void account_cpu_idle(Cpu*);
+void close_idle_period(Cpu*);
+int select_pstate(Tick);
+void count_arrivals(Tick);
+void record_job_energy(Job*);
+void print_energy();
+
+int collect_ready(Process***, int*, Tick);
+int compare_policy(const void*, const void*);
+int threads_waiting(Process**, int);
+Tick run_threads(Process*, int, Tick);
+void finish_threads(Process*, Tick);
+int place_in_matrix(Process*, Process***, int*);
+void print_cpu_stats();
+
+void read_groups();
+Group *find_group(const char*);
+Group *new_group(Group*, const char*, int);
+void enqueue_job(Process*);
+void dequeue_job(Group*);
+void activate_group(Group*);
+void deactivate_group(Group*);
+Group *pick_group();
+void charge_groups(Group*, Tick);
+void unthrottle_groups(Tick);
+void heap_push(Group*, Group*);
+void heap_remove(Group*, Group*);
+void heap_sift(Group*, int);
+int heap_before(const Group*, const Group*);
+void record_latency(Group*, Tick);
+void print_groups(Group*);
+int compare_ticks(const void*, const void*);
 void remove_process(Process*);
-void print_util(pid_t, int, int);
+void unlink_process(Process*);
+void release_process(Process*);
+void print_util(pid_t, Tick, Tick);
+Tick parse_ticks(const char*);
+char *format_ticks(Tick, char*);
+double ticks_to_units(Tick);
 void handle_error(char*);
 int is_empty(const char*);
 
@@ -100,9 +370,24 @@ int is_empty(const char*);
  */
 int main(int argc, char* argv[]) {
 
+	init_submit_queue();
 	read_args(argc, argv);
+	read_groups();
 	read_jobs();
 	start_scheduler();
+	join_producers();
+	if (real_unit_ms > 0) {
+		replay_schedule();
+	}
+	if (cpu_count > 1 || scheduler == GANG) {
+		print_cpu_stats();
+	}
+	if (scheduler == FAIR) {
+		print_groups(root_group);
+	}
+	if (energy_policy != NO_ENERGY) {
+		print_energy();
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -112,7 +397,12 @@ int main(int argc, char* argv[]) {
  * Parameter(s): argc - no of command line arguments passed
  * argv - string array containing command line arguments
  * Description: Reads, processes and validates the command line arguments passed
- * to the program.
+ * to the program. Besides the algorithm (-a) and quantum (-q) it takes the
+ * number of simulated CPUs (-c), the slowdown of partly scheduled coupled
+ * jobs in percent (-s), a groups file for FAIR (-w), the ticks per time
+ * unit (-t), a real time unit in milliseconds to replay the schedule with
+ * (-r), an energy policy (-e race|steady) and a number of producer threads
+ * (-p).
  */
 void read_args(int argc, char *argv[]) {
 	if (argc > ARG_LIMIT) {
@@ -126,6 +416,13 @@ void read_args(int argc, char *argv[]) {
 			--skip_next;
 			continue;
 		}
+		// Every flag takes a value, a trailing one has none to read
+		if (argv[counter][0] == '-' && counter + 1 >= argc) {
+			handle_error("Missing value for an option. Usage: sched -a "
+					"algorithm [-q quantum] [-c cpus] [-s slowdown] "
+					"[-w groups_file] [-t ticks_per_unit] [-r unit_ms] "
+					"[-e race|steady] [-p producers] job_file\n");
+		}
 		if (!strcmp("-a", argv[counter])) {
 			if (!strcmp("FCFS", argv[counter + 1])) {
 				scheduler = FCFS;
@@ -137,19 +434,82 @@ void read_args(int argc, char *argv[]) {
 				scheduler = PRI;
 			} else if (!strcmp("PRIPRE", argv[counter + 1])) {
 				scheduler = PRIPRE;
+			} else if (!strcmp("GANG", argv[counter + 1])) {
+				scheduler = GANG;
+			} else if (!strcmp("FAIR", argv[counter + 1])) {
+				scheduler = FAIR;
 			} else {
 				handle_error("Invalid scheduling algorithm\n");
 			}
 			algorithm = 1;
 			++skip_next;
 		} else if (!strcmp("-q", argv[counter])) {
-			time_quantum = atof(argv[counter + 1]);
+			quantum_text = argv[counter + 1];
+			++skip_next;
+		} else if (!strcmp("-c", argv[counter])) {
+			cpu_count = atoi(argv[counter + 1]);
+			if (cpu_count < 1 || cpu_count > MAX_CPUS) {
+				handle_error("Invalid number of CPUs\n");
+			}
+			++skip_next;
+		} else if (!strcmp("-s", argv[counter])) {
+			partial_slowdown = atoi(argv[counter + 1]);
+			if (partial_slowdown < 0 || partial_slowdown > 100) {
+				handle_error("Invalid partial scheduling slowdown\n");
+			}
+			++skip_next;
+		} else if (!strcmp("-w", argv[counter])) {
+			group_file = argv[counter + 1];
+			++skip_next;
+		} else if (!strcmp("-t", argv[counter])) {
+			ticks_per_unit = strtoll(argv[counter + 1], NULL, 10);
+			++skip_next;
+		} else if (!strcmp("-r", argv[counter])) {
+			real_unit_ms = atof(argv[counter + 1]);
+			if (real_unit_ms <= 0) {
+				handle_error("Invalid real time unit\n");
+			}
+			++skip_next;
+		} else if (!strcmp("-e", argv[counter])) {
+			if (!strcmp("race", argv[counter + 1])) {
+				energy_policy = RACE_TO_IDLE;
+			} else if (!strcmp("steady", argv[counter + 1])) {
+				energy_policy = SLOW_AND_STEADY;
+			} else {
+				handle_error("Invalid energy policy\n");
+			}
+			++skip_next;
+		} else if (!strcmp("-p", argv[counter])) {
+			producer_threads = atoi(argv[counter + 1]);
+			if (producer_threads < 0 || producer_threads > MAX_PRODUCERS) {
+				handle_error("Invalid number of producer threads\n");
+			}
 			++skip_next;
 		} else {
 			job_file = (argv[counter]);
 			file = 1;
 		}
 	}
+	// Resolution must be a power of ten, so ticks print as exact decimals
+	Tick resolution = ticks_per_unit;
+	while (resolution > 1 && resolution % 10 == 0) {
+		resolution /= 10;
+	}
+	if (resolution != 1 || ticks_per_unit > MAX_TICKS_PER_UNIT) {
+		handle_error("Invalid tick resolution\n");
+	}
+	// The quantum is read once the resolution is known
+	time_quantum = quantum_text != NULL ? parse_ticks(quantum_text)
+			: ticks_per_unit;
+	if (time_quantum < 1) {
+		handle_error("Invalid time quantum\n");
+	}
+	if (real_unit_ms > 0 && (cpu_count > 1 || scheduler == GANG)) {
+		handle_error("Real-execution mode needs a single CPU\n");
+	}
+	if (scheduler == FAIR && cpu_count > 1) {
+		handle_error("Fair share scheduling needs a single CPU\n");
+	}
 	if (!algorithm) {
 		handle_error("Scheduling algorithm not found. Exiting program.\n");
 	} else if (!file) {
@@ -160,11 +520,18 @@ void read_args(int argc, char *argv[]) {
 /*
  * Function: read_jobs
  * Description: Reads the input job file, read the jobs given in
- * predefined format and store them for later processing.
+ * predefined format and submits them to the scheduler. After the priority a
+ * job may declare 'threads=N', 'gang' (tightly coupled threads) and
+ * 'group=/a/b'. With '-p N' the jobs are handed to N producer threads
+ * which submit them concurrently while the simulation is already running.
+ * The jobs are sorted by arrival first, so every producer's share comes in
+ * arrival order.
  */
 void read_jobs() {
 	char buffer[BUFFER_SIZE];
-	Process *process = NULL;
+	Process *process = NULL, **processes = NULL;
+	int count = 0, capacity = 0, counter;
+	char *token;
 	FILE *file = fopen(job_file, "rt");
 	if (file == NULL) {
 		handle_error("Job file not found\n");
@@ -176,21 +543,108 @@ void read_jobs() {
 		process = (Process*) calloc(1, sizeof(Process));
 		process->job = (Job*) calloc(1, sizeof(Job));
 		process->job->id = strtol(strtok(buffer, TOKENT_SPLR), NULL, 10);
-		process->job->arrival_time = (float) strtol(strtok(NULL, TOKENT_SPLR),
-		NULL, 10);
-		process->job->run_time = (float) strtol(strtok(NULL, TOKENT_SPLR),
-		NULL, 10);
+		process->job->arrival_time = parse_ticks(strtok(NULL, TOKENT_SPLR));
+		process->job->run_time = parse_ticks(strtok(NULL, TOKENT_SPLR))
+				* FULL_SPEED;
 		process->job->priority = strtol(strtok(NULL, TOKENT_SPLR),
 		NULL, 10);
-		if (head_link == NULL) {
-			process->prev = NULL;
-		} else {
-			head_link->prev = process;
+		process->job->threads = 1;
+		process->job->start_time = -1;
+		// Optional attributes follow the priority
+		while ((token = strtok(NULL, TOKENT_SPLR)) != NULL) {
+			if (!strncmp(token, "threads=", 8)) {
+				process->job->threads = atoi(token + 8);
+			} else if (!strcmp(token, "gang")) {
+				process->job->gang = 1;
+			} else if (!strncmp(token, "group=", 6)) {
+				process->job->group = find_group(token + 6);
+			} else {
+				handle_error("Invalid job attribute\n");
+			}
 		}
-		process->next = head_link;
-		head_link = process;
+		if (process->job->group == NULL) {
+			process->job->group = root_group;
+		}
+		if (process->job->threads < 1 || (scheduler == GANG
+				&& process->job->threads > cpu_count)) {
+			handle_error("Invalid thread count\n");
+		}
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			processes = (Process**) realloc(processes,
+					capacity * sizeof(Process*));
+		}
+		processes[count++] = process;
 	}
 	fclose(file);
+
+	if (producer_threads < 1) {
+		attach_producers(1);
+		for (counter = 0; counter < count; counter++) {
+			submit_process(processes[counter]);
+		}
+		detach_producer();
+		free(processes);
+		return;
+	}
+	qsort(processes, count, sizeof(Process*), compare_arrival);
+	// Producers are attached up front, so the queue can not be seen as closed
+	// before the last thread has started submitting.
+	producers = (Producer*) calloc(producer_threads, sizeof(Producer));
+	attach_producers(producer_threads);
+	for (counter = 0; counter < producer_threads; counter++) {
+		producers[counter].processes = processes;
+		producers[counter].first = counter;
+		producers[counter].stride = producer_threads;
+		producers[counter].count = count;
+		atomic_init(&producers[counter].next_arrival, counter < count ?
+				processes[counter]->job->arrival_time : NO_ARRIVAL);
+	}
+	for (counter = 0; counter < producer_threads; counter++) {
+		if (pthread_create(&producers[counter].thread, NULL, producer_main,
+				&producers[counter])) {
+			handle_error("Unable to start producer thread\n");
+		}
+	}
+}
+
+/*
+ * Function: producer_main
+ * Parameter(s): arg - the Producer describing the share of jobs to submit
+ * Description: Thread body of a job producer. Producer 'n' submits every
+ * n-th job read from the job file and detaches once done. After each job
+ * it publishes the arrival time of the next one.
+ */
+void *producer_main(void *arg) {
+	Producer *producer = (Producer*) arg;
+	int index, next;
+	for (index = producer->first; index < producer->count; index = next) {
+		submit_process(producer->processes[index]);
+		next = index + producer->stride;
+		atomic_store_explicit(&producer->next_arrival, next < producer->count ?
+				producer->processes[next]->job->arrival_time : NO_ARRIVAL,
+				memory_order_release);
+	}
+	detach_producer();
+	return NULL;
+}
+
+/*
+ * Function: join_producers
+ * Description: Waits for the producer threads, all of them have detached
+ * once the simulation is over, and frees them with the job array.
+ */
+void join_producers() {
+	int counter;
+	if (producers == NULL) {
+		return;
+	}
+	for (counter = 0; counter < producer_threads; counter++) {
+		pthread_join(producers[counter].thread, NULL);
+	}
+	free(producers[0].processes);
+	free(producers);
+	producers = NULL;
 }
 
 /*
@@ -199,8 +653,16 @@ void read_jobs() {
  * Acts as a selector.
  */
 void start_scheduler() {
-	sort_by_arrival();
-
+	if (scheduler == GANG) {
+		GANG_scheduler();
+		return;
+	} else if (scheduler == FAIR) {
+		FAIR_scheduler();
+		return;
+	} else if (cpu_count > 1) {
+		MULTI_scheduler();
+		return;
+	}
 	switch (scheduler) {
 	case FCFS:
 		FCFS_scheduler();
@@ -228,13 +690,14 @@ void start_scheduler() {
  * Description: Process jobs as per First Come First Served algorithm.
  */
 void FCFS_scheduler() {
-	float timer = 0, quantum_used = 0;
+	Tick timer = 0, quantum_used = 0;
 	Process *current = head_link, *selected = NULL;
 	while (1) {
-		current = head_link;
-		if (current == NULL) {
+		// Every pass is an event boundary, pending submissions get admitted here.
+		if (!admit_jobs(timer)) {
 			break;
 		}
+		current = head_link;
 		// If selected is not NULL, it means the prev. selected process hasn't finished its processing
 		if (selected == NULL) {
 			while (1) {
@@ -250,6 +713,7 @@ void FCFS_scheduler() {
 					}
 					current = current->next;
 				} else if (current != NULL && selected == NULL) {
+					account_idle();
 					timer += time_quantum;
 				} else {
 					break;
@@ -257,8 +721,8 @@ void FCFS_scheduler() {
 			}
 		}
 
+		selected->job->run_time -= run_quantum(selected, timer);
 		timer += time_quantum, quantum_used += time_quantum;
-		selected->job->run_time -= time_quantum;
 		if (selected->job->run_time <= 0) {
 			print_util(selected->job->id, timer - quantum_used, timer);
 			remove_process(selected);
@@ -273,13 +737,14 @@ void FCFS_scheduler() {
  * Shortest jobs are the ones with shortest run time at a point of time.
  */
 void SJN_scheduler() {
-	float timer = 0, quantum_used = 0;
+	Tick timer = 0, quantum_used = 0;
 	Process *current = head_link, *selected = NULL;
 	while (1) {
-		current = head_link;
-		if (current == NULL) {
+		// Every pass is an event boundary, pending submissions get admitted here.
+		if (!admit_jobs(timer)) {
 			break;
 		}
+		current = head_link;
 		// If selected is not NULL, it means the prev. selected job hasn't finished its processing
 		if (selected == NULL) {
 			while (1) {
@@ -295,6 +760,7 @@ void SJN_scheduler() {
 					}
 					current = current->next;
 				} else if (current != NULL && selected == NULL) {
+					account_idle();
 					timer += time_quantum;
 				} else {
 					break;
@@ -302,8 +768,8 @@ void SJN_scheduler() {
 			}
 		}
 
+		selected->job->run_time -= run_quantum(selected, timer);
 		timer += time_quantum, quantum_used += time_quantum;
-		selected->job->run_time -= time_quantum;
 		if (selected->job->run_time <= 0) {
 			print_util(selected->job->id, timer - quantum_used, timer);
 			remove_process(selected);
@@ -318,13 +784,14 @@ void SJN_scheduler() {
  * Check for preemption is done at given time quantum.
  */
 void SJNPRE_scheduler() {
-	float timer = 0, quantum_used = 0;
+	Tick timer = 0, quantum_used = 0;
 	Process *current = head_link, *running = NULL, *selected = NULL;
 	while (1) {
-		current = head_link, running = selected;
-		if (current == NULL) {
+		// Every pass is an event boundary, pending submissions get admitted here.
+		if (!admit_jobs(timer)) {
 			break;
 		}
+		current = head_link, running = selected;
 		while (1) {
 			// Iteratively selects the job which has shortest run time and incase of a tie, one
 			// with lowest id is selected for processing
@@ -337,6 +804,7 @@ void SJNPRE_scheduler() {
 				}
 				current = current->next;
 			} else if (current != NULL && selected == NULL) {
+				account_idle();
 				timer += time_quantum;
 			} else {
 				break;
@@ -345,8 +813,8 @@ void SJNPRE_scheduler() {
 		// running stores the prev. 'process/process state'. If it is different from selected,
 		// then 'process/process state' has changed and details are logged
 		if (running == NULL || running->job->id == selected->job->id) {
+			selected->job->run_time -= run_quantum(selected, timer);
 			timer += time_quantum, quantum_used += time_quantum;
-			selected->job->run_time -= time_quantum;
 			if (selected->job->run_time <= 0) {
 				print_util(selected->job->id, timer - quantum_used, timer);
 				remove_process(selected);
@@ -366,13 +834,14 @@ void SJNPRE_scheduler() {
  * having lesser priority values.
  */
 void PRI_scheduler() {
-	float timer = 0, quantum_used = 0;
+	Tick timer = 0, quantum_used = 0;
 	Process *current = head_link, *selected = NULL;
 	while (1) {
-		current = head_link;
-		if (current == NULL) {
+		// Every pass is an event boundary, pending submissions get admitted here.
+		if (!admit_jobs(timer)) {
 			break;
 		}
+		current = head_link;
 		// If selected is not NULL, it means the prev. selected job hasn't finished with its processing
 		if (selected == NULL) {
 			while (1) {
@@ -388,6 +857,7 @@ void PRI_scheduler() {
 					}
 					current = current->next;
 				} else if (current != NULL && selected == NULL) {
+					account_idle();
 					timer += time_quantum;
 				} else {
 					break;
@@ -395,8 +865,8 @@ void PRI_scheduler() {
 			}
 		}
 
+		selected->job->run_time -= run_quantum(selected, timer);
 		timer += time_quantum, quantum_used += time_quantum;
-		selected->job->run_time -= time_quantum;
 		if (selected->job->run_time <= 0) {
 			print_util(selected->job->id, timer - quantum_used, timer);
 			remove_process(selected);
@@ -411,13 +881,14 @@ void PRI_scheduler() {
  * Checks for preemption at given time quantum.
  */
 void PRIPRE_scheduler() {
-	float timer = 0, quantum_used = 0;
+	Tick timer = 0, quantum_used = 0;
 	Process *current = head_link, *running = NULL, *selected = NULL;
 	while (1) {
-		current = head_link, running = selected;
-		if (current == NULL) {
+		// Every pass is an event boundary, pending submissions get admitted here.
+		if (!admit_jobs(timer)) {
 			break;
 		}
+		current = head_link, running = selected;
 		while (1) {
 			// Iteratively selects the job which has highest priority at given point of time
 			// and incase of a tie, selects the one with lowest id for processing
@@ -430,6 +901,7 @@ void PRIPRE_scheduler() {
 				}
 				current = current->next;
 			} else if (current != NULL && selected == NULL) {
+				account_idle();
 				timer += time_quantum;
 			} else {
 				break;
@@ -439,8 +911,8 @@ void PRIPRE_scheduler() {
 		// running stores the prev. 'process/process state'. If it is different from selected,
 		// then 'process/process state' has changed and details are logged
 		if (running == NULL || running->job->id == selected->job->id) {
+			selected->job->run_time -= run_quantum(selected, timer);
 			timer += time_quantum, quantum_used += time_quantum;
-			selected->job->run_time -= time_quantum;
 			if (selected->job->run_time <= 0) {
 				print_util(selected->job->id, timer - quantum_used, timer);
 				remove_process(selected);
@@ -454,69 +926,1593 @@ void PRIPRE_scheduler() {
 }
 
 /*
- * Function: sort_by_arrival
- * Description: Utility function - sorts the processes read from file
- * based on its arrival time. Based on the assumption - input may not be in
- * sorted order
+ * Function: MULTI_scheduler
+ * Description: Runs the selected policy on several CPUs. Every quantum the
+ * ready jobs are ordered by the policy and hand out their threads to the
+ * free CPUs in that order; a job may get fewer CPUs than it has threads.
+ * Non preemptive policies keep started jobs ahead of everything else.
  */
-void sort_by_arrival() {
-	Process *current = head_link, *comparator, *temp;
-	Job *current_job;
-	while (current != NULL) {
-		temp = current, comparator = current->next;
-		while (comparator != NULL) {
-			if (comparator->job->arrival_time < temp->job->arrival_time
-					|| (comparator->job->arrival_time == temp->job->arrival_time
-							&& comparator->job->id < temp->job->id)) {
-				temp = comparator;
+void MULTI_scheduler() {
+	Tick timer = 0;
+	Process **ready = NULL, *current;
+	int capacity = 0, count, counter, free_cpus, cpu, given;
+	while (admit_jobs(timer)) {
+		count = collect_ready(&ready, &capacity, timer);
+		qsort(ready, count, sizeof(Process*), compare_policy);
+		free_cpus = cpu_count, cpu = 0;
+		for (counter = 0; counter < count; counter++) {
+			current = ready[counter];
+			given = current->job->threads < free_cpus ?
+					current->job->threads : free_cpus;
+			free_cpus -= given;
+			current->job->running_threads = given;
+		}
+		for (counter = 0; counter < count; counter++) {
+			current = ready[counter];
+			if (current->job->running_threads > 0) {
+				run_threads(current, cpu, timer);
+				cpu += current->job->running_threads;
+			}
+		}
+		for (; cpu < cpu_count; cpu++) {
+			account_cpu_idle(&cpus[cpu]);
+			++cpu_stats.idle;
+			cpu_stats.fragmented += threads_waiting(ready, count);
+		}
+		timer += time_quantum;
+		for (counter = 0; counter < count; counter++) {
+			finish_threads(ready[counter], timer);
+		}
+	}
+	free(ready);
+}
+
+/*
+ * Function: GANG_scheduler
+ * Description: Gang scheduling with an Ousterhout matrix. Rows are time
+ * slices and columns CPUs; a coupled job takes as many slots in a single row
+ * as it has threads, other jobs may spread over rows. Rows are served round
+ * robin, idle slots of the active row are back-filled with jobs from other
+ * rows that fit completely (alternate selection).
+ */
+void GANG_scheduler() {
+	Tick timer = 0;
+	Process **ready = NULL, **matrix = NULL, *current;
+	int capacity = 0, rows = 0, row = -1, count, counter, column, other,
+			idle, cpu, slots;
+	while (admit_jobs(timer)) {
+		count = collect_ready(&ready, &capacity, timer);
+		for (counter = 0; counter < count; counter++) {
+			if (!ready[counter]->job->placed) {
+				place_in_matrix(ready[counter], &matrix, &rows);
+			}
+			ready[counter]->job->running_threads = 0;
+		}
+		if (rows == 0) {
+			for (cpu = 0; cpu < cpu_count; cpu++) {
+				account_cpu_idle(&cpus[cpu]);
+				++cpu_stats.idle;
 			}
-			comparator = comparator->next;
+			timer += time_quantum;
+			continue;
 		}
 
-		if (temp != NULL) {
-			current_job = temp->job;
-			temp->job = current->job;
-			current->job = current_job;
+		row = (row + 1) % rows;
+		idle = 0;
+		for (column = 0; column < cpu_count; column++) {
+			current = matrix[row * cpu_count + column];
+			if (current == NULL) {
+				++idle;
+			} else {
+				++current->job->running_threads;
+			}
+		}
+		// Alternate selection: a job from another row runs only if all of its
+		// slots in that row fit into the idle CPUs, so gangs are never split.
+		for (other = 1; other < rows && idle > 0; other++) {
+			int candidate_row = (row + other) % rows;
+			for (column = 0; column < cpu_count && idle > 0; column++) {
+				current = matrix[candidate_row * cpu_count + column];
+				if (current == NULL || current->job->running_threads > 0) {
+					continue;
+				}
+				for (slots = 0, counter = 0; counter < cpu_count; counter++) {
+					slots += matrix[candidate_row * cpu_count + counter] == current;
+				}
+				if (slots <= idle) {
+					current->job->running_threads = slots;
+					idle -= slots;
+				}
+			}
+		}
+
+		cpu = 0;
+		for (counter = 0; counter < count; counter++) {
+			current = ready[counter];
+			if (current->job->running_threads > 0) {
+				run_threads(current, cpu, timer);
+				cpu += current->job->running_threads;
+			}
+		}
+		for (; cpu < cpu_count; cpu++) {
+			account_cpu_idle(&cpus[cpu]);
+			++cpu_stats.idle;
+			cpu_stats.fragmented += threads_waiting(ready, count);
+		}
+		timer += time_quantum;
+
+		// Finished jobs leave the matrix, empty rows are compacted away
+		for (counter = 0; counter < count; counter++) {
+			current = ready[counter];
+			if (current->job->running_threads > 0 && current->job->run_time <= 0) {
+				for (column = 0; column < rows * cpu_count; column++) {
+					if (matrix[column] == current) {
+						matrix[column] = NULL;
+					}
+				}
+			}
+			finish_threads(current, timer);
+		}
+		for (other = 0; other < rows;) {
+			for (column = 0; column < cpu_count
+					&& matrix[other * cpu_count + column] == NULL; column++)
+				;
+			if (column < cpu_count) {
+				++other;
+				continue;
+			}
+			memmove(&matrix[other * cpu_count], &matrix[(other + 1) * cpu_count],
+					(rows - other - 1) * cpu_count * sizeof(Process*));
+			--rows;
+			if (row >= other) {
+				--row;
+			}
 		}
-		current = current->next;
 	}
+	free(ready);
+	free(matrix);
 }
 
 /*
- * Function: remove_process
- * Parameter(s): process - the process who's allocated memory needs to be freed
- * Description: Frees allocated space for the passed process from heap.
+ * Function: FAIR_scheduler
+ * Description: Hierarchical fair share scheduling. Every quantum the tree is
+ * descended from the root along the child with the least virtual runtime
+ * down to a run queue, whose first job (jobs of a group run in arrival
+ * order) gets the quantum. The quantum is then charged to every group on
+ * the path, weighted by the group's share, and counted against its quota.
  */
-void remove_process(Process *process) {
-	Process *temp = NULL;
-	if (process->prev == NULL && process->next == NULL) {
-		head_link = NULL;
-	} else if (process->prev == NULL) {
-		temp = process->next;
-		temp->prev = NULL;
-		head_link = temp;
-	} else if (process->next == NULL) {
-		temp = process->prev;
-		temp->next = NULL;
+void FAIR_scheduler() {
+	Tick timer = 0, slice_start = 0;
+	Process *running = NULL, *current;
+	Group *tasks;
+	while (admit_jobs(timer)) {
+		// Arrived jobs leave the arrival list for their group's run queue
+		while ((current = head_link) != NULL
+				&& current->job->arrival_time <= timer) {
+			unlink_process(current);
+			enqueue_job(current);
+		}
+		unthrottle_groups(timer);
+		if (root_group->heap_size == 0) {
+			if (running != NULL) {
+				print_util(running->job->id, slice_start, timer);
+				running = NULL;
+			}
+			account_idle();
+			timer += time_quantum;
+			continue;
+		}
+
+		tasks = pick_group();
+		current = tasks->queue_head;
+		if (current != running) {
+			if (running != NULL) {
+				print_util(running->job->id, slice_start, timer);
+			}
+			running = current, slice_start = timer;
+		}
+		current->job->run_time -= run_quantum(current, timer);
+		timer += time_quantum;
+		charge_groups(tasks, timer);
+		if (current->job->run_time <= 0) {
+			print_util(current->job->id, slice_start, timer);
+			record_latency(tasks->parent, timer - current->job->arrival_time);
+			dequeue_job(tasks);
+			release_process(current);
+			running = NULL;
+		}
+	}
+}
+
+/*
+ * Function: read_groups
+ * Description: Builds the group hierarchy. Every line of the groups file
+ * reads 'path, weight[, quota, period]' with quota and period in time
+ * units; groups only named by jobs get the default weight and no quota.
+ * The root group takes a weight but no quota.
+ */
+void read_groups() {
+	char buffer[BUFFER_SIZE], *token;
+	Group *group;
+	FILE *file;
+	root_group = new_group(NULL, "", DEFAULT_WEIGHT);
+	if (group_file == NULL) {
+		return;
+	}
+	file = fopen(group_file, "rt");
+	if (file == NULL) {
+		handle_error("Group file not found\n");
+	}
+	while (fgets(buffer, BUFFER_SIZE, file)) {
+		if (buffer[0] == '\n' || buffer[0] == '#' || is_empty(buffer)) {
+			continue;
+		}
+		group = find_group(strtok(buffer, TOKENT_SPLR));
+		if ((token = strtok(NULL, TOKENT_SPLR)) != NULL) {
+			group->weight = atoi(token);
+		}
+		if ((token = strtok(NULL, TOKENT_SPLR)) != NULL) {
+			group->quota = parse_ticks(token);
+			group->period = parse_ticks(strtok(NULL, TOKENT_SPLR));
+		}
+		if (group->weight < 1 || group->quota < 0
+				|| (group->quota > 0 && group->period < group->quota)
+				|| (group->quota > 0 && group == root_group)) {
+			handle_error("Invalid group definition\n");
+		}
+	}
+	fclose(file);
+}
+
+/*
+ * Function: find_group
+ * Parameter(s): path - slash separated group path, e.g. '/tenant/web'
+ * Returns: the group, created along with its missing ancestors
+ */
+Group *find_group(const char *path) {
+	Group *group = root_group;
+	const char *name = path, *end;
+	char component[BUFFER_SIZE];
+	int counter, length;
+	while (*name != '\0') {
+		while (*name == '/') {
+			++name;
+		}
+		if (*name == '\0') {
+			break;
+		}
+		for (end = name; *end != '\0' && *end != '/'; end++)
+			;
+		length = end - name < BUFFER_SIZE - 1 ? end - name : BUFFER_SIZE - 1;
+		memcpy(component, name, length);
+		component[length] = '\0';
+		for (counter = 0; counter < group->child_count; counter++) {
+			if (group->children[counter] != group->tasks
+					&& !strcmp(strrchr(group->children[counter]->path, '/') + 1,
+							component)) {
+				break;
+			}
+		}
+		group = counter < group->child_count ? group->children[counter] :
+				new_group(group, component, DEFAULT_WEIGHT);
+		name = end;
+	}
+	return group;
+}
+
+/*
+ * Function: new_group
+ * Parameter(s): parent - parent group, NULL for the root
+ * name - last path component
+ * weight - share of the group among its siblings
+ * Returns: a new group attached to its parent
+ * Description: Every real group gets its hidden tasks child right away.
+ */
+Group *new_group(Group *parent, const char *name, int weight) {
+	Group *group = (Group*) calloc(1, sizeof(Group));
+	group->path = (char*) malloc(
+			(parent ? strlen(parent->path) : 0) + strlen(name) + 2);
+	// The root's path is empty, so that children read '/name'
+	if (parent == NULL) {
+		group->path[0] = '\0';
 	} else {
-		temp = process->prev;
-		temp->next = process->next;
-		temp = process->next;
-		temp->prev = process->prev;
+		sprintf(group->path, "%s/%s", parent->path, name);
 	}
-	free(process->job);
-	free(process);
+	group->parent = parent;
+	group->weight = weight;
+	group->heap_index = -1;
+	if (parent != NULL) {
+		parent->children = (Group**) realloc(parent->children,
+				(parent->child_count + 1) * sizeof(Group*));
+		parent->children[parent->child_count++] = group;
+	}
+	if (strcmp(name, TASKS_ENTITY)) {
+		group->tasks = new_group(group, TASKS_ENTITY, DEFAULT_WEIGHT);
+	}
+	return group;
 }
 
 /*
- * Function: print_util
- * Parameter(s): id - process id
- * start_time - process start time
- * end_time - process end time
- * Description: Prints the process execution details.
+ * Function: enqueue_job
+ * Parameter(s): process - an arrived process
+ * Description: Appends the process to its group's run queue, making the
+ * queue runnable if it was empty.
+ */
+void enqueue_job(Process *process) {
+	Group *tasks = process->job->group->tasks;
+	process->next = NULL;
+	process->prev = tasks->queue_tail;
+	if (tasks->queue_tail == NULL) {
+		tasks->queue_head = process;
+	} else {
+		tasks->queue_tail->next = process;
+	}
+	tasks->queue_tail = process;
+	++parked_jobs;
+	if (process->prev == NULL) {
+		activate_group(tasks);
+	}
+}
+
+/*
+ * Function: dequeue_job
+ * Parameter(s): tasks - run queue whose first process has finished
+ * Description: Drops the first process of the queue, an emptied queue stops
+ * being runnable.
+ */
+void dequeue_job(Group *tasks) {
+	Process *process = tasks->queue_head;
+	tasks->queue_head = process->next;
+	if (tasks->queue_head == NULL) {
+		tasks->queue_tail = NULL;
+		deactivate_group(tasks);
+	} else {
+		tasks->queue_head->prev = NULL;
+	}
+	process->next = process->prev = NULL;
+	--parked_jobs;
+}
+
+/*
+ * Function: activate_group
+ * Parameter(s): group - a group that may have become runnable
+ * Description: Enters the group into its parent's heap and walks up as long
+ * as parents become runnable by that. A group returning from sleep starts
+ * at its parent's minimum virtual runtime, so it can not hoard credit.
+ */
+void activate_group(Group *group) {
+	Group *parent;
+	int was_runnable;
+	while (group->parent != NULL && group->heap_index < 0 && !group->throttled
+			&& (group->queue_head != NULL || group->heap_size > 0)) {
+		parent = group->parent;
+		was_runnable = parent->heap_size > 0;
+		if (group->vruntime < parent->min_vruntime) {
+			group->vruntime = parent->min_vruntime;
+		}
+		heap_push(parent, group);
+		if (was_runnable) {
+			break;
+		}
+		group = parent;
+	}
+}
+
+/*
+ * Function: deactivate_group
+ * Parameter(s): group - a group that ran empty or got throttled
+ * Description: Takes the group out of its parent's heap and walks up as long
+ * as parents run empty by that.
+ */
+void deactivate_group(Group *group) {
+	Group *parent;
+	while (group->parent != NULL && group->heap_index >= 0) {
+		parent = group->parent;
+		heap_remove(parent, group);
+		if (parent->heap_size > 0) {
+			break;
+		}
+		group = parent;
+	}
+}
+
+/*
+ * Function: pick_group
+ * Returns: the run queue to serve next
+ * Description: Descends from the root along the least virtual runtime.
+ */
+Group *pick_group() {
+	Group *group = root_group;
+	while (group->heap_size > 0) {
+		group = group->heap[0];
+	}
+	return group;
+}
+
+/*
+ * Function: charge_groups
+ * Parameter(s): tasks - run queue that got the last quantum
+ * timer - simulation time at the end of the quantum
+ * Description: Advances virtual runtime along the path in inverse proportion
+ * to each group's weight and throttles groups that used up their quota.
+ */
+void charge_groups(Group *tasks, Tick timer) {
+	Group *group;
+	for (group = tasks; group->parent != NULL; group = group->parent) {
+		group->vruntime += time_quantum * WEIGHT_SCALE / group->weight;
+		heap_sift(group->parent, group->heap_index);
+		if (group->parent->min_vruntime < group->parent->heap[0]->vruntime) {
+			group->parent->min_vruntime = group->parent->heap[0]->vruntime;
+		}
+	}
+	for (group = tasks; group->parent != NULL; group = group->parent) {
+		if (group->quota <= 0) {
+			continue;
+		}
+		if (timer - time_quantum >= group->period_start + group->period) {
+			group->period_start = (timer - time_quantum)
+					- (timer - time_quantum) % group->period;
+			group->usage = 0;
+		}
+		group->usage += time_quantum;
+		if (group->usage >= group->quota && !group->throttled) {
+			group->throttled = 1;
+			group->throttle_start = timer;
+			deactivate_group(group);
+			if (throttled_count == throttled_capacity) {
+				throttled_capacity = throttled_capacity ? throttled_capacity * 2 : 16;
+				throttled_groups = (Group**) realloc(throttled_groups,
+						throttled_capacity * sizeof(Group*));
+			}
+			throttled_groups[throttled_count++] = group;
+		}
+	}
+}
+
+/*
+ * Function: unthrottle_groups
+ * Parameter(s): timer - current simulation time
+ * Description: Releases throttled groups whose period has ended.
+ */
+void unthrottle_groups(Tick timer) {
+	Group *group;
+	int counter = 0;
+	while (counter < throttled_count) {
+		group = throttled_groups[counter];
+		if (timer < group->period_start + group->period) {
+			++counter;
+			continue;
+		}
+		group->throttled = 0;
+		group->usage = 0;
+		group->period_start = timer - timer % group->period;
+		group->throttled_time += timer - group->throttle_start;
+		throttled_groups[counter] = throttled_groups[--throttled_count];
+		activate_group(group);
+	}
+}
+
+/*
+ * Function: heap_push
+ * Parameter(s): parent - owner of the heap
+ * group - runnable child to add
+ */
+void heap_push(Group *parent, Group *group) {
+	if (parent->heap_size == parent->heap_capacity) {
+		parent->heap_capacity = parent->heap_capacity ?
+				parent->heap_capacity * 2 : 4;
+		parent->heap = (Group**) realloc(parent->heap,
+				parent->heap_capacity * sizeof(Group*));
+	}
+	group->heap_index = parent->heap_size;
+	parent->heap[parent->heap_size++] = group;
+	heap_sift(parent, group->heap_index);
+}
+
+/*
+ * Function: heap_remove
+ * Parameter(s): parent - owner of the heap
+ * group - child to take out
+ */
+void heap_remove(Group *parent, Group *group) {
+	int index = group->heap_index;
+	Group *last = parent->heap[--parent->heap_size];
+	group->heap_index = -1;
+	if (last != group) {
+		parent->heap[index] = last;
+		last->heap_index = index;
+		heap_sift(parent, index);
+	}
+}
+
+/*
+ * Function: heap_sift
+ * Parameter(s): parent - owner of the heap
+ * index - position whose key has changed
+ * Description: Restores the heap order around 'index', up or down.
+ */
+void heap_sift(Group *parent, int index) {
+	Group **heap = parent->heap, *group = heap[index];
+	int child;
+	while (index > 0 && heap_before(group, heap[(index - 1) / 2])) {
+		heap[index] = heap[(index - 1) / 2];
+		heap[index]->heap_index = index;
+		index = (index - 1) / 2;
+	}
+	while ((child = 2 * index + 1) < parent->heap_size) {
+		if (child + 1 < parent->heap_size
+				&& heap_before(heap[child + 1], heap[child])) {
+			++child;
+		}
+		if (!heap_before(heap[child], group)) {
+			break;
+		}
+		heap[index] = heap[child];
+		heap[index]->heap_index = index;
+		index = child;
+	}
+	heap[index] = group;
+	group->heap_index = index;
+}
+
+/*
+ * Function: heap_before
+ * Returns: 1 if 'first' has to be served ahead of 'second'
+ * Description: Least virtual runtime first, ties broken by path.
+ */
+int heap_before(const Group *first, const Group *second) {
+	return first->vruntime < second->vruntime
+			|| (first->vruntime == second->vruntime
+					&& strcmp(first->path, second->path) < 0);
+}
+
+/*
+ * Function: record_latency
+ * Parameter(s): group - group of a finished job
+ * latency - the job's turnaround time
+ * Description: Adds the latency to the group and every ancestor, so each
+ * tenant sees the latencies of its whole subtree.
+ */
+void record_latency(Group *group, Tick latency) {
+	for (; group != NULL; group = group->parent) {
+		if (group->latency_count == group->latency_capacity) {
+			group->latency_capacity = group->latency_capacity ?
+					group->latency_capacity * 2 : 16;
+			group->latencies = (Tick*) realloc(group->latencies,
+					group->latency_capacity * sizeof(Tick));
+		}
+		group->latencies[group->latency_count++] = latency;
+	}
+}
+
+/*
+ * Function: print_groups
+ * Parameter(s): group - root of the subtree to report
+ * Description: Prints turnaround percentiles and throttled time for every
+ * group that ran jobs, depth first.
+ */
+void print_groups(Group *group) {
+	char p50[32], p95[32], p99[32], throttled[32];
+	int count = group->latency_count, counter;
+	if (count > 0) {
+		qsort(group->latencies, count, sizeof(Tick), compare_ticks);
+		printf("group %s: jobs %d, turnaround p50 %s, p95 %s, p99 %s, "
+				"throttled %s\n", group->parent == NULL ? "/" : group->path,
+				count, format_ticks(group->latencies[(count - 1) * 50 / 100], p50),
+				format_ticks(group->latencies[(count - 1) * 95 / 100], p95),
+				format_ticks(group->latencies[(count - 1) * 99 / 100], p99),
+				format_ticks(group->throttled_time, throttled));
+	}
+	for (counter = 0; counter < group->child_count; counter++) {
+		print_groups(group->children[counter]);
+	}
+}
+
+/*
+ * Function: compare_ticks
+ * Description: qsort comparator - ascending ticks.
+ */
+int compare_ticks(const void *first, const void *second) {
+	Tick left = *(const Tick*) first, right = *(const Tick*) second;
+	return (left > right) - (left < right);
+}
+
+/*
+ * Function: collect_ready
+ * Parameter(s): ready - growable array receiving the ready processes
+ * capacity - current capacity of the array
+ * timer - current simulation time
+ * Returns: no of processes that have arrived by 'timer'
+ */
+int collect_ready(Process ***ready, int *capacity, Tick timer) {
+	Process *current = head_link;
+	int count = 0;
+	while (current != NULL && current->job->arrival_time <= timer) {
+		if (count == *capacity) {
+			*capacity = *capacity ? *capacity * 2 : 64;
+			*ready = (Process**) realloc(*ready, *capacity * sizeof(Process*));
+		}
+		(*ready)[count++] = current;
+		current->job->running_threads = 0;
+		current = current->next;
+	}
+	return count;
+}
+
+/*
+ * Function: threads_waiting
+ * Parameter(s): ready - ready processes
+ * count - no of ready processes
+ * Returns: 1 if some ready process has threads that are not running
+ */
+int threads_waiting(Process **ready, int count) {
+	int counter;
+	for (counter = 0; counter < count; counter++) {
+		if (ready[counter]->job->running_threads < ready[counter]->job->threads) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function: compare_policy
+ * Description: qsort comparator - orders ready processes by the selected
+ * policy, ties broken by lowest id.
+ */
+int compare_policy(const void *first, const void *second) {
+	const Job *left = (*(Process* const *) first)->job;
+	const Job *right = (*(Process* const *) second)->job;
+	Tick key = 0;
+	if (scheduler == FCFS || scheduler == SJN || scheduler == PRI) {
+		// Started jobs are not preempted, they keep their place in start order
+		if ((left->start_time < 0) != (right->start_time < 0)) {
+			return left->start_time < 0 ? 1 : -1;
+		}
+		key = left->start_time - right->start_time;
+	}
+	if (key == 0) {
+		if (scheduler == FCFS) {
+			key = left->arrival_time - right->arrival_time;
+		} else if (scheduler == SJN || scheduler == SJNPRE) {
+			key = left->run_time - right->run_time;
+		} else {
+			key = left->priority - right->priority;
+		}
+	}
+	if (key == 0) {
+		key = left->id - right->id;
+	}
+	return (key > 0) - (key < 0);
+}
+
+/*
+ * Function: run_threads
+ * Parameter(s): process - the process to run for one quantum
+ * first_cpu - first of the 'running_threads' CPUs given to the process
+ * timer - simulation time at which the quantum starts
+ * Returns: the work done by the process
+ * Description: Runs the scheduled threads of a process for a quantum. Run
+ * time is per thread, so a fully scheduled job progresses like a single
+ * threaded one; a partially scheduled job progresses in proportion to its
+ * running threads, less the slowdown if its threads are coupled. Work that
+ * does not divide by the thread count is carried to the next quantum.
+ */
+Tick run_threads(Process *process, int first_cpu, Tick timer) {
+	Job *job = process->job;
+	Tick work = 0;
+	int cpu;
+	for (cpu = first_cpu; cpu < first_cpu + job->running_threads; cpu++) {
+		work += run_cpu_quantum(&cpus[cpu], process, timer);
+	}
+	cpu_stats.busy += job->running_threads;
+	if (job->start_time < 0) {
+		job->start_time = timer;
+	}
+	work += job->thread_work;
+	job->thread_work = work % job->threads;
+	work /= job->threads;
+	if (job->running_threads < job->threads && job->gang) {
+		cpu_stats.partial += job->running_threads;
+		cpu_stats.lost_work += work * partial_slowdown / 100;
+		work -= work * partial_slowdown / 100;
+	}
+	job->run_time -= work;
+	ready_work -= work;
+	return work;
+}
+
+/*
+ * Function: finish_threads
+ * Parameter(s): process - a process that may have completed
+ * timer - simulation time at the end of the quantum
+ * Description: Prints and removes the process once its work is done.
+ */
+void finish_threads(Process *process, Tick timer) {
+	if (process->job->running_threads > 0 && process->job->run_time <= 0) {
+		print_util(process->job->id, process->job->start_time, timer);
+		cpu_stats.makespan = timer;
+		++cpu_stats.finished;
+		remove_process(process);
+	}
+}
+
+/*
+ * Function: place_in_matrix
+ * Parameter(s): process - a newly ready process
+ * matrix - the Ousterhout matrix, 'rows' rows of cpu_count slots
+ * rows - no of rows, grows when a new row is needed
+ * Returns: first row the process was placed in
+ * Description: First fit placement. A coupled job needs all of its slots in
+ * one row, other jobs take free slots wherever they are.
+ */
+int place_in_matrix(Process *process, Process ***matrix, int *rows) {
+	int needed = process->job->threads, row, column, free_slots, first = -1;
+	for (row = 0; needed > 0; row++) {
+		if (row == *rows) {
+			*matrix = (Process**) realloc(*matrix,
+					(*rows + 1) * cpu_count * sizeof(Process*));
+			memset(&(*matrix)[*rows * cpu_count], 0, cpu_count * sizeof(Process*));
+			++*rows;
+		}
+		for (free_slots = 0, column = 0; column < cpu_count; column++) {
+			free_slots += (*matrix)[row * cpu_count + column] == NULL;
+		}
+		if (free_slots == 0 || (process->job->gang && free_slots < needed)) {
+			continue;
+		}
+		for (column = 0; column < cpu_count && needed > 0; column++) {
+			if ((*matrix)[row * cpu_count + column] == NULL) {
+				(*matrix)[row * cpu_count + column] = process;
+				--needed;
+			}
+		}
+		if (first < 0) {
+			first = row;
+		}
+	}
+	process->job->placed = 1;
+	return first;
+}
+
+/*
+ * Function: print_cpu_stats
+ * Description: Prints the multi-CPU summary - throughput, utilization,
+ * fragmentation (CPUs idle while threads were waiting) and the work lost to
+ * partially scheduled coupled jobs.
+ */
+void print_cpu_stats() {
+	long long total = cpu_stats.busy + cpu_stats.idle;
+	char makespan[32], lost[32];
+	format_ticks(cpu_stats.makespan, makespan);
+	format_ticks(cpu_stats.lost_work / FULL_SPEED, lost);
+	printf("cpus: %d, jobs: %d, makespan: %s\n", cpu_count, cpu_stats.finished,
+			makespan);
+	if (cpu_stats.makespan > 0) {
+		printf("throughput: %.3f jobs/unit\n",
+				cpu_stats.finished / ticks_to_units(cpu_stats.makespan));
+	}
+	if (total > 0) {
+		printf("utilization: %.1f%%, fragmentation: %.1f%%\n",
+				100.0 * cpu_stats.busy / total,
+				100.0 * cpu_stats.fragmented / total);
+	}
+	printf("partial: %lld cpu-quanta, lost work: %s\n", cpu_stats.partial, lost);
+}
+
+/*
+ * Function: init_submit_queue
+ * Description: Prepares the job submission queue. The queue always holds at
+ * least the stub node, so producers never have to deal with an empty queue.
+ */
+void init_submit_queue() {
+	atomic_init(&submit_queue.stub.submit_next, NULL);
+	atomic_init(&submit_queue.tail, &submit_queue.stub);
+	atomic_init(&submit_queue.producers, 0);
+	submit_queue.head = &submit_queue.stub;
+}
+
+/*
+ * Function: attach_producers
+ * Parameter(s): count - number of producers joining the queue
+ * Description: Registers producers with the submission queue. The queue is
+ * considered closed once every attached producer has detached again.
+ */
+void attach_producers(int count) {
+	atomic_fetch_add_explicit(&submit_queue.producers, count,
+			memory_order_relaxed);
+}
+
+/*
+ * Function: detach_producer
+ * Description: Signals that the calling producer will not submit any more
+ * jobs. Release ordering publishes all of its submissions to the consumer.
+ */
+void detach_producer() {
+	atomic_fetch_sub_explicit(&submit_queue.producers, 1,
+			memory_order_release);
+}
+
+/*
+ * Function: submit_process
+ * Parameter(s): process - the process to hand over to the scheduler
+ * Description: Lock-free submission, safe to call from any number of threads.
+ * A single exchange on the tail orders the producers, so a submission never
+ * blocks or retries regardless of contention.
+ */
+void submit_process(Process *process) {
+	Process *prev;
+	atomic_store_explicit(&process->submit_next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&submit_queue.tail, process,
+			memory_order_acq_rel);
+	atomic_store_explicit(&prev->submit_next, process, memory_order_release);
+}
+
+/*
+ * Function: pop_submission
+ * Returns: the oldest fully linked submission, NULL if there is none
+ * Description: Consumer side of the submission queue, only the simulation
+ * thread may call it. A producer caught between its exchange and its link
+ * store hides the nodes behind it until the next event boundary.
+ */
+Process *pop_submission() {
+	Process *head = submit_queue.head, *next = atomic_load_explicit(
+			&head->submit_next, memory_order_acquire);
+	if (head == &submit_queue.stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		submit_queue.head = head = next;
+		next = atomic_load_explicit(&head->submit_next, memory_order_acquire);
+	}
+	if (next != NULL) {
+		submit_queue.head = next;
+		return head;
+	}
+	if (head != atomic_load_explicit(&submit_queue.tail, memory_order_acquire)) {
+		return NULL;
+	}
+	// head is the last node, re-insert the stub behind it so it can be detached
+	submit_process(&submit_queue.stub);
+	next = atomic_load_explicit(&head->submit_next, memory_order_acquire);
+	if (next != NULL) {
+		submit_queue.head = next;
+		return head;
+	}
+	return NULL;
+}
+
+/*
+ * Function: admit_jobs
+ * Parameter(s): timer - current simulation time
+ * Returns: 0 once all jobs are processed and the submission queue is closed
+ * Description: Drains pending submissions and merges them into the arrival
+ * ordered job list. Admission is deterministic: it waits until no producer
+ * has a job left arriving by the end of the quantum holding the next
+ * arrival, which a scheduler may idle up to, nor before the first arrival
+ * after that, which the energy policy looks ahead to. So the schedule does
+ * not depend on thread timing. Jobs parked on other run queues (see
+ * FAIR_scheduler) still count as something to schedule.
+ */
+int admit_jobs(Tick timer) {
+	Process *batch, *last, *process;
+	Tick pending, reach, horizon;
+	int closed, settled;
+	while (1) {
+		// Closed state and producer progress are read before draining, every
+		// submission made before that is visible once the queue has settled.
+		closed = !atomic_load_explicit(&submit_queue.producers,
+				memory_order_acquire);
+		pending = earliest_pending();
+		batch = last = NULL;
+		while ((process = pop_submission()) != NULL) {
+			process->next = NULL;
+			if (last == NULL) {
+				batch = process;
+			} else {
+				last->next = process;
+			}
+			last = process;
+		}
+		// A producer caught between its exchange and its link hides the rest
+		settled = atomic_load_explicit(&submit_queue.tail, memory_order_acquire)
+				== submit_queue.head;
+		merge_batch(batch);
+		count_arrivals(timer);
+		process = arrival_cursor;
+		if (process != NULL) {
+			reach = process->job->arrival_time + time_quantum - 1;
+			while (process != NULL && process->job->arrival_time <= reach) {
+				process = process->next;
+			}
+		}
+		horizon = process != NULL ? process->job->arrival_time : NO_ARRIVAL;
+		if (closed || (settled && (pending > horizon
+				|| pending == NO_ARRIVAL))) {
+			break;
+		}
+		sched_yield();
+	}
+	return head_link != NULL || parked_jobs > 0;
+}
+
+/*
+ * Function: merge_batch
+ * Parameter(s): batch - singly linked list of freshly admitted processes
+ * Description: Sorts the batch and merges it into the sorted job list,
+ * relinking prev pointers. New jobs already due count as ready work and
+ * the arrival cursor moves to the first job arriving later.
+ */
+void merge_batch(Process *batch) {
+	Process *process, *current, *merged = NULL, *tail = NULL;
+	if (batch == NULL) {
+		return;
+	}
+	batch = sort_batch(batch);
+	current = head_link;
+	arrival_cursor = NULL;
+	while (current != NULL || batch != NULL) {
+		if (batch == NULL || (current != NULL && !arrives_before(batch, current))) {
+			process = current, current = current->next;
+		} else {
+			process = batch, batch = batch->next;
+			if (process->job->arrival_time <= arrived_until) {
+				ready_work += process->job->run_time;
+			}
+		}
+		if (arrival_cursor == NULL
+				&& process->job->arrival_time > arrived_until) {
+			arrival_cursor = process;
+		}
+		process->prev = tail;
+		if (tail == NULL) {
+			merged = process;
+		} else {
+			tail->next = process;
+		}
+		tail = process;
+	}
+	tail->next = NULL;
+	head_link = merged;
+}
+
+/*
+ * Function: earliest_pending
+ * Returns: the earliest arrival time a producer still has to submit,
+ * NO_ARRIVAL if none
+ */
+Tick earliest_pending() {
+	Tick earliest = NO_ARRIVAL, arrival;
+	int counter;
+	for (counter = 0; producers != NULL && counter < producer_threads;
+			counter++) {
+		arrival = atomic_load_explicit(&producers[counter].next_arrival,
+				memory_order_acquire);
+		if (arrival < earliest) {
+			earliest = arrival;
+		}
+	}
+	return earliest;
+}
+
+/*
+ * Function: sort_batch
+ * Parameter(s): batch - singly linked list of freshly admitted processes
+ * Returns: the batch sorted by arrival time, ties broken by id
+ * Description: Utility function - bottom up merge sort over the 'next' links.
+ * Input may not be in sorted order, and batches can be large.
+ */
+Process *sort_batch(Process *batch) {
+	Process *left, *right, *tail, *rest, *merged;
+	int width, count, left_size, right_size;
+	if (batch == NULL) {
+		return NULL;
+	}
+	for (width = 1;; width *= 2) {
+		rest = batch, merged = tail = NULL, count = 0;
+		while (rest != NULL) {
+			++count;
+			left = rest;
+			for (left_size = 0; rest != NULL && left_size < width; left_size++) {
+				rest = rest->next;
+			}
+			right = rest;
+			for (right_size = 0; rest != NULL && right_size < width;
+					right_size++) {
+				rest = rest->next;
+			}
+			while (left_size > 0 || (right_size > 0 && right != NULL)) {
+				Process *pick;
+				if (left_size == 0 || (right_size > 0 && right != NULL
+						&& arrives_before(right, left))) {
+					pick = right, right = right->next, --right_size;
+				} else {
+					pick = left, left = left->next, --left_size;
+				}
+				if (tail == NULL) {
+					merged = pick;
+				} else {
+					tail->next = pick;
+				}
+				tail = pick;
+			}
+		}
+		tail->next = NULL;
+		batch = merged;
+		if (count <= 1) {
+			return batch;
+		}
+	}
+}
+
+/*
+ * Function: arrives_before
+ * Parameter(s): first, second - processes to compare
+ * Returns: 1 if 'first' is ordered strictly ahead of 'second'
+ * Description: Job list ordering - arrival time, then lowest id.
+ */
+int arrives_before(const Process *first, const Process *second) {
+	return first->job->arrival_time < second->job->arrival_time
+			|| (first->job->arrival_time == second->job->arrival_time
+					&& first->job->id < second->job->id);
+}
+
+/*
+ * Function: compare_arrival
+ * Description: qsort comparator - orders processes like the job list.
+ */
+int compare_arrival(const void *first, const void *second) {
+	const Process *left = *(Process* const *) first;
+	const Process *right = *(Process* const *) second;
+	return arrives_before(right, left) - arrives_before(left, right);
+}
+
+/*
+ * Function: replay_schedule
+ * Description: Real-execution mode. Every job becomes a stopped child process
+ * burning CPU; the simulated slices are then replayed on the wall clock by
+ * resuming (SIGCONT) and pausing (SIGSTOP) the children at the slice
+ * boundaries. Deadlines are absolute, so control latency never accumulates.
+ */
+void replay_schedule() {
+	Worker *workers = (Worker*) calloc(slice_count ? slice_count : 1,
+			sizeof(Worker));
+	int worker_count = 0, counter;
+	double nanos_per_tick = real_unit_ms * NANOS_PER_MILLI / ticks_per_unit;
+	long long origin, deadline;
+	Worker *worker;
+	clockid_t clock;
+	struct timespec cpu;
+
+	// One child per distinct job id
+	for (counter = 0; counter < slice_count; counter++) {
+		workers[worker_count++].id = slices[counter].id;
+	}
+	qsort(workers, worker_count, sizeof(Worker), compare_workers);
+	for (counter = 0; counter < worker_count; counter++) {
+		if (counter > 0 && workers[counter].id == workers[counter - 1].id) {
+			continue;
+		}
+		workers[counter].pid = spawn_worker();
+	}
+	for (counter = 1; counter < worker_count; counter++) {
+		if (workers[counter].id == workers[counter - 1].id) {
+			memmove(&workers[counter], &workers[counter + 1],
+					(worker_count - counter - 1) * sizeof(Worker));
+			--worker_count, --counter;
+		}
+	}
+
+	origin = now_nanos() + REPLAY_LEAD_NANOS;
+	for (counter = 0; counter < slice_count; counter++) {
+		worker = find_worker(workers, worker_count, slices[counter].id);
+		deadline = origin + (long long) (slices[counter].start * nanos_per_tick);
+		// Back to back slices of the same job need no signal at all
+		if (counter == 0 || slices[counter - 1].id != slices[counter].id
+				|| slices[counter - 1].end != slices[counter].start) {
+			sleep_until(deadline);
+			kill(worker->pid, SIGCONT);
+			slices[counter].real_start = now_nanos() - origin;
+		} else {
+			slices[counter].real_start = slices[counter - 1].real_end;
+		}
+		deadline = origin + (long long) (slices[counter].end * nanos_per_tick);
+		sleep_until(deadline);
+		if (counter + 1 == slice_count || slices[counter + 1].id != slices[counter].id
+				|| slices[counter + 1].start != slices[counter].end) {
+			kill(worker->pid, SIGSTOP);
+		}
+		slices[counter].real_end = now_nanos() - origin;
+	}
+
+	for (counter = 0; counter < worker_count; counter++) {
+		if (!clock_getcpuclockid(workers[counter].pid, &clock)
+				&& !clock_gettime(clock, &cpu)) {
+			workers[counter].cpu_time = cpu.tv_sec * 1000000000LL + cpu.tv_nsec;
+		}
+		kill(workers[counter].pid, SIGKILL);
+		waitpid(workers[counter].pid, NULL, 0);
+	}
+	print_replay(workers, worker_count);
+	free(workers);
+}
+
+/*
+ * Function: spawn_worker
+ * Returns: pid of a child which burns CPU, already in stopped state
+ * Description: Forks a CPU burning child and waits until it has stopped
+ * itself, so that it does not consume any CPU before its first slice.
+ * Children run at the lowest priority, so the controller is never kept
+ * off the CPU by the worker it has just resumed.
+ */
+pid_t spawn_worker() {
+	volatile unsigned long spin = 0;
+	int status;
+	pid_t pid = fork();
+	if (pid < 0) {
+		handle_error("Unable to fork worker process\n");
+	} else if (pid == 0) {
+		setpriority(PRIO_PROCESS, 0, 19);
+		raise(SIGSTOP);
+		while (1) {
+			++spin;
+		}
+	}
+	while (waitpid(pid, &status, WUNTRACED) < 0 && errno == EINTR)
+		;
+	return pid;
+}
+
+/*
+ * Function: find_worker
+ * Parameter(s): workers - workers sorted by job id
+ * count - no of workers
+ * id - job id to look up
+ * Returns: the worker running the given job
+ */
+Worker *find_worker(Worker *workers, int count, pid_t id) {
+	Worker key;
+	key.id = id;
+	return (Worker*) bsearch(&key, workers, count, sizeof(Worker),
+			compare_workers);
+}
+
+/*
+ * Function: compare_workers
+ * Description: qsort/bsearch comparator - orders workers by job id.
+ */
+int compare_workers(const void *first, const void *second) {
+	pid_t left = ((const Worker*) first)->id, right = ((const Worker*) second)->id;
+	return (left > right) - (left < right);
+}
+
+/*
+ * Function: now_nanos
+ * Returns: current monotonic time in nanoseconds
+ */
+long long now_nanos() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Function: sleep_until
+ * Parameter(s): deadline - absolute monotonic time in nanoseconds
+ * Description: Sleeps until the given absolute deadline, resuming after
+ * signal interruptions.
+ */
+void sleep_until(long long deadline) {
+	struct timespec until;
+	until.tv_sec = deadline / 1000000000LL;
+	until.tv_nsec = deadline % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+		;
+}
+
+/*
+ * Function: print_replay
+ * Parameter(s): workers - replayed workers with their consumed CPU time
+ * count - no of workers
+ * Description: Prints simulated and actual 'id, start, end' side by side,
+ * followed by drift statistics. Actual times are given in simulated time
+ * units, drift in milliseconds.
+ */
+void print_replay(Worker *workers, int count) {
+	double unit = real_unit_ms * NANOS_PER_MILLI, drift, start_sum = 0,
+			end_sum = 0, start_max = 0, end_max = 0, simulated = 0, consumed = 0;
+	double tick = unit / ticks_per_unit;
+	char start[32], end[32];
+	int counter;
+	printf("id, start, end, real start, real end\n");
+	for (counter = 0; counter < slice_count; counter++) {
+		printf("%d, %s, %s, %.3f, %.3f\n", slices[counter].id,
+				format_ticks(slices[counter].start, start),
+				format_ticks(slices[counter].end, end),
+				slices[counter].real_start / unit, slices[counter].real_end / unit);
+		drift = slices[counter].real_start - slices[counter].start * tick;
+		drift = drift < 0 ? -drift : drift;
+		start_sum += drift, start_max = drift > start_max ? drift : start_max;
+		drift = slices[counter].real_end - slices[counter].end * tick;
+		drift = drift < 0 ? -drift : drift;
+		end_sum += drift, end_max = drift > end_max ? drift : end_max;
+		simulated += (slices[counter].end - slices[counter].start) * tick;
+	}
+	for (counter = 0; counter < count; counter++) {
+		consumed += workers[counter].cpu_time;
+	}
+	if (slice_count > 0) {
+		printf("drift: start mean %.3f ms, max %.3f ms; end mean %.3f ms, "
+				"max %.3f ms\n", start_sum / slice_count / NANOS_PER_MILLI,
+				start_max / NANOS_PER_MILLI, end_sum / slice_count / NANOS_PER_MILLI,
+				end_max / NANOS_PER_MILLI);
+		printf("cpu: simulated %.3f ms, consumed %.3f ms (%.1f%%)\n",
+				simulated / NANOS_PER_MILLI, consumed / NANOS_PER_MILLI,
+				simulated > 0 ? 100 * consumed / simulated : 0);
+	}
+}
+
+/*
+ * Function: run_quantum
+ * Parameter(s): process - the process running for the next quantum
+ * timer - simulation time at which the quantum starts
+ * Returns: the amount of work done by the process in this quantum
+ * Description: Runs one quantum on the (first) CPU. With an energy policy the CPU
+ * picks a P-state first, the quantum does proportionally less work at lower
+ * frequencies and its energy is charged to the running job.
+ */
+Tick run_quantum(Process *process, Tick timer) {
+	Tick work = run_cpu_quantum(&cpus[0], process, timer);
+	ready_work -= work;
+	return work;
+}
+
+/*
+ * Function: run_cpu_quantum
+ * Parameter(s): cpu - the CPU running the quantum
+ * process - the process running for the next quantum
+ * timer - simulation time at which the quantum starts
+ * Returns: the amount of work done on this CPU in this quantum
+ * Description: Per-CPU body of run_quantum.
+ */
+Tick run_cpu_quantum(Cpu *cpu, Process *process, Tick timer) {
+	double energy;
+	if (energy_policy == NO_ENERGY) {
+		return time_quantum * FULL_SPEED;
+	}
+	close_idle_period(cpu);
+	cpu->pstate = select_pstate(timer);
+	energy = P_STATES[cpu->pstate].power * ticks_to_units(time_quantum);
+	process->job->energy += energy;
+	cpu->busy_energy += energy;
+	cpu->pstate_residency[cpu->pstate] += time_quantum;
+	cpu->busy_until = timer + time_quantum;
+	return time_quantum * P_STATES[cpu->pstate].frequency;
+}
+
+/*
+ * Function: account_idle
+ * Description: Accounts a quantum in which no job was ready to run. Idle
+ * quanta are collected into an idle period and charged once it ends.
+ */
+void account_idle() {
+	account_cpu_idle(&cpus[0]);
+}
+
+/*
+ * Function: account_cpu_idle
+ * Parameter(s): cpu - the idle CPU
+ * Description: Per-CPU body of account_idle.
+ */
+void account_cpu_idle(Cpu *cpu) {
+	if (energy_policy != NO_ENERGY) {
+		cpu->idle_run += time_quantum;
+	}
+}
+
+/*
+ * Function: close_idle_period
+ * Parameter(s): cpu - the CPU leaving idle
+ * Description: Charges a finished idle period to the deepest C-state whose
+ * target residency it covers; the simulation knows the period's length, so
+ * the idle governor is an oracle.
+ */
+void close_idle_period(Cpu *cpu) {
+	int state = 0;
+	if (cpu->idle_run <= 0) {
+		return;
+	}
+	while (state + 1 < C_STATE_COUNT
+			&& C_STATES[state + 1].target_residency * ticks_per_unit
+					<= cpu->idle_run) {
+		++state;
+	}
+	cpu->cstate_residency[state] += cpu->idle_run;
+	cpu->idle_energy += C_STATES[state].power * ticks_to_units(cpu->idle_run);
+	cpu->idle_run = 0;
+}
+
+/*
+ * Function: select_pstate
+ * Parameter(s): timer - current simulation time
+ * Returns: index of the P-state to run the next quantum at
+ * Description: Race to idle always runs flat out. Slow and steady stretches
+ * the ready backlog over the gap until the next arrival, using the slowest
+ * state that still finishes in time but never one slower than the most
+ * energy efficient state. The backlog is the running total of ready work,
+ * so it does not matter which queue a scheduler keeps its jobs on.
+ */
+int select_pstate(Tick timer) {
+	Tick horizon = -1;
+	int state, efficient = 0;
+	if (energy_policy == RACE_TO_IDLE) {
+		return 0;
+	}
+	for (state = 1; state < P_STATE_COUNT; state++) {
+		if (P_STATES[state].power * P_STATES[efficient].frequency
+				< P_STATES[efficient].power * P_STATES[state].frequency) {
+			efficient = state;
+		}
+	}
+	count_arrivals(timer);
+	if (arrival_cursor != NULL) {
+		horizon = arrival_cursor->job->arrival_time - timer;
+	}
+	if (horizon < 0) {
+		return efficient;
+	}
+	for (state = efficient; state > 0; state--) {
+		if (ready_work <= horizon * P_STATES[state].frequency) {
+			return state;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function: count_arrivals
+ * Parameter(s): timer - current simulation time
+ * Description: Adds the work of jobs arrived by 'timer' to the ready work,
+ * moving the arrival cursor past them.
+ */
+void count_arrivals(Tick timer) {
+	while (arrival_cursor != NULL
+			&& arrival_cursor->job->arrival_time <= timer) {
+		ready_work += arrival_cursor->job->run_time;
+		arrival_cursor = arrival_cursor->next;
+	}
+	if (timer > arrived_until) {
+		arrived_until = timer;
+	}
+}
+
+/*
+ * Function: record_job_energy
+ * Parameter(s): job - a finished job
+ * Description: Keeps the energy spent by a finished job for the report.
+ */
+void record_job_energy(Job *job) {
+	if (job_energy_count == job_energy_capacity) {
+		job_energy_capacity = job_energy_capacity ? job_energy_capacity * 2 : 64;
+		job_energy = (JobEnergy*) realloc(job_energy,
+				job_energy_capacity * sizeof(JobEnergy));
+	}
+	job_energy[job_energy_count].id = job->id;
+	job_energy[job_energy_count++].energy = job->energy;
+}
+
+/*
+ * Function: print_energy
+ * Description: Prints the energy report - energy per job, P-state and
+ * C-state residency, total energy and throughput per watt.
+ */
+void print_energy() {
+	Cpu *cpu = &cpus[0];
+	double total;
+	char buffer[32];
+	int counter, index;
+	// Fold every CPU into the first one, the report covers the whole machine
+	close_idle_period(cpu);
+	for (index = 1; index < cpu_count; index++) {
+		close_idle_period(&cpus[index]);
+		cpu->busy_energy += cpus[index].busy_energy;
+		cpu->idle_energy += cpus[index].idle_energy;
+		if (cpus[index].busy_until > cpu->busy_until) {
+			cpu->busy_until = cpus[index].busy_until;
+		}
+		for (counter = 0; counter < P_STATE_COUNT; counter++) {
+			cpu->pstate_residency[counter] += cpus[index].pstate_residency[counter];
+		}
+		for (counter = 0; counter < C_STATE_COUNT; counter++) {
+			cpu->cstate_residency[counter] += cpus[index].cstate_residency[counter];
+		}
+	}
+	total = cpu->busy_energy + cpu->idle_energy;
+	printf("energy policy: %s\n",
+			energy_policy == RACE_TO_IDLE ? "race to idle" : "slow and steady");
+	for (counter = 0; counter < job_energy_count; counter++) {
+		printf("job %d: %.3f mJ\n", job_energy[counter].id,
+				job_energy[counter].energy);
+	}
+	for (counter = 0; counter < P_STATE_COUNT; counter++) {
+		printf("P%d (%d%%): %s ms\n", counter,
+				P_STATES[counter].frequency * 100 / FULL_SPEED,
+				format_ticks(cpu->pstate_residency[counter], buffer));
+	}
+	for (counter = 0; counter < C_STATE_COUNT; counter++) {
+		printf("%s: %s ms\n", C_STATES[counter].name,
+				format_ticks(cpu->cstate_residency[counter], buffer));
+	}
+	printf("total: %.3f mJ (busy %.3f, idle %.3f) over %s ms\n", total,
+			cpu->busy_energy, cpu->idle_energy,
+			format_ticks(cpu->busy_until, buffer));
+	// jobs per second per watt reduces to jobs per joule
+	if (total > 0) {
+		printf("throughput per watt: %.3f jobs/s/W\n",
+				job_energy_count * 1000 / total);
+	}
+}
+
+/*
+ * Function: remove_process
+ * Parameter(s): process - the process who's allocated memory needs to be freed
+ * Description: Unlinks the passed process from the job list and frees its
+ * allocated space from heap.
+ */
+void remove_process(Process *process) {
+	unlink_process(process);
+	release_process(process);
+}
+
+/*
+ * Function: unlink_process
+ * Parameter(s): process - a process on the job list
+ * Description: Takes the passed process off the job list without freeing it.
+ * A job taken off before it was counted as arrived is counted now, it is
+ * ready wherever it goes.
+ */
+void unlink_process(Process *process) {
+	Process *temp = NULL;
+	if (process == arrival_cursor) {
+		ready_work += process->job->run_time;
+		arrival_cursor = process->next;
+	}
+	if (process->prev == NULL && process->next == NULL) {
+		head_link = NULL;
+	} else if (process->prev == NULL) {
+		temp = process->next;
+		temp->prev = NULL;
+		head_link = temp;
+	} else if (process->next == NULL) {
+		temp = process->prev;
+		temp->next = NULL;
+	} else {
+		temp = process->prev;
+		temp->next = process->next;
+		temp = process->next;
+		temp->prev = process->prev;
+	}
+	process->prev = process->next = NULL;
+}
+
+/*
+ * Function: release_process
+ * Parameter(s): process - a finished process, on no list anymore
+ * Description: Frees allocated space for the passed process from heap.
+ * A released process has finished, its energy is recorded first and the
+ * work it did past its end handed back to the ready work.
+ */
+void release_process(Process *process) {
+	ready_work -= process->job->run_time;
+	if (energy_policy != NO_ENERGY) {
+		record_job_energy(process->job);
+	}
+	free(process->job);
+	free(process);
+}
+
+/*
+ * Function: print_util
+ * Parameter(s): id - process id
+ * start_time - process start time
+ * end_time - process end time
+ * Description: Prints the process execution details. In real-execution mode
+ * the slice is only recorded, it is printed after the replay.
+ */
+void print_util(pid_t id, Tick start_time, Tick end_time) {
+	if (real_unit_ms > 0) {
+		if (slice_count == slice_capacity) {
+			slice_capacity = slice_capacity ? slice_capacity * 2 : 64;
+			slices = (Slice*) realloc(slices, slice_capacity * sizeof(Slice));
+		}
+		slices[slice_count].id = id;
+		slices[slice_count].start = start_time;
+		slices[slice_count++].end = end_time;
+		return;
+	}
+	char start[32], end[32];
+	printf("%d, %s, %s\n", id, format_ticks(start_time, start),
+			format_ticks(end_time, end));
+}
+
+/*
+ * Function: parse_ticks
+ * Parameter(s): string - a time in units, may carry a decimal fraction
+ * Returns: the time in ticks
+ * Description: Converts a time read as decimal text into ticks without going
+ * through floating point. Digits beyond the tick resolution are dropped.
+ * Times whose work (FULL_SPEED units per tick) would not fit a Tick are
+ * rejected.
+ */
+Tick parse_ticks(const char *string) {
+	Tick ticks = 0, scale = ticks_per_unit;
+	Tick limit = INT64_MAX / FULL_SPEED / ticks_per_unit - 1;
+	int negative = 0;
+	if (string == NULL) {
+		return 0;
+	}
+	while (isspace((unsigned char) *string)) {
+		++string;
+	}
+	if (*string == '-') {
+		negative = 1, ++string;
+	}
+	while (isdigit((unsigned char) *string)) {
+		if (ticks > (limit - (*string - '0')) / 10) {
+			handle_error("Time value out of range\n");
+		}
+		ticks = ticks * 10 + (*string++ - '0');
+	}
+	ticks *= ticks_per_unit;
+	if (*string == '.') {
+		++string;
+		while (isdigit((unsigned char) *string) && scale > 1) {
+			scale /= 10;
+			ticks += (*string++ - '0') * scale;
+		}
+	}
+	return negative ? -ticks : ticks;
+}
+
+/*
+ * Function: format_ticks
+ * Parameter(s): ticks - time to format
+ * buffer - storage for the text, 32 bytes are enough for any Tick
+ * Returns: the buffer
+ * Description: Formats ticks as time units. Whole units print as integers,
+ * anything else as an exact decimal without trailing zeros.
+ */
+char *format_ticks(Tick ticks, char *buffer) {
+	Tick fraction = ticks % ticks_per_unit, scale = ticks_per_unit;
+	int digits = 0, length;
+	if (fraction == 0) {
+		snprintf(buffer, 32, "%lld", (long long) (ticks / ticks_per_unit));
+		return buffer;
+	}
+	fraction = fraction < 0 ? -fraction : fraction;
+	while (scale > 1 && fraction % 10 == 0) {
+		fraction /= 10, scale /= 10;
+	}
+	while (scale > 1) {
+		scale /= 10, ++digits;
+	}
+	length = snprintf(buffer, 32, "%s%lld.", ticks < 0 ? "-" : "",
+			(long long) ((ticks < 0 ? -ticks : ticks) / ticks_per_unit));
+	buffer[length + digits] = '\0';
+	while (digits-- > 0) {
+		buffer[length + digits] = '0' + fraction % 10;
+		fraction /= 10;
+	}
+	return buffer;
+}
+
+/*
+ * Function: ticks_to_units
+ * Parameter(s): ticks - time to convert
+ * Returns: the time in units, for reporting only
  */
-void print_util(pid_t id, int start_time, int end_time) {
-	printf("%d, %d, %d\n", id, start_time, end_time);
+double ticks_to_units(Tick ticks) {
+	return (double) ticks / ticks_per_unit;
 }
 
 /*
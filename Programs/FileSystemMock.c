@@ -24,8 +24,15 @@
  /*
  * Description: A custom file system model to
  * showcase the general features of a modern file system. 
+ * Files are stored as extents in a tree per inode, directories nest and
+ * keep their entries in B+trees, and put deduplicates (and optionally
+ * compresses) file data. The volume lives in memory or in a mapped disk
+ * image with a write-ahead journal, and can be served to many clients at
+ * once over a Unix socket (see main for the options).
  */
 
+#define _GNU_SOURCE //-- copy_file_range, O_DIRECT
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -34,73 +41,692 @@
 #include <ctype.h>
 #include <regex.h>
 #include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h> //-- CRC32C instruction
+#endif
 
-#define FILE_SYSTEM_SIZE 1310720 //-- 10MB
-#define BLOCK_SIZE 2048 //-- Bytes
-#define DIRECTORY_SIZE 128
-#define TOTAL_BLOCKS (FILE_SYSTEM_SIZE/BLOCK_SIZE)
-#define MAX_FILE_SIZE 98304
-#define MAX_FILE_BLOCKS (MAX_FILE_SIZE/BLOCK_SIZE)
+#define DEFAULT_VOLUME_SIZE 1310720 //-- 1.25MB
+#define DEFAULT_BLOCK_SIZE 2048 //-- Bytes
+#define DEFAULT_DIRECTORY_SIZE 128
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define MAX_TOTAL_BLOCKS 0x7FFFF000 //-- Block numbers stay positive ints
+#define MAX_DIRECTORY_SIZE (1 << 24)
+#define INLINE_EXTENTS 4
+#define MAX_TREE_DEPTH 8
+#define BITS_PER_WORD 64
+#define WORDS(bits) (((uint64_t) (bits) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+#define ALIGN_UP(size, align) (((size) + (align) - 1) & ~((uint64_t) (align) - 1))
+#define PAGE_ALIGN(size) ALIGN_UP(size, 4096)
+#define MIN_CACHE_BLOCKS 64
+#define MAX_READ_AHEAD 64 //-- Blocks
+#define DIRECT_ALIGN 4096
+#define DIRECT_CHUNK (1 << 20) //-- Bytes staged per write while importing
+#define JOURNAL_PAGE 4096 //-- Unit of metadata logged by the journal
+#define JOURNAL_SEED 14695981039346656037ULL //-- FNV-1a offset basis
+#define DEFAULT_COMMIT_INTERVAL 1000 //-- Milliseconds
+#define NAME_PREFIX 24 //-- Bytes of a name kept in directory tree entries
+#define ROOT_DIRECTORY 0 //-- Inode of the root directory
+#define NO_BLOCK UINT32_MAX
+#define INDEXED_BLOCK 0x8000 //-- Reference flag: the block is in the content index
+#define MAX_SHARES 0x7FFF //-- Owners a block can have besides the first
+#define INDEX_PROBE 8 //-- Content index slots a hash may sit in
+#define MIN_INDEX_SLOTS 256
+#define CRC32C_POLYNOMIAL 0x82F63B78 //-- Reflected Castagnoli polynomial
+#define HASH_PRIME 11400714785074694791ULL //-- 2^64 / golden ratio
+#define CONTENT_TAG(hash) ((uint32_t) ((hash) >> 32) | 1) //-- Never 0
+#define COMPRESS_CLUSTER 65536 //-- Bytes of a file compressed together
+#define MIN_CLUSTER_BLOCKS 4
+#define CLUSTER_BLOCKS (COMPRESS_CLUSTER / block_size > MIN_CLUSTER_BLOCKS ? \
+		COMPRESS_CLUSTER / block_size : MIN_CLUSTER_BLOCKS)
+#define COMPRESS_SLACK 32 //-- Bytes past its end a decompressed cluster may touch
+#define COMPRESS_HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define MAX_CLUSTER (MIN_CLUSTER_BLOCKS * MAX_BLOCK_SIZE) //-- Bytes, any geometry
+#define MAX_BYPASS 64 //-- Clusters stored raw unseen after repeated failures
+#define COMPRESSED_EXTENT 0x80000000U //-- Extent length flag
+#define MAX_SPLICE 16 //-- Extents a write may put in place of part of one
+#define DEFRAG_STEP 1024 //-- Blocks the background compactor moves at a time
+#define DEFRAG_SCAN 4096 //-- Files it looks at at a time
+#define DEFRAG_INTERVAL 1000 //-- Milliseconds an idle server waits between steps
+#define HISTOGRAM_BUCKETS 8 //-- Powers of two, the last open ended
+#define INODE_LOCKS 1024 //-- File locks, inodes share them round robin
+#define LOOKUP_RETRIES 4 //-- Lockless directory searches before taking the lock
+#define MIN_WORKERS 4
+#define MAX_WORKERS 256
+#define IO_SLOTS 8 //-- Buffers of a thread's I/O engine
+#define IO_CHUNK DIRECT_CHUNK //-- Bytes per engine buffer
+#define IO_QUEUE 256 //-- Requests an engine has in flight at most
+#define IO_BATCH IO_SLOTS //-- Requests queued before they are submitted unasked
+#define IO_THREADS 4 //-- Threads serving an engine without io_uring
+//-- Blocks an extent covers in the file, and blocks it takes on disk.
+#define EXTENT_BLOCKS(extent) ((extent)->length & COMPRESSED_EXTENT ? \
+		(extent)->length & 0xFFFF : (extent)->length)
+#define STORED_BLOCKS(extent) ((extent)->length & COMPRESSED_EXTENT ? \
+		(extent)->length >> 16 & 0x7FFF : (extent)->length)
+//-- Node blocks a splice may take: a copy and a split per level, a new root.
+#define SPLICE_BLOCKS(depth) (2 * ((depth) + 1) + 1)
+#define EXTENT_CAPACITY ((block_size - sizeof(ExtentHeader)) / sizeof(Extent))
+#define HOT(inode) (&inode_hot[(inode) - directory]) //-- Inode in the table
+#define INODE_USED(index) \
+		(inode_map[(index) / BITS_PER_WORD] >> ((index) % BITS_PER_WORD) & 1)
+#define ENTRY_CAPACITY ((block_size - sizeof(EntryHeader)) \
+		/ sizeof(DirectoryEntry))
 
 typedef enum State {
 	NEGATIVE = -1, UNSET = 0, SET = 1
 } State;
 
+typedef enum FileType {
+	REGULAR_FILE = 0, DIRECTORY_FILE = 1
+} FileType;
+
 /*
  * Constants
  */
 const int BUFFER_SIZE = 600;
 const int MAX_FILE_NAME = 255;
-const int ARGS_SUPPORTED = 3;
+const int ARGS_SUPPORTED = 4;
 const int CUSCH_EXIT = 99;
+const int BATCH_FLUSH = 4096; //-- Commands between output flushes in batch mode
+const int LIST_PAGE = 1000; //-- Entries per listing, later ones are paged
 const char *PROMPT = "mfs>";
 const char *TOKENT_SPLR = " ";
 const char *NOT_FOUND = "%s: Command not found.\n";
 const char *FILE_NAME_REGEX = "^[a-zA-Z0-9.]{1,255}$";
+const char IMAGE_MAGIC[8] = "MAVFS10";
+const char JOURNAL_MAGIC[8] = "MAVJRNL";
 
 /*Custom types*/
+/*
+ * A run of 'length' blocks starting at block 'start' which holds the file's
+ * blocks from 'logical' on. In index nodes 'start' is the child node's block
+ * and 'logical' the first logical block below it. A compressed cluster has
+ * COMPRESSED_EXTENT set, the blocks it covers in the low 16 bits of
+ * 'length' and the blocks its packed form takes in the 15 above.
+ */
+typedef struct Extent {
+	uint32_t logical;
+	uint32_t start;
+	uint32_t length;
+} Extent;
+
+//-- Head of an extent tree node, the entries follow it directly. Like
+//-- directory nodes, nodes written before the last commit are copied when
+//-- a write changes them.
+typedef struct ExtentHeader {
+	uint16_t count;
+	uint16_t max;
+	uint16_t depth; //-- 0 for a leaf
+	uint16_t unused;
+	uint32_t generation;
+} ExtentHeader;
+
+/*
+ * Cold part of an inode: the full name and the block map, read once a file
+ * is opened. Whether an inode is in use is a bit of inode_map, the fields
+ * listings and lookups look at sit in the hot table alongside.
+ */
 typedef struct Inode {
-	short used;
 	char file_name[255];
-	unsigned long size;
-	time_t time_created;
-	int blocks[MAX_FILE_BLOCKS];
+	ExtentHeader tree;
+	Extent extents[INLINE_EXTENTS];
+	uint32_t parent; //-- Directory holding the entry
+	uint32_t root; //-- Directories: root node of the entry tree, or NO_BLOCK
 } Inode;
 
-typedef struct Directory {
-	struct Inode files[DIRECTORY_SIZE];
-} Directory;
+//-- Hot part of an inode, a few fit in a cache line. name_hash lets a lookup
+//-- reject a long name without reading it.
+typedef struct InodeHot {
+	uint64_t size; //-- Bytes, entries for a directory
+	time_t time_created;
+	uint32_t name_hash;
+	uint16_t type;
+	uint16_t unused;
+} InodeHot;
+
+//-- The inline entries double as the root node's entry array.
+_Static_assert(offsetof(Inode, extents) == offsetof(Inode, tree)
+		+ sizeof(ExtentHeader), "inline extents must follow the tree header");
+
+//-- Position of an in-order walk over the leaf extents of a file.
+typedef struct ExtentCursor {
+	ExtentHeader *nodes[MAX_TREE_DEPTH];
+	int positions[MAX_TREE_DEPTH];
+	int level;
+} ExtentCursor;
+
+/*
+ * Directory tree node, a block of entries sorted by name and inode. Leaf
+ * entries name a file; index entries carry the first key of the child
+ * they point to. A node written before the last commit is copied rather
+ * than changed, generation tells which commit wrote it.
+ */
+typedef struct EntryHeader {
+	uint16_t count;
+	uint16_t max;
+	uint16_t depth; //-- 0 for a leaf
+	uint16_t unused;
+	uint32_t generation;
+} EntryHeader;
+
+//-- Names longer than the prefix are compared in full through the inode.
+typedef struct DirectoryEntry {
+	char prefix[NAME_PREFIX];
+	uint32_t inode;
+	uint32_t child; //-- Index entries only
+} DirectoryEntry;
+
+typedef struct EntryCursor {
+	EntryHeader *nodes[MAX_TREE_DEPTH];
+	int positions[MAX_TREE_DEPTH];
+	int level;
+} EntryCursor;
+
+/*
+ * Content index entry: a stored block and the high half of its hash, the
+ * low half picks the slot. Empty slots have tag 0.
+ */
+typedef struct ContentSlot {
+	uint32_t tag;
+	uint32_t block;
+} ContentSlot;
+
+/*
+ * First page of a disk image. The regions that follow (bitmap, bitmap
+ * summary, block reference counts, inode bitmap, hot inode table, inode
+ * table, journal, content index, data blocks) each start on a page boundary,
+ * data blocks on a block boundary as well. Their sizes follow from the
+ * geometry chosen at format time.
+ */
+typedef struct Superblock {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t total_blocks;
+	uint32_t directory_size;
+	uint32_t next_fit;
+	int64_t free_blocks;
+	uint32_t inode_count; //-- Inodes in use
+	uint32_t inode_high; //-- Inodes at and past this index were never used
+	uint32_t index_slots; //-- A power of two
+	uint64_t logical_blocks; //-- Blocks of file data before sharing
+	uint64_t bitmap_offset;
+	uint64_t summary_offset;
+	uint64_t refs_offset;
+	uint64_t index_offset;
+	uint64_t inode_map_offset;
+	uint64_t hot_offset;
+	uint64_t inode_offset;
+	uint64_t journal_offset; //-- Also the size of the metadata in front of it
+	uint64_t journal_size;
+	uint64_t data_offset;
+	uint64_t image_size;
+	uint32_t generation; //-- Commits made, tags directory tree nodes
+	uint32_t compression; //-- SET: put compresses file data
+} Superblock;
+
+/*
+ * Journal record: the header, the numbers of the metadata pages it holds,
+ * padded to a page, then the page images in the same order. The checksum
+ * covers everything after the header.
+ */
+typedef struct JournalHeader {
+	char magic[8];
+	uint32_t page_count;
+	uint32_t unused;
+	uint64_t checksum;
+} JournalHeader;
+
+//-- Block cache slot, valid once it holds a block. Pinned slots are in use
+//-- by the command and are not evicted.
+typedef struct CacheSlot {
+	uint32_t block;
+	short valid;
+	short referenced;
+	short prefetched; //-- Read ahead and not asked for yet
+	int pins;
+} CacheSlot;
+
+typedef struct BlockCache {
+	int size; //-- Slots, 0 when the volume is mapped whole
+	int used;
+	int hand; //-- CLOCK hand
+	CacheSlot *slots;
+	unsigned char *buffers;
+	int *table; //-- Block hash to slot, NEGATIVE when empty
+	int table_size;
+	int *free_slots; //-- Stack of slots holding no block
+	int free_count;
+	uint32_t last_block; //-- For sequential read detection
+	int window; //-- Current read-ahead in blocks
+	uint64_t lookups, hits, read_ahead, evictions;
+} BlockCache;
+
+//-- Resident extent tree index node of cache mode, buffer NULL when empty.
+typedef struct NodeSlot {
+	uint32_t block;
+	short dirty;
+	unsigned char *buffer;
+} NodeSlot;
+
+//-- Block transfer queued on an I/O engine, slot is the engine buffer it
+//-- reads into or writes from.
+typedef struct IoRequest {
+	int fd;
+	short write;
+	short slot;
+	unsigned char *buffer;
+	size_t length;
+	uint64_t offset;
+} IoRequest;
+
+/*
+ * I/O engine of a thread in cache mode: an io_uring with the engine's
+ * buffers and the image registered, or where io_uring is missing a few
+ * threads doing the same transfers with pread and pwrite. A request uses
+ * the submission queue entry of its own index. Requests are waited for by
+ * buffer, pending and failed count them per buffer.
+ */
+typedef struct IoEngine {
+	int ring_fd; //-- NEGATIVE when the threads serve the requests
+	short fixed_buffers;
+	short fixed_file;
+	unsigned char *buffers; //-- IO_SLOTS buffers of IO_CHUNK bytes
+	void *rings[3]; //-- Submission ring, completion ring, submission entries
+	size_t ring_sizes[3];
+	unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned queued; //-- Entries not submitted yet
+	IoRequest requests[IO_QUEUE];
+	int free_requests[IO_QUEUE];
+	int free_count;
+	int in_flight;
+	int pending[IO_SLOTS];
+	short failed[IO_SLOTS];
+	pthread_t threads[IO_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	int queue[IO_QUEUE];
+	int queue_head, queue_count;
+	short stopping;
+} IoEngine;
+
+/*
+ * Client of server mode: its socket, through a stream buffering what the
+ * commands print, its current directory and the line being read.
+ */
+typedef struct Session {
+	FILE *output;
+	uint32_t directory;
+	char *input;
+	size_t filled;
+	struct Session *next;
+} Session;
+
+//-- Kept a cache line apart, so readers of different files do not contend.
+typedef struct InodeLock {
+	pthread_rwlock_t lock;
+} __attribute__((aligned(64))) InodeLock;
 
-Directory directory;
-unsigned char file_data[TOTAL_BLOCKS][2048];
-unsigned int used_space[TOTAL_BLOCKS];
+//-- Volume geometry, the format options until a volume is opened.
+uint32_t block_size = DEFAULT_BLOCK_SIZE;
+uint64_t total_blocks = DEFAULT_VOLUME_SIZE / DEFAULT_BLOCK_SIZE;
+uint32_t directory_size = DEFAULT_DIRECTORY_SIZE;
+//-- The metadata lives in one mapping, these point into it.
+Superblock *superblock;
+Inode *directory;
+//-- Bit set: inode in use. The hot fields of inode i are inode_hot[i].
+uint64_t *inode_map;
+InodeHot *inode_hot;
+unsigned char *file_data;
+//-- Bit set: block in use. Summary bit set: bitmap word has no free block.
+uint64_t *block_map;
+uint64_t *full_words;
+//-- Per block: owners besides the first, and INDEXED_BLOCK while the block
+//-- may be shared. 0 for free blocks.
+uint16_t *block_refs;
+ContentSlot *content_index;
+void *volume = MAP_FAILED;
+int image_fd = -1; //-- Kept open for in-kernel copies into the image
+int meta_fd = -1; //-- Buffered, for the journal and metadata write back
+uint64_t mapped_size;
+uint64_t data_size; //-- Size of the shared mapping of an image, else 0
+uint64_t cache_bytes; //-- Requested cache size, 0 maps the whole volume
+short compress_option; //-- mfs -z, a new volume compresses file data
+short compact_option; //-- mfs -a, an idle server defragments the volume
+uint32_t defrag_cursor; //-- Inode the next defragmentation step starts at
+uint32_t free_inode_hint; //-- No inode below this one is free
+BlockCache cache;
+__thread IoEngine *engine;
+const char *io_method; //-- How the first engine does I/O, NULL before one
+uint64_t io_requests, io_submissions;
+NodeSlot *node_table;
+int node_table_size, node_count, dirty_nodes;
+uint32_t shell_directory = ROOT_DIRECTORY;
+//-- The command's current directory and output: the shell's, or those of
+//-- the session a server worker is running it for.
+__thread uint32_t *working_directory = &shell_directory;
+__thread FILE *output;
+//-- Batch mode state: script name (NULL when interactive), current line and
+//-- number of failed commands.
+const char *batch_script;
+int batch_line;
+int batch_errors;
+//-- Journal state: metadata pages changed since the last commit, frees
+//-- waiting on it, and when the oldest of those changes was made.
+short journaling;
+uint64_t meta_pages;
+uint64_t *dirty_map;
+uint64_t dirty_count;
+unsigned char *page_list; //-- Record header and page numbers
+Extent *pending_frees;
+int pending_count, pending_capacity;
+int64_t pending_blocks;
+int64_t reserved_blocks; //-- Held back from files so a delete can copy its path
+struct timespec oldest_change;
+long commit_interval = DEFAULT_COMMIT_INTERVAL;
+//-- Server mode: socket path (NULL otherwise), worker threads, the
+//-- listening socket and epoll instance, and the connected sessions.
+const char *socket_path;
+int worker_count;
+int listen_fd = -1;
+int poll_fd = -1;
+Session *sessions;
+pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Locks. Commands that change the volume, and commits, hold update_lock.
+ * A directory tree change holds directory_lock for writing and leaves
+ * directory_sequence odd while it runs; listings and cache mode searches
+ * read under the lock, mapped volumes are searched without it. Files are
+ * read under their inode lock, which a delete takes before freeing them.
+ * The block cache and the index node table have a mutex each.
+ */
+pthread_mutex_t update_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t directory_lock;
+uint32_t directory_sequence;
+InodeLock inode_locks[INODE_LOCKS];
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*Function prototypes*/
 void execute_command(char *[]);
 void put(char *[]);
 void get(char *[]);
 void delete(char *);
-void list();
+void read_range(char *[]);
+void write_range(char *[], short);
+int parse_offset(const char *, uint64_t *);
+void list(char *[]);
+void print_file(int, const char *);
+void make_directory(char *);
+void remove_directory(char *);
+void change_directory(char *);
+void print_directory();
+void set_compression(char *);
 long disk_availability(short);
 void show_prompt(short);
 void print_message(char *);
+void flush_output();
 void split_string(char *, char *[]);
 int is_empty(const char *);
 int get_new_file_entry();
-int get_free_block();
+uint32_t next_inode(uint32_t, State);
+void set_inode_used(uint32_t, State);
+uint32_t name_hash(const char *);
+void open_volume(const char *);
+void close_volume();
+uint64_t plan_volume(Superblock *);
+void format_volume(uint64_t);
+uint64_t parse_size(const char *);
+unsigned char *block_data(uint32_t);
+int import_file(int, Inode *, uint64_t);
+int import_compressed(int, Inode *, uint64_t);
+int claim_run(Extent *, int64_t);
+int update_file(Inode *, uint64_t, const unsigned char *, size_t);
+int store_cluster(Inode *, Extent *, unsigned char *);
+int claim_blocks(Inode *, Extent *, int64_t);
+int load_block(uint32_t, unsigned char *);
+int store_blocks(uint32_t, const unsigned char *, uint32_t);
+int write_batch(struct iovec *, int, uint32_t, int, uint64_t);
+uint64_t content_hash(const unsigned char *, size_t);
+#if defined(__x86_64__)
+void crc_hardware(const unsigned char *, size_t, uint32_t *);
+#endif
+void crc_table(const unsigned char *, size_t, uint32_t *);
+uint32_t find_content(uint64_t);
+int same_content(uint32_t, const unsigned char *);
+void index_content(uint64_t, uint32_t);
+uint32_t find_run(uint64_t, const unsigned char *, uint32_t);
+size_t compress_cluster(const unsigned char *, size_t, unsigned char *, size_t);
+int decompress_cluster(const unsigned char *, size_t, unsigned char *, size_t);
+int expand_extent(Extent *, unsigned char *, short);
+int export_vector(int, struct iovec *, int);
+uint64_t journal_bytes(uint64_t);
+void open_journal();
+void close_journal();
+void log_range(const void *, size_t);
+void release_blocks(uint32_t, uint32_t);
+void free_run(uint32_t, uint32_t);
+void maybe_commit();
+void commit_journal();
+int write_vector(int, struct iovec *, int, uint64_t);
+uint64_t fnv_checksum(const void *, size_t, uint64_t);
+int replay_journal(int, Superblock *);
+void rebuild_volume();
+void mark_tree(ExtentHeader *);
+void mark_entries(uint32_t);
+void open_cache(const char *);
+void close_cache();
+uint32_t block_hash(uint32_t);
+int cache_lookup(uint32_t);
+void cache_insert(int, uint32_t);
+void cache_remove(int);
+int cache_victim();
+int cache_read(uint32_t, uint32_t);
+unsigned char *cache_buffer(int);
+void cache_unpin(int *, int, short);
+void cache_invalidate(uint32_t, uint32_t);
+unsigned char *node_buffer(uint32_t, short);
+void mark_node(uint32_t);
+void forget_node(uint32_t);
+void flush_nodes();
+void cache_statistics();
+IoEngine *open_engine();
+int start_ring(IoEngine *);
+void start_pool(IoEngine *);
+void *serve_io(void *);
+void close_engine();
+unsigned char *io_buffer(int);
+int queue_io(short, int, unsigned char *, size_t, uint64_t);
+void reap_io(IoEngine *, short);
+void complete_io(IoEngine *, int, int64_t);
+int wait_io(int);
+void submit_io();
+void settle_io();
+int drain_io();
+int transfer_io(short, int, unsigned char *, size_t, uint64_t);
+int stream_file(Inode *, int);
+void init_block_map();
+int allocate_extent(int, Extent *);
+int find_block(int, int, State);
+void set_block_range(int, int, State);
+void release_extents(Inode *);
+void init_extent_tree(Inode *);
+Extent *node_entries(ExtentHeader *);
+ExtentHeader *tree_node(uint32_t);
+ExtentHeader *edit_node(uint32_t);
+void free_node(uint32_t);
+int append_extent(Inode *, Extent *);
+int append_to_node(ExtentHeader *, Extent *, uint32_t *);
+int new_tree_node(int, uint32_t *);
+void release_node(ExtentHeader *);
+void release_spine(uint32_t);
+ExtentHeader *edit_extent_node(uint32_t *);
+int splice_extents(Inode *, Extent *, int);
+int splice_node(ExtentHeader *, Extent *, int, Extent *);
+int place_extents(ExtentHeader *, int, int, Extent *, int, Extent *);
+int extent_position(ExtentHeader *, uint32_t);
+Extent *lookup_extent(Inode *, uint32_t);
+Extent *first_extent(Inode *, ExtentCursor *);
+Extent *next_extent(ExtentCursor *);
+void defragment(char *);
+uint64_t defrag_step(uint64_t, uint32_t, uint32_t *);
+int file_fragments(Inode *, uint32_t *, uint32_t *, short *);
+int lowest_run(uint32_t, uint32_t, Extent *);
+int relocate_file(int, Extent *);
+int copy_blocks(uint32_t, uint32_t, uint32_t, unsigned char *);
+void print_fragmentation(const char *);
+void make_key(DirectoryEntry *, const char *, uint32_t);
+int compare_entry(const DirectoryEntry *, const char *, const DirectoryEntry *);
+int floor_entry(EntryHeader *, const DirectoryEntry *, const char *);
+DirectoryEntry *directory_entries(EntryHeader *);
+EntryHeader *entry_node(uint32_t);
+EntryHeader *edit_entry_node(uint32_t *);
+int new_entry_node(int, uint32_t *);
+int reserve_blocks(int64_t);
+int directory_insert(int, int);
+int insert_entry(uint32_t *, DirectoryEntry *, const char *, DirectoryEntry *);
+int place_entry(EntryHeader *, int, DirectoryEntry *, DirectoryEntry *);
+int directory_remove(int, int);
+int remove_entry(uint32_t *, DirectoryEntry *, const char *);
+DirectoryEntry *seek_entry(uint32_t, DirectoryEntry *, const char *,
+		EntryCursor *);
+DirectoryEntry *next_entry(EntryCursor *);
+int directory_find(int, const char *, short);
+int resolve_path(const char *, char *, char **);
+int lookup_path(const char *, short);
+int search_path(const char *, short);
+const char *check_name(const char *);
+int entry_count(EntryHeader *);
+void begin_directory_change();
+void end_directory_change();
+int directory_in_use(int);
+int lock_file(const char *);
+pthread_rwlock_t *inode_lock(int);
+void init_locks();
+int run_server();
+void *serve_clients(void *);
+void accept_clients();
+void serve_session(Session *);
+void serve_line(Session *, char *);
+void close_session(Session *);
+void stop_server();
 
 /*
  * Function: main
- * Returns: exit status of the program
+ * Parameter(s): built in parameters, 'mfs [-b block_size] [-s volume_size]
+ * [-d directory_size] [-f script] [-c cache_size] [-i commit_interval] [-z]
+ * [-l socket] [-w workers] [-a] [image]'. The geometry options only apply when
+ * a volume is formatted, an existing image keeps its own geometry, as does
+ * -z, which formats the volume with compression on. Sizes take a K, M, G
+ * or T suffix. '-f -' reads the script from stdin. The commit interval is
+ * in milliseconds, 0 commits after every command. -l serves the volume on
+ * a Unix socket instead of reading commands, with a worker thread per CPU
+ * (at least MIN_WORKERS) unless -w says otherwise. With -a the server
+ * defragments the volume a step at a time while it is idle.
+ * Returns: exit status of the program, a failure in batch mode if any
+ * command failed
  * Description: The main controller of the whole program,
  * connects with other functions and accomplishes the given task.
  */
-int main(void) {
+int main(int argc, char *argv[]) {
+	uint64_t volume_size = DEFAULT_VOLUME_SIZE, value;
+	int option, terminal;
+	FILE *input = stdin;
+	output = stdout;
+	while ((option = getopt(argc, argv, "b:s:d:f:c:i:zl:w:a")) != -1) {
+		value = optarg != NULL ? parse_size(optarg) : 0;
+		if (option == 'b' && value >= MIN_BLOCK_SIZE && value <= MAX_BLOCK_SIZE
+				&& (value & (value - 1)) == 0) {
+			block_size = value;
+		} else if (option == 's' && value > 0) {
+			volume_size = value;
+		} else if (option == 'd' && value > 0 && value <= MAX_DIRECTORY_SIZE) {
+			directory_size = value;
+		} else if (option == 'f') {
+			batch_script = optarg;
+		} else if (option == 'c' && value > 0) {
+			cache_bytes = value;
+		} else if (option == 'i' && isdigit((unsigned char) *optarg)
+				&& strspn(optarg, "0123456789") == strlen(optarg)) {
+			commit_interval = atol(optarg);
+		} else if (option == 'z') {
+			compress_option = SET;
+		} else if (option == 'l') {
+			socket_path = optarg;
+		} else if (option == 'w' && value > 0 && value <= MAX_WORKERS) {
+			worker_count = value;
+		} else if (option == 'a') {
+			compact_option = SET;
+		} else {
+			fprintf(stderr, "usage: %s [-b block_size] [-s volume_size] "
+					"[-d directory_size] [-f script] [-c cache_size] "
+					"[-i commit_interval] [-z] [-l socket] [-w workers] [-a] "
+					"[image]\n"
+					"block size is a power of two from %d to %d bytes, "
+					"at most %d files\n", argv[0], MIN_BLOCK_SIZE,
+					MAX_BLOCK_SIZE, MAX_DIRECTORY_SIZE);
+			return EXIT_FAILURE;
+		}
+	}
+	total_blocks = volume_size / block_size;
+	if (total_blocks == 0 || total_blocks > MAX_TOTAL_BLOCKS) {
+		fprintf(stderr, "%s: Volume must hold 1 to %d blocks.\n", argv[0],
+				MAX_TOTAL_BLOCKS);
+		return EXIT_FAILURE;
+	}
+	if (cache_bytes > 0 && optind >= argc) {
+		fprintf(stderr, "%s: The block cache needs a disk image.\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (batch_script != NULL && socket_path != NULL) {
+		fprintf(stderr, "%s: A server takes no script.\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (batch_script != NULL && strcmp(batch_script, "-")
+			&& (input = fopen(batch_script, "r")) == NULL) {
+		perror(batch_script);
+		return EXIT_FAILURE;
+	}
+	if (batch_script != NULL) {
+		//-- Errors are buffered as well, their line numbers place them in the
+		//-- script.
+		setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+		setvbuf(stderr, NULL, _IOFBF, 1 << 16);
+	}
+	init_locks();
+	open_volume(optind < argc ? argv[optind] : NULL);
+	if (socket_path != NULL) {
+		return run_server();
+	}
+	terminal = batch_script == NULL && isatty(fileno(input));
 	show_prompt(0);
 	char buffer[BUFFER_SIZE], *shell_args[ARGS_SUPPORTED];
-	while (fgets(buffer, BUFFER_SIZE, stdin)) {
+	//-- Nothing is left waiting on a commit while the user at a terminal is.
+	while ((!terminal || (commit_journal(), 1))
+			&& fgets(buffer, BUFFER_SIZE, input)) {
+		++batch_line;
+		if (batch_script != NULL && batch_line % BATCH_FLUSH == 0) {
+			fflush(NULL);
+		}
 		// If read input contains only newline/ is empty, do nothing and show prompt
 		// else if the last character is newline, replace it with null terminator. Doing so
 		// will help while splitting the read line.
@@ -115,64 +741,112 @@ int main(void) {
 		execute_command(shell_args);
 		show_prompt(0);
 	}
-	return EXIT_SUCCESS;
+	close_volume();
+	fflush(NULL);
+	return batch_errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /*
  * Function: execute_command
  * Parameter(s): shell_args - array of arguments read from command line
  * Description: A decision making function. Calls appropriate function based on
- * the command passed by User.
+ * the command passed by User. Commands that change the volume or the
+ * current directory run one at a time; the others run alongside them and
+ * commit only if nothing else holds the volume.
  */
 void execute_command(char *shell_args[]) {
-
+	short update = strcmp(shell_args[0], "get") && strcmp(shell_args[0], "list")
+			&& strcmp(shell_args[0], "pwd") && strcmp(shell_args[0], "df")
+			&& strcmp(shell_args[0], "cache") && strcmp(shell_args[0], "read")
+			&& (strcmp(shell_args[0], "compress") || shell_args[1] != NULL);
+	if (update) {
+		pthread_mutex_lock(&update_lock);
+	}
 	if (!strcmp(shell_args[0], "put")) {
 		put(shell_args);
 	} else if (!strcmp(shell_args[0], "get")) {
 		get(shell_args);
 	} else if (!strcmp(shell_args[0], "del")) {
 		delete(shell_args[1]);
+	} else if (!strcmp(shell_args[0], "read")) {
+		read_range(shell_args);
+	} else if (!strcmp(shell_args[0], "write")) {
+		write_range(shell_args, UNSET);
+	} else if (!strcmp(shell_args[0], "append")) {
+		write_range(shell_args, SET);
 	} else if (!strcmp(shell_args[0], "list")) {
-		list();
+		list(shell_args);
+	} else if (!strcmp(shell_args[0], "mkdir")) {
+		make_directory(shell_args[1]);
+	} else if (!strcmp(shell_args[0], "rmdir")) {
+		remove_directory(shell_args[1]);
+	} else if (!strcmp(shell_args[0], "cd")) {
+		change_directory(shell_args[1]);
+	} else if (!strcmp(shell_args[0], "pwd")) {
+		print_directory();
 	} else if (!strcmp(shell_args[0], "df")) {
 		disk_availability(1);
+	} else if (!strcmp(shell_args[0], "cache")) {
+		cache_statistics();
+	} else if (!strcmp(shell_args[0], "compress")) {
+		set_compression(shell_args[1]);
+	} else if (!strcmp(shell_args[0], "defrag")) {
+		defragment(shell_args[1]);
 	} else {
-		printf("%s%s: Command not found\n", PROMPT, shell_args[0]);
-		fflush(NULL);
+		char message[BUFFER_SIZE + 32];
+		snprintf(message, sizeof(message), "%s: Command not found",
+				shell_args[0]);
+		print_message(message);
+	}
+	if (update || pthread_mutex_trylock(&update_lock) == 0) {
+		flush_nodes();
+		maybe_commit();
+		pthread_mutex_unlock(&update_lock);
 	}
 }
 
 /*
  * Function: put
- * Parameter(s): args - array containing command parameters
+ * Parameter(s): args - array containing command parameters, 'put file
+ * [path]'
  * Description: Copies the given file from OS file system to the MAV file system.
+ * It is stored under its own name in the current directory unless a path
+ * is given; a path naming a directory keeps the file's name.
  */
 void put(char *args[]) {
+	char buffer[BUFFER_SIZE], message[BUFFER_SIZE + 32], *leaf;
+	const char *problem;
+	int parent, existing;
 
 	//-- Checks if the file name argument is missing or not.
 	if (args[1] == NULL) {
 		print_message("put error: File name missing.");
 		return;
 	}
-	//-- Checks if the file name length exceeds the predefined limit.
-	if (strlen(args[1]) > MAX_FILE_NAME) {
-		print_message("put error: File name too long.");
+	parent = resolve_path(args[2] != NULL ? args[2] : ".", buffer, &leaf);
+	if (parent >= 0 && leaf != NULL
+			&& (existing = directory_find(parent, leaf, SET)) >= 0
+			&& inode_hot[existing].type == DIRECTORY_FILE) {
+		parent = existing, leaf = NULL;
+	}
+	if (parent < 0) {
+		print_message("put error: Directory not found.");
 		return;
 	}
-
-	//-- Checks if the file name contains any invalid characters (i.e other than
-	//-- alphanumeric characters and periods.) using regex.
-	regex_t regex;
-	if (regcomp(&regex, FILE_NAME_REGEX, REG_EXTENDED) != 0) {
-		print_message("Failed to compile regex");
+	if (leaf == NULL) {
+		leaf = strrchr(args[1], '/') != NULL ? strrchr(args[1], '/') + 1 : args[1];
+	}
+	//-- Checks the name's length and characters (alphanumeric and periods).
+	if ((problem = check_name(leaf)) != NULL) {
+		snprintf(message, sizeof(message), "put error: %s", problem);
+		print_message(message);
 		return;
 	}
-	if (regexec(&regex, args[1], (size_t) 0, NULL, 0)) {
-		print_message("put error: Invalid file name.");
-		regfree(&regex);
+	existing = directory_find(parent, leaf, SET);
+	if (existing >= 0 && inode_hot[existing].type == DIRECTORY_FILE) {
+		print_message("put error: Is a directory.");
 		return;
 	}
-	regfree(&regex);
 
 	//-- Checks if the file is available in the OS file system.
 	struct stat buf;
@@ -181,18 +855,9 @@ void put(char *args[]) {
 		print_message("put error: File not found.");
 		return;
 	}
-	//-- Checks if the file exceeds the size supported by MAV file system.
-	unsigned long file_size = (int) buf.st_size;
-	if (file_size > MAX_FILE_SIZE) {
-		print_message("put error: Exceeds maximum supported file size.");
-		return;
-	}
-	//-- Checks if MAV disk has enough space to store the file.
-	unsigned long available_disk_space = disk_availability(0);
-	if (file_size > available_disk_space) {
-		print_message("put error: Not enough disk space.");
-		return;
-	}
+	//-- Files are only bounded by the space left on the MAV disk, shared
+	//-- blocks take none, so that is only known once the file is in.
+	uint64_t file_size = buf.st_size;
 
 	int file_entry_index = get_new_file_entry();
 	if (file_entry_index == -1) {
@@ -200,39 +865,49 @@ void put(char *args[]) {
 		return;
 	}
 
-	int counter = 0, offset = 0, new_block = 0;
-	long copy_size = file_size;
+	Inode *inode = &directory[file_entry_index];
+	InodeHot *hot = &inode_hot[file_entry_index];
 	// -- Open the input file read-only
 	// -- Copy file section. Reference: File read sample code provided by Prof. Trevor Bakker, UTArlington.
-	FILE *input_file = fopen(args[1], "r");
-	while (copy_size > 0) {
-
-		new_block = get_free_block();
-		//-- After each write, seek to the position which is yet to be written.
-		fseek(input_file, offset, SEEK_SET);
-		int bytes = fread(file_data[new_block], BLOCK_SIZE, 1, input_file);
-		if (bytes == 0 && !feof(input_file)) {
-			print_message(
-					"get error: An error occurred reading from the input file.");
-			return;
-		}
-		// -- Clear the EOF file flag.
-		clearerr(input_file);
-		copy_size -= BLOCK_SIZE;
-		offset += BLOCK_SIZE;
-		directory.files[file_entry_index].blocks[counter++] = new_block;
-		used_space[new_block] = SET;
-	}
-	//-- Close the file stream once usage is over.
-	fclose(input_file);
-	while (counter < MAX_FILE_BLOCKS) {
-		directory.files[file_entry_index].blocks[counter++] = NEGATIVE;
-	}
-	memcpy(directory.files[file_entry_index].file_name, args[1],
-			strlen(args[1]) + 1);
-	directory.files[file_entry_index].size = file_size;
-	directory.files[file_entry_index].time_created = time(NULL);
-	directory.files[file_entry_index].used = SET;
+	int input_file = open(args[1], O_RDONLY);
+	if (input_file < 0) {
+		print_message("put error: File not found.");
+		return;
+	}
+	init_extent_tree(inode);
+	status = import_file(input_file, inode, file_size);
+	//-- Close the file once usage is over.
+	close(input_file);
+	if (status < 0) {
+		print_message(status == -1 ? "put error: Not enough disk space." :
+				"put error: An error occurred reading from the input file.");
+		release_extents(inode);
+		return;
+	}
+	//-- Complete before the entry makes it visible to lockless lookups.
+	memcpy(inode->file_name, leaf, strlen(leaf) + 1);
+	hot->size = file_size;
+	hot->time_created = time(NULL);
+	hot->type = REGULAR_FILE;
+	inode->parent = parent;
+	set_inode_used(file_entry_index, SET);
+	if (directory_insert(parent, file_entry_index) < 0) {
+		print_message("put error: Not enough disk space.");
+		release_extents(inode);
+		inode->file_name[0] = '\0';
+		hot->size = 0;
+		hot->time_created = 0;
+		set_inode_used(file_entry_index, UNSET);
+		return;
+	}
+	superblock->logical_blocks += (file_size + block_size - 1) / block_size;
+	superblock->inode_count++;
+	if ((uint32_t) file_entry_index >= superblock->inode_high) {
+		superblock->inode_high = file_entry_index + 1;
+	}
+	log_range(inode, sizeof(Inode));
+	log_range(hot, sizeof(InodeHot));
+	log_range(superblock, sizeof(Superblock));
 }
 
 /*
@@ -240,7 +915,10 @@ void put(char *args[]) {
  * Parameter(s): args - array containing command parameters
  * Description: Copies the given file from MAV file system to the OS file system.
  * If a args array has a third parameter, the copied file will be assigned that parameter
- * as its name.
+ * as its name, else it keeps the name it has in the MAV file system.
+ * Compressed clusters are expanded into a buffer and written out with the
+ * blocks around them. In cache mode a file too big to be worth caching is
+ * streamed around the cache instead.
  */
 void get(char *args[]) {
 
@@ -248,46 +926,119 @@ void get(char *args[]) {
 		print_message("get error: File name not found");
 		return;
 	}
-	int counter = 0, index = -1;
-	while (counter < DIRECTORY_SIZE) {
-		if (!strcmp(directory.files[counter].file_name, args[1])) {
-			index = counter;
-		}
-		++counter;
-	}
+	//-- The newest entry of a duplicated name wins.
+	int index = lock_file(args[1]);
 	if (index < 0) {
 		print_message("get error: File not found");
 		return;
 	}
 
-	counter = 0;
-	int block_index = 0, num_bytes = 0;
-	long offset = 0, copy_size = directory.files[index].size;
-	char *copy_name = (args[2] == NULL) ? args[1] : args[2];
+	static __thread unsigned char *expanded;
+	Inode *inode = &directory[index];
+	uint64_t num_bytes = 0, copy_size = inode_hot[index].size;
+	ExtentCursor cursor;
+	Extent *extent;
+	struct iovec vector[IOV_MAX];
+	int pinned[IOV_MAX], count = 0, pins = 0, status = 0, slot;
+	//-- Gets running side by side share half the cache for their batches.
+	int share = cache.size / 2 / (worker_count > 0 ? worker_count : 1);
+	int batch = cache.size > 0 && share < IOV_MAX ? (share > 0 ? share : 1) :
+			IOV_MAX;
+	short scan = copy_size / block_size > (uint64_t) cache.size / 4;
+	uint64_t offset, piece, filled = 0;
+	char *copy_name = (args[2] == NULL) ? inode->file_name : args[2];
 	// -- Copy file section. Reference: File write sample code provided by Prof. Trevor Bakker, UTArlington.
-	FILE *output_file = fopen(copy_name, "w");
-	while (copy_size > 0) {
+	int output_file = open(copy_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (output_file < 0) {
+		pthread_rwlock_unlock(inode_lock(index));
+		print_message("get error: Unable to create the output file.");
+		return;
+	}
+	if (expanded == NULL && (expanded = malloc(DIRECT_CHUNK
+			+ COMPRESS_SLACK)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	if (cache.size > 0 && scan) {
+		status = stream_file(inode, output_file);
+		copy_size = 0;
+	}
+	for (extent = first_extent(inode, &cursor); extent != NULL && copy_size > 0;
+			extent = next_extent(&cursor)) {
 
-		// If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-		// only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
+		// If the remaining number of bytes we need to copy is less than the extent then
+		// only copy the amount that remains. If we copied the whole extent we'd
 		// end up with garbage at the end of the file.
-		if (copy_size < BLOCK_SIZE) {
+		num_bytes = (uint64_t) EXTENT_BLOCKS(extent) * block_size;
+		if (copy_size < num_bytes) {
 			num_bytes = copy_size;
-		} else {
-			num_bytes = BLOCK_SIZE;
 		}
-		block_index = directory.files[index].blocks[counter];
-		// -- Move the pointer in the output stream to the number of bytes already wrote.
-		fseek(output_file, offset, SEEK_SET);
-		//-- Write num_bytes number of bytes from our data array into our output file.
-		fwrite(file_data[block_index], num_bytes, 1, output_file);
-
-		copy_size -= BLOCK_SIZE;
-		offset += BLOCK_SIZE;
-		++counter;
+		if (extent->length & COMPRESSED_EXTENT) {
+			if (filled + (uint64_t) EXTENT_BLOCKS(extent) * block_size
+					> DIRECT_CHUNK) {
+				status = export_vector(output_file, vector, count);
+				cache_unpin(pinned, pins, scan);
+				count = 0, pins = 0, filled = 0;
+			}
+			if (status == 0) {
+				status = expand_extent(extent, expanded + filled, scan);
+			}
+			if (status < 0) {
+				break;
+			}
+			vector[count].iov_base = expanded + filled;
+			vector[count].iov_len = num_bytes;
+			filled += (uint64_t) EXTENT_BLOCKS(extent) * block_size;
+			copy_size -= num_bytes;
+			if (++count == batch) {
+				status = export_vector(output_file, vector, count);
+				cache_unpin(pinned, pins, scan);
+				count = 0, pins = 0, filled = 0;
+			}
+			continue;
+		}
+		//-- Extents are gathered straight from the volume, IOV_MAX of them
+		//-- per write. In cache mode every block is a cache buffer of its
+		//-- own, pinned until written.
+		for (offset = 0; offset < num_bytes && status == 0; offset += piece) {
+			piece = num_bytes - offset;
+			if (cache.size == 0) {
+				vector[count].iov_base = block_data(extent->start);
+			} else {
+				piece = piece < block_size ? piece : block_size;
+				slot = cache_read(extent->start + offset / block_size,
+						extent->length - offset / block_size);
+				if (slot == NEGATIVE) {
+					status = -2;
+					break;
+				}
+				pinned[pins++] = slot;
+				vector[count].iov_base = cache_buffer(slot);
+			}
+			vector[count].iov_len = piece;
+			if (++count == batch) {
+				status = export_vector(output_file, vector, count);
+				cache_unpin(pinned, pins, scan);
+				count = 0, pins = 0, filled = 0;
+			}
+		}
+		copy_size -= num_bytes;
+		if (status < 0) {
+			break;
+		}
 	}
-	// -- After the output stream usage is done, close it
-	fclose(output_file);
+	if (count > 0 && status == 0) {
+		status = export_vector(output_file, vector, count);
+	}
+	cache_unpin(pinned, pins, scan);
+	if (status == -2) {
+		print_message("get error: An error occurred reading the volume.");
+	} else if (status < 0) {
+		print_message("get error: An error occurred writing the output file.");
+	}
+	// -- After the output file usage is done, close it
+	close(output_file);
+	pthread_rwlock_unlock(inode_lock(index));
 }
 
 /*
@@ -297,62 +1048,267 @@ void get(char *args[]) {
  */
 void delete(char *file_name) {
 
-	int counter = 0, index = -1;
-	while (counter < DIRECTORY_SIZE) {
-		if (!strcmp(directory.files[counter].file_name, file_name)) {
-			index = counter;
-			break;
-		}
-		++counter;
-	}
+	int index = file_name == NULL ? NEGATIVE : lookup_path(file_name, UNSET);
 	if (index < 0) {
 		print_message("del error: File not found.");
 		return;
 	}
+	if (inode_hot[index].type == DIRECTORY_FILE) {
+		print_message("del error: Is a directory.");
+		return;
+	}
+	if (directory_remove(directory[index].parent, index) < 0) {
+		print_message("del error: Not enough disk space.");
+		return;
+	}
 
-	counter = 0;
-	int block_num = directory.files[index].blocks[counter];
-	// -- clear out the blocks used by the Inode entry
-	while (block_num > -1) {
+	// -- clear out the blocks used by the Inode entry, once the gets still
+	// -- reading it are done
+	pthread_rwlock_wrlock(inode_lock(index));
+	release_extents(&directory[index]);
+	superblock->logical_blocks -= (inode_hot[index].size + block_size - 1)
+			/ block_size;
+	inode_hot[index].size = 0;
+	inode_hot[index].time_created = 0;
+	set_inode_used(index, UNSET);
+	directory[index].file_name[0] = '\0';
+	pthread_rwlock_unlock(inode_lock(index));
+	superblock->inode_count--;
+	log_range(&directory[index], sizeof(Inode));
+	log_range(&inode_hot[index], sizeof(InodeHot));
+	log_range(superblock, sizeof(Superblock));
+}
 
-		file_data[block_num][0] = '\0';
-		used_space[block_num] = UNSET;
-		directory.files[index].blocks[counter] = UNSET;
-		block_num = directory.files[index].blocks[++counter];
+/*
+ * Function: read_range
+ * Parameter(s): args - array containing command parameters, 'read name
+ * offset length'
+ * Description: Prints the bytes of the file from the offset on, fewer if
+ * the file ends first, and a new line. Only the blocks holding them are
+ * read; a compressed cluster is expanded whole.
+ */
+void read_range(char *args[]) {
+	static __thread unsigned char *expanded;
+	uint64_t offset, length, end, position, piece, first;
+	uint32_t logical;
+	Extent *extent;
+	Inode *inode;
+	int index, slot, status = 0;
+	if (args[1] == NULL || !parse_offset(args[2], &offset)
+			|| !parse_offset(args[3], &length)) {
+		print_message("read error: Usage is read name offset length.");
+		return;
+	}
+	index = lock_file(args[1]);
+	if (index < 0) {
+		print_message("read error: File not found.");
+		return;
+	}
+	if (expanded == NULL && (expanded = malloc(MAX_CLUSTER
+			+ COMPRESS_SLACK)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	inode = &directory[index];
+	end = offset > inode_hot[index].size ? offset : inode_hot[index].size;
+	end = length < end - offset ? offset + length : end;
+	for (position = offset; position < end && status == 0; position += piece) {
+		logical = position / block_size;
+		extent = lookup_extent(inode, logical);
+		if (extent == NULL) {
+			status = -2;
+			break;
+		}
+		first = (uint64_t) extent->logical * block_size;
+		piece = first + (uint64_t) EXTENT_BLOCKS(extent) * block_size - position;
+		piece = piece < end - position ? piece : end - position;
+		if (extent->length & COMPRESSED_EXTENT) {
+			status = expand_extent(extent, expanded, UNSET);
+			if (status == 0) {
+				fwrite(expanded + (position - first), 1, piece, output);
+			}
+		} else if (cache.size == 0) {
+			fwrite(block_data(extent->start) + (position - first), 1, piece,
+					output);
+		} else {
+			//-- A block at a time, each through the cache.
+			piece = piece < block_size - position % block_size ? piece :
+					block_size - position % block_size;
+			slot = cache_read(extent->start + (logical - extent->logical),
+					extent->length - (logical - extent->logical));
+			if (slot == NEGATIVE) {
+				status = -2;
+				break;
+			}
+			fwrite(cache_buffer(slot) + position % block_size, 1, piece, output);
+			cache_unpin(&slot, 1, UNSET);
+		}
+	}
+	fprintf(output, "\n");
+	pthread_rwlock_unlock(inode_lock(index));
+	if (status < 0) {
+		print_message("read error: An error occurred reading the volume.");
 	}
-	directory.files[index].size = 0;
-	directory.files[index].time_created = 0;
-	directory.files[index].used = UNSET;
-	directory.files[index].file_name[0] = '\0';
+	flush_output();
 }
 
 /*
- * Function: list
- * Description: Lists files and its details in the MAV file system.
+ * Function: write_range
+ * Parameter(s): args - array containing command parameters, 'write name
+ * offset < data' or 'append name < data'
+ * append - SET for append, which writes at the end of the file
+ * Description: Writes the data over the file from the offset on, growing
+ * the file if it runs past the end. Offsets past the end are refused,
+ * files have no holes. Only the blocks the data falls in are written;
+ * blocks shared with other files, and tree nodes from before the last
+ * commit, are copied before they change.
  */
-void list() {
-	int counter = 0, list_counter = 0;
-	struct tm *time_info;
-	char timeString[15];
-	Inode file;
+void write_range(char *args[], short append) {
+	const char *command = append ? "append" : "write";
+	char *data = append ? args[2] : args[3], message[64];
+	uint64_t offset = 0;
+	int index, status;
+	Inode *inode;
+	if (args[1] == NULL || data == NULL
+			|| (!append && !parse_offset(args[2], &offset))) {
+		snprintf(message, sizeof(message), "%s error: Usage is %s name %s< data.",
+				command, command, append ? "" : "offset ");
+		print_message(message);
+		return;
+	}
+	index = lookup_path(args[1], SET);
+	if (index < 0 || inode_hot[index].type == DIRECTORY_FILE) {
+		snprintf(message, sizeof(message), "%s error: File not found.", command);
+		print_message(message);
+		return;
+	}
+	//-- Gets of the file wait, deletes run one at a time with this.
+	pthread_rwlock_wrlock(inode_lock(index));
+	inode = &directory[index];
+	offset = append ? inode_hot[index].size : offset;
+	if (offset > inode_hot[index].size) {
+		pthread_rwlock_unlock(inode_lock(index));
+		snprintf(message, sizeof(message),
+				"%s error: Offset past the end of the file.", command);
+		print_message(message);
+		return;
+	}
+	status = update_file(inode, offset, (unsigned char*) data, strlen(data));
+	pthread_rwlock_unlock(inode_lock(index));
+	if (status < 0) {
+		snprintf(message, sizeof(message), "%s error: %s", command,
+				status == -1 ? "Not enough disk space." :
+						"An error occurred writing the volume.");
+		print_message(message);
+	}
+}
 
-	// -- Iterate the directory array and list the valid entries.
-	while (counter < DIRECTORY_SIZE) {
-		if (directory.files[counter].used == SET) {
+/*
+ * Function: parse_offset
+ * Parameter(s): text - decimal number, optionally suffixed K, M, G or T
+ * value - receives the number
+ * Returns: SET if the text is a valid number, 0 included.
+ */
+int parse_offset(const char *text, uint64_t *value) {
+	if (text == NULL) {
+		return UNSET;
+	}
+	*value = parse_size(text);
+	return *value > 0 || (*text != '\0' && strspn(text, "0") == strlen(text));
+}
 
-			file = directory.files[counter];
-			time_info = localtime(&file.time_created);
-			strftime(timeString, sizeof(timeString), "%b %d %R", time_info);
-			printf("%5lu %s %s\n", file.size, timeString, file.file_name);
-			fflush(NULL);
-			++list_counter;
+/*
+ * Function: lock_file
+ * Parameter(s): path - file to read
+ * Returns: Inode of the newest file of that name, its lock held for reading
+ * until the caller is done, NEGATIVE if there is no such file.
+ * Description: The path is looked up again once the lock is held. A delete
+ * takes the lock after removing the entry, so a file still found then
+ * keeps its blocks until it is unlocked.
+ */
+int lock_file(const char *path) {
+	int index;
+	while ((index = lookup_path(path, SET)) >= 0
+			&& inode_hot[index].type != DIRECTORY_FILE) {
+		pthread_rwlock_rdlock(inode_lock(index));
+		if (lookup_path(path, SET) == index
+				&& inode_hot[index].type != DIRECTORY_FILE) {
+			return index;
+		}
+		pthread_rwlock_unlock(inode_lock(index));
+	}
+	return NEGATIVE;
+}
+
+/*
+ * Function: inode_lock
+ * Parameter(s): index - inode of a file
+ * Returns: The reader-writer lock guarding the file's blocks.
+ */
+pthread_rwlock_t *inode_lock(int index) {
+	return &inode_locks[index & (INODE_LOCKS - 1)].lock;
+}
+
+/*
+ * Function: list
+ * Parameter(s): args - array containing command parameters, 'list [path]
+ * [name]'
+ * Description: Lists a file, or the entries of a directory in name order,
+ * the current one by default. Long directories are listed a page at a time;
+ * a name picks up the listing from there without walking the entries
+ * before it. Directories are held still while listed. A listing reads the
+ * hot inode table only, names which fit their entry's prefix are printed
+ * from there.
+ */
+void list(char *args[]) {
+	int index, counter = 0;
+	DirectoryEntry key, *entry;
+	EntryCursor cursor;
+	const char *from = args[1] != NULL && args[2] != NULL ? args[2] : "";
+	pthread_rwlock_rdlock(&directory_lock);
+	index = search_path(args[1] != NULL ? args[1] : ".", SET);
+	if (index < 0) {
+		pthread_rwlock_unlock(&directory_lock);
+		print_message("list error: File not found.");
+		return;
+	}
+	if (inode_hot[index].type != DIRECTORY_FILE) {
+		print_file(index, directory[index].file_name);
+	} else if (directory[index].root != NO_BLOCK) {
+		make_key(&key, from, 0);
+		seek_entry(directory[index].root, &key, from, &cursor);
+		for (entry = next_entry(&cursor); entry != NULL && counter < LIST_PAGE;
+				entry = next_entry(&cursor), counter++) {
+			print_file(entry->inode, entry->prefix[NAME_PREFIX - 1] == '\0' ?
+					entry->prefix : directory[entry->inode].file_name);
+		}
+		if (entry != NULL) {
+			fprintf(output, "list: More from %s.\n",
+					directory[entry->inode].file_name);
 		}
-		++counter;
 	}
-	if (list_counter < 1) {
-		printf("list: No files found.\n");
-		fflush(NULL);
+	if (inode_hot[index].type == DIRECTORY_FILE && counter == 0) {
+		fprintf(output, "list: No files found.\n");
 	}
+	pthread_rwlock_unlock(&directory_lock);
+	flush_output();
+}
+
+/*
+ * Function: print_file
+ * Parameter(s): index - inode of a file or directory
+ * name - its name
+ * Description: Prints one line of a listing, directories with their number
+ * of entries and a trailing slash.
+ */
+void print_file(int index, const char *name) {
+	struct tm time_info;
+	char timeString[15];
+	InodeHot *file = &inode_hot[index];
+	localtime_r(&file->time_created, &time_info);
+	strftime(timeString, sizeof(timeString), "%b %d %R", &time_info);
+	fprintf(output, "%5llu %s %s%s\n", (unsigned long long) file->size,
+			timeString, name, file->type == DIRECTORY_FILE ? "/" : "");
 }
 
 /*
@@ -360,20 +1316,23 @@ void list() {
  * Parameter(s): print - flag which decides to print the disk availability
  * to the screen.
  * Returns: The size of available disk space.
- * Description: Calculates the free space available in the MAV file system.
+ * Description: Calculates the free space available in the MAV file system
+ * from the running free block count, blocks waiting on a commit included
+ * and blocks held back for directory changes not. The printed report adds
+ * the space files take before sharing (logical) against the blocks in use
+ * (physical, index and directory blocks included).
  */
 long disk_availability(short print) {
-	int counter = 0;
-	unsigned long free_size = 0;
-	while (counter < TOTAL_BLOCKS) {
-		if (used_space[counter] == 0) {
-			free_size += BLOCK_SIZE;
-		}
-		++counter;
-	}
+	int64_t blocks = superblock->free_blocks + pending_blocks - reserved_blocks;
+	unsigned long free_size = (unsigned long) (blocks > 0 ? blocks : 0)
+			* block_size;
+	uint64_t physical = total_blocks - superblock->free_blocks - pending_blocks;
 	if (print) {
-		printf("%lu bytes free.\n", free_size);
-		fflush(NULL);
+		fprintf(output, "%lu bytes free.\n", free_size);
+		fprintf(output, "%llu bytes logical, %llu bytes physical.\n",
+				(unsigned long long) superblock->logical_blocks * block_size,
+				(unsigned long long) physical * block_size);
+		flush_output();
 	}
 	return free_size;
 }
@@ -381,99 +1340,4945 @@ long disk_availability(short print) {
 /*
  * Function: get_new_file_entry
  * Returns: An index of free Inode entry available in the directory array.
- * Description: Checks if a free entry is available for a new file.
+ * Description: Checks if a free entry is available for a new file. Holes
+ * left by deletes are reused first, searched for in the inode bitmap from
+ * the lowest one freed; without any the next never used slot is taken.
  */
 int get_new_file_entry() {
-	int counter = 0, index = -1;
-	while (counter < DIRECTORY_SIZE) {
-		if (!directory.files[counter].used) {
-			index = counter;
-			break;
-		}
-		++counter;
+	uint32_t index = superblock->inode_high;
+	if (superblock->inode_count < superblock->inode_high) {
+		index = free_inode_hint = next_inode(free_inode_hint, UNSET);
 	}
-	return index;
+	return index < directory_size ? (int) index : -1;
 }
 
 /*
- * Function: get_free_block
- * Returns: An index of free block available in the disk block array.
- * Description: Checks if a free disk block is available to store a new file.
+ * Function: next_inode
+ * Parameter(s): from - first inode to look at
+ * state - UNSET to look for a free inode, SET for one in use
+ * Returns: First inode at or after 'from' in the given state,
+ * directory_size if none.
+ * Description: Word at a time search of the inode bitmap, as find_block
+ * does for blocks.
  */
-int get_free_block() {
-	int counter = 0, index = -1;
-	while (counter < TOTAL_BLOCKS) {
-		if (used_space[counter] == UNSET) {
-			index = counter;
-			break;
+uint32_t next_inode(uint32_t from, State state) {
+	uint32_t word;
+	uint64_t bits;
+	while (from < directory_size) {
+		word = from / BITS_PER_WORD;
+		bits = state == SET ? inode_map[word] : ~inode_map[word];
+		bits &= ~0ULL << (from % BITS_PER_WORD);
+		if (bits != 0) {
+			from = word * BITS_PER_WORD + __builtin_ctzll(bits);
+			return from < directory_size ? from : directory_size;
 		}
-		++counter;
+		from = (word + 1) * BITS_PER_WORD;
 	}
-	return index;
+	return directory_size;
 }
 
 /*
- * Function: main
- * Returns: exit status of the program
- * Description: The main controller of the whole program,
- * connects with other functions and accomplishes the given task.
+ * Function: set_inode_used
+ * Parameter(s): index - inode
+ * state - SET when it is taken, UNSET when it is freed
+ * Description: Updates the inode's bit and logs the word holding it. A
+ * freed inode below the free inode hint becomes the hint.
  */
-void show_prompt(short new_line) {
-	if (new_line) {
-		printf("\n%s", PROMPT);
+void set_inode_used(uint32_t index, State state) {
+	uint64_t *word = &inode_map[index / BITS_PER_WORD];
+	if (state == SET) {
+		*word |= 1ULL << (index % BITS_PER_WORD);
 	} else {
-		printf("%s", PROMPT);
+		*word &= ~(1ULL << (index % BITS_PER_WORD));
+		if (index < free_inode_hint) {
+			free_inode_hint = index;
+		}
 	}
-	fflush(NULL);
+	log_range(word, sizeof(uint64_t));
 }
 
 /*
- * Function: print_message
- * Description: Util function to print formatted messages.
+ * Function: name_hash
+ * Parameter(s): name - file name
+ * Returns: 32 bit FNV-1a of the name, kept in the hot inode table.
  */
-void print_message(char *message) {
-	printf("%s%s\n", PROMPT, message);
-	fflush(NULL);
+uint32_t name_hash(const char *name) {
+	return (uint32_t) fnv_checksum(name, strlen(name), JOURNAL_SEED);
 }
 
 /*
- * Function: split_string
- * Parameter(s): string - command line submitted by User
- * args - storage passed from calling function to store split items
- * Description: Splits the command line passed to function, based on space
- * between words. This helps in extracting the command and its arguments
+ * Function: open_volume
+ * Parameter(s): image - path of the disk image, NULL for a volatile volume
+ * Description: Maps the volume. An empty or missing image is formatted with
+ * the requested geometry, an existing one is checked against the layout its
+ * superblock describes. Metadata is mapped privately and only reaches the
+ * image through the journal; the content index and data region are shared.
+ * An image left by a crash has its journal replayed.
  */
-void split_string(char *string, char *args[]) {
-	char *token;
-	int counter = 0;
+void open_volume(const char *image) {
+	Superblock header;
+	struct stat buf;
+	uint64_t size;
+	int fd = -1, fresh = 1, unclean = UNSET;
+	memset(&header, 0, sizeof(header));
+	header.block_size = block_size;
+	header.total_blocks = total_blocks;
+	header.directory_size = directory_size;
+	if (image != NULL) {
+		fd = open(image, O_RDWR | O_CREAT, 0644);
+		if (fd < 0 || fstat(fd, &buf) < 0) {
+			perror(image);
+			exit(EXIT_FAILURE);
+		}
+		fresh = buf.st_size == 0;
+		if (!fresh && (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+				|| memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC))
+				|| header.block_size < MIN_BLOCK_SIZE
+				|| header.block_size > MAX_BLOCK_SIZE
+				|| (header.block_size & (header.block_size - 1))
+				|| header.total_blocks == 0
+				|| header.total_blocks > MAX_TOTAL_BLOCKS
+				|| header.directory_size == 0
+				|| header.directory_size > MAX_DIRECTORY_SIZE)) {
+			fprintf(stderr, "%s: Not a MAV file system image.\n", image);
+			exit(EXIT_FAILURE);
+		}
+	}
+	size = plan_volume(&header);
+	if (image != NULL) {
+		if (!fresh && (uint64_t) buf.st_size != size) {
+			fprintf(stderr, "%s: Not a MAV file system image.\n", image);
+			exit(EXIT_FAILURE);
+		}
+		//-- A sparse file, blocks are only backed once written.
+		if (fresh && ftruncate(fd, size) < 0) {
+			perror(image);
+			exit(EXIT_FAILURE);
+		}
+		if (!fresh) {
+			unclean = replay_journal(fd, &header);
+		}
+		mapped_size = header.journal_offset;
+		volume = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+				fd, 0);
+		if (volume != MAP_FAILED) {
+			data_size = (cache_bytes == 0 ? size : header.data_offset)
+					- header.index_offset;
+			content_index = mmap(NULL, data_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, header.index_offset);
+			if (content_index == MAP_FAILED) {
+				perror("mmap");
+				exit(EXIT_FAILURE);
+			}
+			file_data = cache_bytes > 0 ? NULL : (unsigned char*) content_index
+					+ (header.data_offset - header.index_offset);
+		}
+		image_fd = meta_fd = fd;
+	} else {
+		mapped_size = size;
+		volume = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		content_index = (ContentSlot*) ((char*) volume + header.index_offset);
+		file_data = (unsigned char*) volume + header.data_offset;
+	}
+	if (volume == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	superblock = (Superblock*) volume;
+	if (fresh) {
+		*superblock = header;
+	} else if (superblock->bitmap_offset != header.bitmap_offset
+			|| superblock->summary_offset != header.summary_offset
+			|| superblock->refs_offset != header.refs_offset
+			|| superblock->index_offset != header.index_offset
+			|| superblock->index_slots != header.index_slots
+			|| superblock->inode_map_offset != header.inode_map_offset
+			|| superblock->hot_offset != header.hot_offset
+			|| superblock->inode_offset != header.inode_offset
+			|| superblock->journal_offset != header.journal_offset
+			|| superblock->journal_size != header.journal_size
+			|| superblock->data_offset != header.data_offset
+			|| superblock->image_size != size) {
+		fprintf(stderr, "%s: Not a MAV file system image.\n", image);
+		exit(EXIT_FAILURE);
+	}
+	block_size = superblock->block_size;
+	total_blocks = superblock->total_blocks;
+	directory_size = superblock->directory_size;
+	block_map = (uint64_t*) ((char*) volume + superblock->bitmap_offset);
+	full_words = (uint64_t*) ((char*) volume + superblock->summary_offset);
+	block_refs = (uint16_t*) ((char*) volume + superblock->refs_offset);
+	inode_map = (uint64_t*) ((char*) volume + superblock->inode_map_offset);
+	inode_hot = (InodeHot*) ((char*) volume + superblock->hot_offset);
+	directory = (Inode*) ((char*) volume + superblock->inode_offset);
+	if (image != NULL) {
+		open_journal();
+	}
+	if (fresh) {
+		format_volume(size);
+		init_block_map();
+	}
+	if (cache_bytes > 0) {
+		open_cache(image);
+	}
+	if (unclean) {
+		fprintf(stderr, "%s: Not closed cleanly, recovering.\n", image);
+		rebuild_volume();
+	}
+	commit_journal();
+}
 
-	token = strtok(string, TOKENT_SPLR);
-	while (token != NULL || counter < ARGS_SUPPORTED) {
-		args[counter] = token;
-		token = strtok(NULL, TOKENT_SPLR);
-		++counter;
+/*
+ * Function: close_volume
+ * Description: Commits and closes an image backed volume and unmaps it.
+ */
+void close_volume() {
+	if (cache.size > 0) {
+		close_cache();
+	}
+	if (journaling) {
+		close_journal();
+	}
+	if (data_size > 0) {
+		munmap(content_index, data_size);
+		data_size = 0;
 	}
+	if (volume != MAP_FAILED) {
+		munmap(volume, mapped_size);
+		volume = MAP_FAILED;
+	}
+	if (image_fd >= 0 && image_fd != meta_fd) {
+		close(image_fd);
+	}
+	if (meta_fd >= 0) {
+		close(meta_fd);
+	}
+	image_fd = meta_fd = -1;
+}
 
-	//-- Array to store tokens have a predefined size. If there aren't
-	//-- enough tokens to fill up the array, left space is filled up with NULL
-	while (counter < ARGS_SUPPORTED) {
-		args[counter] = NULL;
-		++counter;
+/*
+ * Function: plan_volume
+ * Parameter(s): header - superblock holding the geometry, receives the
+ * region offsets
+ * Returns: Size of the whole image.
+ * Description: Lays the regions out one after the other, the data region
+ * aligned to the block size. The content index gets a slot per two blocks,
+ * rounded up to a power of two.
+ */
+uint64_t plan_volume(Superblock *header) {
+	uint64_t bitmap_words = WORDS(header->total_blocks);
+	for (header->index_slots = MIN_INDEX_SLOTS;
+			header->index_slots < header->total_blocks / 2;
+			header->index_slots *= 2)
+		;
+	header->bitmap_offset = PAGE_ALIGN(sizeof(Superblock));
+	header->summary_offset = header->bitmap_offset
+			+ PAGE_ALIGN(bitmap_words * sizeof(uint64_t));
+	header->refs_offset = header->summary_offset
+			+ PAGE_ALIGN(WORDS(bitmap_words) * sizeof(uint64_t));
+	header->inode_map_offset = header->refs_offset
+			+ PAGE_ALIGN((uint64_t) header->total_blocks * sizeof(uint16_t));
+	header->hot_offset = header->inode_map_offset
+			+ PAGE_ALIGN(WORDS(header->directory_size) * sizeof(uint64_t));
+	header->inode_offset = header->hot_offset
+			+ PAGE_ALIGN((uint64_t) header->directory_size * sizeof(InodeHot));
+	header->journal_offset = header->inode_offset
+			+ PAGE_ALIGN((uint64_t) header->directory_size * sizeof(Inode));
+	header->journal_size = journal_bytes(header->journal_offset);
+	header->index_offset = header->journal_offset + header->journal_size;
+	header->data_offset = ALIGN_UP(header->index_offset + PAGE_ALIGN(
+			(uint64_t) header->index_slots * sizeof(ContentSlot)),
+			header->block_size);
+	return header->data_offset
+			+ (uint64_t) header->total_blocks * header->block_size;
+}
+
+/*
+ * Function: format_volume
+ * Parameter(s): size - size of the mapping
+ * Description: Completes the fresh superblock, which already carries the
+ * geometry and layout, and creates the empty root directory in the first
+ * inode. The mapping is zero filled, so the rest of the inode table starts
+ * out empty.
+ */
+void format_volume(uint64_t size) {
+	Inode *root = &directory[ROOT_DIRECTORY];
+	InodeHot *hot = &inode_hot[ROOT_DIRECTORY];
+	memcpy(superblock->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	superblock->inode_count = 1;
+	superblock->inode_high = 1;
+	superblock->image_size = size;
+	superblock->compression = compress_option;
+	init_extent_tree(root);
+	hot->time_created = time(NULL);
+	hot->type = DIRECTORY_FILE;
+	root->parent = ROOT_DIRECTORY;
+	root->root = NO_BLOCK;
+	set_inode_used(ROOT_DIRECTORY, SET);
+	log_range(root, sizeof(Inode));
+	log_range(hot, sizeof(InodeHot));
+	log_range(superblock, sizeof(Superblock));
+}
+
+/*
+ * Function: parse_size
+ * Parameter(s): text - decimal number, optionally suffixed K, M, G or T
+ * Returns: The size in bytes, 0 if the text is not a valid size.
+ */
+uint64_t parse_size(const char *text) {
+	const char *units = "KMGT", *unit;
+	char *end;
+	uint64_t value = strtoull(text, &end, 10);
+	int shift = 0;
+	if (*end != '\0' && (unit = strchr(units, toupper((unsigned char) *end)))) {
+		shift = 10 * (unit - units + 1);
+		end++;
+	}
+	if (end == text || *end != '\0' || !isdigit((unsigned char) *text)
+			|| value > (UINT64_MAX >> shift)) {
+		return 0;
 	}
+	return value << shift;
 }
 
 /*
- * Function: is_empty
- * Parameter(s): string - string to be validated
- * Returns: Validation status
- * Description: Validates if the passed string is empty or not.
+ * Function: block_data
+ * Parameter(s): block - block number
+ * Returns: Start of the block in the data region.
  */
-int is_empty(const char *string) {
-	while (*string != '\0') {
-		if (!isspace(*string)) {
-			return 0;
+unsigned char *block_data(uint32_t block) {
+	return file_data + (uint64_t) block * block_size;
+}
+
+/*
+ * Function: import_file
+ * Parameter(s): fd - source file
+ * inode - file being stored, its extent tree still empty
+ * size - number of bytes to copy
+ * Returns: 0 on success, -1 when the disk is full, -2 on a read or write
+ * error. The extents mapped so far are left for the caller to release.
+ * Description: Copies a host file in with inline deduplication, a
+ * DIRECT_CHUNK at a time. Each chunk is hashed block by block in one pass
+ * which prefetches the index slots, so their cache misses overlap. A block
+ * whose content is already stored maps to the stored copy, any other goes
+ * to the next block of a run allocated as it is needed. A volatile volume
+ * reads the chunk straight into the blocks it would take if nothing is
+ * shared, and only moves blocks up behind a shared one. A mapped image
+ * hashes the source through a mapping of its own and has the kernel copy
+ * the new blocks over, one consecutive stretch at a time. Cache mode
+ * stages the chunks in the buffers of the I/O engine in turn, reading the
+ * next one and writing out the last few while one is hashed. The last
+ * block is zero padded, so equal tails are shared as well. With
+ * compression on the file goes through import_compressed instead.
+ */
+int import_file(int fd, Inode *inode, uint64_t size) {
+	static unsigned char *staging;
+	static uint64_t hashes[DIRECT_CHUNK / MIN_BLOCK_SIZE];
+	struct iovec vector[IOV_MAX];
+	uint64_t chunk = DIRECT_CHUNK / block_size * block_size, offset, wanted;
+	uint64_t padded, blocks, done, counter, next;
+	int64_t remaining = (size + block_size - 1) / block_size;
+	uint32_t used = 0, batch_start = 0, batch_blocks = 0, shared;
+	uint64_t batch_source = 0;
+	Extent run = { 0, 0, 0 }, piece = { 0, 0, 1 };
+	int count = 0, status = 0, duplicate, stage = 0;
+	unsigned char *source = MAP_FAILED, *buffer, *last, *data;
+	ssize_t bytes;
+	if (superblock->compression) {
+		return import_compressed(fd, inode, size);
+	}
+	if (staging == NULL && posix_memalign((void**) &staging, DIRECT_ALIGN,
+			DIRECT_CHUNK)) {
+		return -2;
+	}
+	if (image_fd >= 0 && cache.size == 0 && size > 0) {
+		source = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (source != MAP_FAILED) {
+			madvise(source, size, MADV_SEQUENTIAL);
 		}
-		string++;
 	}
-	return 1;
+	if (cache.size > 0 && size > 0) {
+		status = queue_io(UNSET, fd, io_buffer(0), size < chunk ? size : chunk, 0);
+	}
+	for (offset = 0; offset < size && status == 0; offset += wanted,
+			stage = (stage + 1) % IO_SLOTS) {
+		wanted = size - offset < chunk ? size - offset : chunk;
+		padded = ALIGN_UP(wanted, block_size);
+		blocks = padded / block_size;
+		if (image_fd < 0 && used == run.length) {
+			used = 0;
+			if (claim_run(&run, remaining) < 0) {
+				run.length = 0;
+			}
+		}
+		buffer = image_fd < 0 && run.length - used >= blocks ?
+				block_data(run.start + used) : cache.size > 0 ? io_buffer(stage)
+				: staging;
+		last = NULL;
+		if (cache.size > 0) {
+			//-- The chunk was read ahead, the next one is read meanwhile
+			//-- into a buffer whose writes are done. It is queued first,
+			//-- so it goes out with the wait for this one.
+			next = offset + wanted;
+			if (next < size) {
+				status = wait_io((stage + 1) % IO_SLOTS);
+				status = status < 0 ? status : queue_io(UNSET, fd,
+						io_buffer((stage + 1) % IO_SLOTS),
+						size - next < chunk ? size - next : chunk, next);
+			}
+			status = wait_io(stage) < 0 ? -2 : status;
+			submit_io();
+		}
+		if (source != MAP_FAILED) {
+			//-- The mapping ends with the file, a partial last block is
+			//-- padded in the staging buffer.
+			buffer = source + offset;
+			if (wanted < padded) {
+				last = staging;
+				memcpy(last, buffer + padded - block_size,
+						block_size - (padded - wanted));
+				memset(last + block_size - (padded - wanted), 0, padded - wanted);
+			}
+		}
+		for (done = 0; done < wanted && status == 0 && source == MAP_FAILED
+				&& cache.size == 0; done += bytes) {
+			bytes = pread(fd, buffer + done, wanted - done, offset + done);
+			if (bytes == 0 || (bytes < 0 && errno != EINTR)) {
+				status = -2;
+			}
+			bytes = bytes < 0 ? 0 : bytes;
+		}
+		if (source == MAP_FAILED) {
+			memset(buffer + wanted, 0, padded - wanted);
+		}
+		for (counter = 0; counter < blocks; counter++) {
+			data = last != NULL && counter + 1 == blocks ? last
+					: buffer + counter * block_size;
+			hashes[counter] = content_hash(data, block_size);
+			__builtin_prefetch(&content_index[hashes[counter]
+					& (superblock->index_slots - 1)]);
+		}
+		for (counter = 0; counter < blocks && status == 0; counter++) {
+			data = last != NULL && counter + 1 == blocks ? last
+					: buffer + counter * block_size;
+			shared = find_content(hashes[counter]);
+			//-- A match among the blocks not written yet is compared on disk.
+			if (shared != NO_BLOCK && shared - batch_start < batch_blocks) {
+				status = write_batch(vector, count, batch_start, fd, batch_source);
+				count = 0, batch_blocks = 0;
+			}
+			duplicate = shared != NO_BLOCK && status == 0
+					&& same_content(shared, data);
+			if (!duplicate && used == run.length && status == 0) {
+				status = write_batch(vector, count, batch_start, fd, batch_source);
+				count = 0, batch_blocks = 0, used = 0;
+				status = status < 0 ? status : claim_run(&run, remaining);
+			}
+			piece.start = duplicate ? shared : run.start + used;
+			//-- Index blocks come out of the same free space as the data.
+			if (status < 0 || append_extent(inode, &piece) < 0) {
+				status = status < 0 ? status : -1;
+				break;
+			}
+			piece.logical++;
+			remaining--;
+			if (duplicate) {
+				block_refs[shared]++;
+				log_range(&block_refs[shared], sizeof(uint16_t));
+				continue;
+			}
+			used++;
+			index_content(hashes[counter], piece.start);
+			if (image_fd < 0) {
+				if (data != block_data(piece.start)) {
+					memcpy(block_data(piece.start), data, block_size);
+				}
+				continue;
+			}
+			//-- Without the cache a stretch is copied from the source
+			//-- file, so it has to be consecutive there as well.
+			if (batch_blocks > 0 && (piece.start != batch_start + batch_blocks
+					|| count == IOV_MAX || (cache.size == 0
+					&& (unsigned char*) vector[count - 1].iov_base
+							+ vector[count - 1].iov_len != data))) {
+				status = write_batch(vector, count, batch_start, fd, batch_source);
+				count = 0, batch_blocks = 0;
+			}
+			if (batch_blocks++ == 0) {
+				batch_start = piece.start;
+				batch_source = offset + counter * block_size;
+			}
+			if (count > 0 && (unsigned char*) vector[count - 1].iov_base
+					+ vector[count - 1].iov_len == data) {
+				vector[count - 1].iov_len += block_size;
+			} else {
+				vector[count].iov_base = data;
+				vector[count++].iov_len = block_size;
+			}
+		}
+		if (status == 0) {
+			status = write_batch(vector, count, batch_start, fd, batch_source);
+		}
+		count = 0, batch_blocks = 0;
+	}
+	//-- The rest of the last run was never used.
+	if (run.length > used) {
+		set_block_range(run.start + used, run.length - used, UNSET);
+	}
+	if (source != MAP_FAILED) {
+		munmap(source, size);
+	}
+	if (cache.size > 0 && drain_io() < 0 && status == 0) {
+		status = -2;
+	}
+	return status;
+}
+
+/*
+ * Function: import_compressed
+ * Parameter(s): fd - source file
+ * inode - file being stored, its extent tree still empty
+ * size - number of bytes to copy
+ * Returns: 0 on success, -1 when the disk is full, -2 on a read or write
+ * error. The extents mapped so far are left for the caller to release.
+ * Description: import_file for a volume with compression on. The source is
+ * read a cluster at a time and compressed. A cluster which saves at least
+ * a block is packed into consecutive blocks mapped by an extent of its
+ * own, and shared whole when the same packed blocks are stored already;
+ * any other cluster is stored raw and deduplicated block by block. Each
+ * failure to compress has the clusters after it stored raw untried, twice
+ * as many as after the previous failure up to MAX_BYPASS, so data that
+ * does not compress costs little more than a plain copy. In cache mode
+ * each cluster is staged and packed in the next buffer of the I/O engine,
+ * so the writes of the last few are still going on.
+ */
+int import_compressed(int fd, Inode *inode, uint64_t size) {
+	static unsigned char *staging, *packed;
+	unsigned char *raw, *squeezed;
+	struct iovec vector[MAX_CLUSTER / MIN_BLOCK_SIZE];
+	uint64_t cluster = (uint64_t) CLUSTER_BLOCKS * block_size, offset, wanted;
+	uint64_t padded, done, hash;
+	int64_t remaining = (size + block_size - 1) / block_size;
+	uint32_t blocks, stored = 0, counter, used = 0, batch_start = 0;
+	uint32_t batch_blocks = 0, shared, skip = 0, backoff = 0;
+	Extent run = { 0, 0, 0 }, piece;
+	int count = 0, status = 0, duplicate, stage = 0;
+	size_t length;
+	unsigned char *data;
+	ssize_t bytes;
+	if (staging == NULL && (posix_memalign((void**) &staging, DIRECT_ALIGN,
+			MAX_CLUSTER) || posix_memalign((void**) &packed, DIRECT_ALIGN,
+			MAX_CLUSTER))) {
+		return -2;
+	}
+	for (offset = 0; offset < size && status == 0; offset += wanted,
+			stage = (stage + 1) % IO_SLOTS) {
+		wanted = size - offset < cluster ? size - offset : cluster;
+		raw = cache.size > 0 ? io_buffer(stage) : staging;
+		squeezed = cache.size > 0 ? raw + IO_CHUNK / 2 : packed;
+		status = cache.size > 0 ? wait_io(stage) : 0;
+		//-- The writes of the last cluster go out while this one is read.
+		submit_io();
+		for (done = 0; done < wanted && status == 0; done += bytes) {
+			bytes = pread(fd, raw + done, wanted - done, offset + done);
+			if (bytes == 0 || (bytes < 0 && errno != EINTR)) {
+				status = -2;
+			}
+			bytes = bytes < 0 ? 0 : bytes;
+		}
+		padded = ALIGN_UP(wanted, block_size);
+		memset(raw + wanted, 0, padded - wanted);
+		blocks = padded / block_size;
+		length = 0;
+		if (skip > 0) {
+			skip--;
+		} else if (blocks > 1 && status == 0) {
+			length = compress_cluster(raw, padded, squeezed, padded - block_size);
+			backoff = length > 0 ? 0 : backoff == 0 ? 1
+					: backoff * 2 > MAX_BYPASS ? MAX_BYPASS : backoff * 2;
+			skip = backoff;
+		}
+		piece.logical = offset / block_size;
+		shared = NO_BLOCK;
+		if (length > 0) {
+			stored = (length + block_size - 1) / block_size;
+			memset(squeezed + length, 0, (size_t) stored * block_size - length);
+			hash = content_hash(squeezed, block_size);
+			shared = find_run(hash, squeezed, stored);
+		}
+		//-- The packed blocks have to be consecutive, a cluster the free
+		//-- space is too broken up for is stored raw.
+		if (length > 0 && shared == NO_BLOCK && run.length - used < stored) {
+			set_block_range(run.start + used, run.length - used, UNSET);
+			used = 0;
+			status = claim_run(&run, remaining);
+			length = status == 0 && run.length < stored ? 0 : length;
+		}
+		if (length > 0 && status == 0) {
+			piece.start = shared != NO_BLOCK ? shared : run.start + used;
+			piece.length = COMPRESSED_EXTENT | stored << 16 | blocks;
+			if (append_extent(inode, &piece) < 0) {
+				status = -1;
+				break;
+			}
+			remaining -= blocks;
+			for (counter = 0; counter < stored; counter++) {
+				block_refs[piece.start + counter] += shared != NO_BLOCK ? 1 : 0;
+				block_refs[piece.start + counter] |= INDEXED_BLOCK;
+				log_range(&block_refs[piece.start + counter], sizeof(uint16_t));
+			}
+			if (shared != NO_BLOCK) {
+				continue;
+			}
+			used += stored;
+			index_content(hash, piece.start);
+			vector[0].iov_base = squeezed;
+			vector[0].iov_len = (size_t) stored * block_size;
+			if (image_fd < 0) {
+				memcpy(block_data(piece.start), squeezed, vector[0].iov_len);
+			} else {
+				status = write_batch(vector, 1, piece.start, -1, 0);
+			}
+			continue;
+		}
+		piece.length = 1;
+		for (counter = 0; counter < blocks && status == 0; counter++) {
+			data = raw + (size_t) counter * block_size;
+			hash = content_hash(data, block_size);
+			shared = find_content(hash);
+			//-- A match among the blocks not written yet is compared on disk.
+			if (shared != NO_BLOCK && shared - batch_start < batch_blocks) {
+				status = write_batch(vector, count, batch_start, -1, 0);
+				count = 0, batch_blocks = 0;
+			}
+			duplicate = shared != NO_BLOCK && status == 0
+					&& same_content(shared, data);
+			if (!duplicate && used == run.length && status == 0) {
+				status = write_batch(vector, count, batch_start, -1, 0);
+				count = 0, batch_blocks = 0, used = 0;
+				status = status < 0 ? status : claim_run(&run, remaining);
+			}
+			piece.start = duplicate ? shared : run.start + used;
+			if (status < 0 || append_extent(inode, &piece) < 0) {
+				status = status < 0 ? status : -1;
+				break;
+			}
+			piece.logical++;
+			remaining--;
+			if (duplicate) {
+				block_refs[shared]++;
+				log_range(&block_refs[shared], sizeof(uint16_t));
+				continue;
+			}
+			used++;
+			index_content(hash, piece.start);
+			if (image_fd < 0) {
+				memcpy(block_data(piece.start), data, block_size);
+				continue;
+			}
+			if (batch_blocks > 0 && piece.start != batch_start + batch_blocks) {
+				status = write_batch(vector, count, batch_start, -1, 0);
+				count = 0, batch_blocks = 0;
+			}
+			if (batch_blocks++ == 0) {
+				batch_start = piece.start;
+			}
+			if (count > 0 && (unsigned char*) vector[count - 1].iov_base
+					+ vector[count - 1].iov_len == data) {
+				vector[count - 1].iov_len += block_size;
+			} else {
+				vector[count].iov_base = data;
+				vector[count++].iov_len = block_size;
+			}
+		}
+		if (status == 0) {
+			status = write_batch(vector, count, batch_start, -1, 0);
+		}
+		count = 0, batch_blocks = 0;
+	}
+	//-- The rest of the last run was never used.
+	if (run.length > used) {
+		set_block_range(run.start + used, run.length - used, UNSET);
+	}
+	if (cache.size > 0 && drain_io() < 0 && status == 0) {
+		status = -2;
+	}
+	return status;
+}
+
+/*
+ * Function: claim_run
+ * Parameter(s): run - receives the run
+ * wanted - blocks the file still needs
+ * Returns: 0 on success, -1 when the disk is full.
+ * Description: Allocates the next run of a file being stored. Blocks of
+ * deleted files count, a commit makes them usable. The blocks held back
+ * for deletes are never handed to file data.
+ */
+int claim_run(Extent *run, int64_t wanted) {
+	int64_t available = superblock->free_blocks - reserved_blocks;
+	if (available < wanted && pending_count > 0) {
+		commit_journal();
+		available = superblock->free_blocks - reserved_blocks;
+	}
+	available = available < wanted ? available : wanted;
+	if (available <= 0 || allocate_extent(available > INT32_MAX ? INT32_MAX
+			: available, run) == 0) {
+		run->length = 0;
+		return -1;
+	}
+	if (cache.size > 0) {
+		cache_invalidate(run->start, run->length);
+	}
+	return 0;
+}
+
+/*
+ * Function: write_batch
+ * Parameter(s): vector - staged blocks bound for consecutive blocks,
+ * consumed by the call
+ * count - number of buffers
+ * block - first destination block
+ * fd, source - the source file and where the staged bytes came from, fd
+ * -1 when there is none
+ * Returns: 0 on success, -2 on a write error.
+ * Description: Writes staged blocks into the image. Without the cache a
+ * single buffer is copied by the kernel straight from the source file,
+ * the image and its mapping share the page cache; the staged copy fills in
+ * past the end of the file (the padding) or where the file systems refuse
+ * to copy. In cache mode the buffers are queued on the I/O engine, written
+ * by the time their engine buffer is waited for.
+ */
+int write_batch(struct iovec *vector, int count, uint32_t block, int fd,
+		uint64_t source) {
+	static int copy_range = 1;
+	loff_t from = source, to = superblock->data_offset
+			+ (uint64_t) block * block_size;
+	ssize_t copied;
+	int counter, status = 0;
+	for (counter = 0; counter < count && cache.size > 0 && status == 0;
+			counter++) {
+		status = queue_io(SET, image_fd, vector[counter].iov_base,
+				vector[counter].iov_len, to);
+		to += vector[counter].iov_len;
+	}
+	if (cache.size > 0) {
+		return status;
+	}
+	while (copy_range && fd >= 0 && count == 1
+			&& vector->iov_len > 0) {
+		copied = copy_file_range(fd, &from, image_fd, &to, vector->iov_len, 0);
+		if (copied < 0 && errno != EINTR) {
+			//-- Older kernels and cross file system copies are refused,
+			//-- nothing was copied.
+			copy_range = 0;
+		} else if (copied == 0) {
+			break;
+		} else if (copied > 0) {
+			vector->iov_base = (unsigned char*) vector->iov_base + copied;
+			vector->iov_len -= copied;
+		}
+	}
+	if (count == 0 || write_vector(image_fd, vector, count, to) == 0) {
+		return 0;
+	}
+	return -2;
+}
+
+/*
+ * Function: update_file
+ * Parameter(s): inode - file being written, its lock held for writing
+ * offset - first byte to write, at most the file size
+ * data, length - bytes to write
+ * Returns: 0 on success, -1 when the disk is full, -2 on a read or write
+ * error. The file keeps what was written up to then.
+ * Description: Maps the offset straight to its extent and works through
+ * the range a stretch at a time, touching only the blocks it covers.
+ * Blocks only this file holds are overwritten in place and leave the
+ * content index; blocks shared through deduplication are copied to new
+ * ones, which are spliced into the extent tree before the old ones lose
+ * this owner. A compressed cluster is expanded, changed and stored again
+ * whole. Bytes past the end of the file go into new blocks, zero padded.
+ * Partly written blocks keep the rest of their bytes.
+ */
+int update_file(Inode *inode, uint64_t offset, const unsigned char *data,
+		size_t length) {
+	static unsigned char *scratch;
+	InodeHot *hot = HOT(inode);
+	uint64_t position = offset, end = offset + length, first, stop;
+	uint32_t logical, block, count, counter;
+	uint32_t limit = DIRECT_CHUNK / block_size;
+	Extent *extent, old, run;
+	int status = 0;
+	short shared;
+	if (scratch == NULL && posix_memalign((void**) &scratch, DIRECT_ALIGN,
+			DIRECT_CHUNK + COMPRESS_SLACK)) {
+		return -2;
+	}
+	while (position < end && status == 0) {
+		logical = position / block_size;
+		first = (uint64_t) logical * block_size;
+		count = (end - first + block_size - 1) / block_size;
+		count = count < limit ? count : limit;
+		extent = lookup_extent(inode, logical);
+		if (extent != NULL && (extent->length & COMPRESSED_EXTENT)) {
+			old = *extent;
+			first = (uint64_t) old.logical * block_size;
+			stop = first + (uint64_t) EXTENT_BLOCKS(&old) * block_size;
+			stop = stop < end ? stop : end;
+			status = expand_extent(&old, scratch, UNSET);
+			if (status == 0) {
+				memcpy(scratch + (position - first), data + (position - offset),
+						stop - position);
+				status = store_cluster(inode, &old, scratch);
+			}
+		} else if (extent != NULL) {
+			old = *extent;
+			block = old.start + (logical - old.logical);
+			if (count > EXTENT_BLOCKS(&old) - (logical - old.logical)) {
+				count = EXTENT_BLOCKS(&old) - (logical - old.logical);
+			}
+			//-- A stretch is either all shared or all this file's own.
+			shared = (block_refs[block] & MAX_SHARES) > 0;
+			for (counter = 1; counter < count && ((block_refs[block + counter]
+					& MAX_SHARES) > 0) == shared; counter++)
+				;
+			count = counter;
+			if (shared && claim_blocks(inode, &run, count) < 0) {
+				status = -1;
+				break;
+			}
+			count = shared ? run.length : count;
+			stop = first + (uint64_t) count * block_size;
+			stop = stop < end ? stop : end;
+			if (position > first) {
+				status = load_block(block, scratch);
+			}
+			if (status == 0 && stop < first + (uint64_t) count * block_size) {
+				status = load_block(block + count - 1,
+						scratch + (size_t) (count - 1) * block_size);
+			}
+			memcpy(scratch + (position - first), data + (position - offset),
+					stop - position);
+			if (status == 0 && !shared) {
+				status = store_blocks(block, scratch, count);
+				for (counter = 0; counter < count; counter++) {
+					if (block_refs[block + counter] & INDEXED_BLOCK) {
+						block_refs[block + counter] &= ~INDEXED_BLOCK;
+						log_range(&block_refs[block + counter], sizeof(uint16_t));
+					}
+				}
+			} else if (shared) {
+				run.logical = logical;
+				if (status == 0) {
+					status = store_blocks(run.start, scratch, count);
+				}
+				if (status == 0 && splice_extents(inode, &run, 1) < 0) {
+					status = -1;
+				}
+				if (status == 0) {
+					release_blocks(block, count);
+				} else {
+					set_block_range(run.start, run.length, UNSET);
+				}
+			}
+		} else {
+			if (claim_blocks(inode, &run, count) < 0) {
+				status = -1;
+				break;
+			}
+			count = run.length;
+			stop = first + (uint64_t) count * block_size;
+			stop = stop < end ? stop : end;
+			memset(scratch, 0, (size_t) count * block_size);
+			memcpy(scratch + (position - first), data + (position - offset),
+					stop - position);
+			run.logical = logical;
+			status = store_blocks(run.start, scratch, count);
+			if (status == 0 && splice_extents(inode, &run, 1) < 0) {
+				status = -1;
+			}
+			if (status < 0) {
+				set_block_range(run.start, run.length, UNSET);
+			}
+		}
+		if (status == 0 && stop > hot->size) {
+			superblock->logical_blocks += (stop + block_size - 1) / block_size
+					- (hot->size + block_size - 1) / block_size;
+			hot->size = stop;
+		}
+		position = stop;
+		//-- A commit may come with the next allocation.
+		log_range(inode, sizeof(Inode));
+		log_range(hot, sizeof(InodeHot));
+		log_range(superblock, sizeof(Superblock));
+	}
+	return status;
+}
+
+/*
+ * Function: store_cluster
+ * Parameter(s): inode - file being written
+ * old - compressed cluster of the file
+ * data - the cluster's new content, aligned for direct I/O
+ * Returns: 0 on success, -1 when the disk is full, -2 on a write error.
+ * Description: Packs the content again when compression is on and it still
+ * saves a block, else stores it raw in up to MAX_SPLICE runs. The cluster
+ * is then mapped to the new blocks and its old ones released.
+ */
+int store_cluster(Inode *inode, Extent *old, unsigned char *data) {
+	static unsigned char *packed;
+	Extent pieces[MAX_SPLICE];
+	uint32_t blocks = EXTENT_BLOCKS(old), stored = 0, done;
+	size_t length = 0;
+	int count = 0, status = 0, counter;
+	if (packed == NULL && posix_memalign((void**) &packed, DIRECT_ALIGN,
+			MAX_CLUSTER)) {
+		return -2;
+	}
+	if (superblock->compression) {
+		length = compress_cluster(data, (size_t) blocks * block_size, packed,
+				(size_t) (blocks - 1) * block_size);
+		stored = (length + block_size - 1) / block_size;
+	}
+	if (stored > 0 && claim_blocks(inode, &pieces[0], stored) < 0) {
+		status = -1;
+	} else if (stored > 0 && pieces[0].length < stored) {
+		//-- No run was long enough, the cluster goes in raw.
+		set_block_range(pieces[0].start, pieces[0].length, UNSET);
+		stored = 0;
+	} else if (stored > 0) {
+		memset(packed + length, 0, (size_t) stored * block_size - length);
+		pieces[0].logical = old->logical;
+		pieces[0].length = COMPRESSED_EXTENT | stored << 16 | blocks;
+		count = 1;
+		status = store_blocks(pieces[0].start, packed, stored);
+	}
+	for (done = 0; stored == 0 && status == 0 && done < blocks;
+			done += pieces[count++].length) {
+		if (count == MAX_SPLICE
+				|| claim_blocks(inode, &pieces[count], blocks - done) < 0) {
+			status = -1;
+			break;
+		}
+		pieces[count].logical = old->logical + done;
+		status = store_blocks(pieces[count].start,
+				data + (size_t) done * block_size, pieces[count].length);
+	}
+	if (status == 0 && splice_extents(inode, pieces, count) < 0) {
+		status = -1;
+	}
+	if (status < 0) {
+		for (counter = 0; counter < count; counter++) {
+			set_block_range(pieces[counter].start,
+					STORED_BLOCKS(&pieces[counter]), UNSET);
+		}
+		return status;
+	}
+	release_blocks(old->start, STORED_BLOCKS(old));
+	return 0;
+}
+
+/*
+ * Function: claim_blocks
+ * Parameter(s): inode - file being written
+ * run - receives the run
+ * wanted - blocks needed
+ * Returns: 0 on success, -1 when the disk is full.
+ * Description: claim_run for writes, which keeps back as well the node
+ * blocks splicing the run into the file's tree may take.
+ */
+int claim_blocks(Inode *inode, Extent *run, int64_t wanted) {
+	int64_t nodes = SPLICE_BLOCKS(inode->tree.depth);
+	if (!reserve_blocks(reserved_blocks + nodes + wanted)) {
+		wanted = superblock->free_blocks - reserved_blocks - nodes;
+	}
+	if (wanted <= 0) {
+		run->length = 0;
+		return -1;
+	}
+	return claim_run(run, wanted);
+}
+
+/*
+ * Function: load_block
+ * Parameter(s): block - block to read
+ * buffer - receives its content
+ * Returns: 0 on success, -2 on a read error.
+ */
+int load_block(uint32_t block, unsigned char *buffer) {
+	int slot;
+	if (cache.size == 0) {
+		memcpy(buffer, block_data(block), block_size);
+		return 0;
+	}
+	slot = cache_read(block, 1);
+	if (slot == NEGATIVE) {
+		return -2;
+	}
+	memcpy(buffer, cache_buffer(slot), block_size);
+	cache_unpin(&slot, 1, UNSET);
+	return 0;
+}
+
+/*
+ * Function: store_blocks
+ * Parameter(s): start - first block to write
+ * data - their new content, aligned for direct I/O
+ * count - number of blocks
+ * Returns: 0 on success, -2 on a write error.
+ * Description: In cache mode the blocks are dropped from the cache and
+ * written around it.
+ */
+int store_blocks(uint32_t start, const unsigned char *data, uint32_t count) {
+	if (cache.size == 0) {
+		memcpy(block_data(start), data, (size_t) count * block_size);
+		return 0;
+	}
+	cache_invalidate(start, count);
+	return transfer_io(SET, image_fd, (unsigned char*) data,
+			(size_t) count * block_size,
+			superblock->data_offset + (uint64_t) start * block_size);
+}
+
+/*
+ * Function: content_hash
+ * Parameter(s): data - block content
+ * length - multiple of 32 bytes
+ * Returns: 64 bit hash of the bytes.
+ * Description: CRC32C of the four quarters of the block, packed and mixed
+ * into 64 bits. The quarters run side by side so the CRC instruction
+ * keeps its pipeline full; CPUs without one get the same values from a
+ * table, the hashes are kept in the image. Equal hashes are only a hint,
+ * sharing compares the blocks.
+ */
+uint64_t content_hash(const unsigned char *data, size_t length) {
+	uint32_t crcs[4] = { 0, 1, 2, 3 };
+#if defined(__x86_64__)
+	static int hardware = NEGATIVE;
+	if (hardware == NEGATIVE) {
+		hardware = __builtin_cpu_supports("sse4.2") ? SET : UNSET;
+	}
+	if (hardware) {
+		crc_hardware(data, length / 4, crcs);
+	} else {
+		crc_table(data, length / 4, crcs);
+	}
+#else
+	crc_table(data, length / 4, crcs);
+#endif
+	return ((((uint64_t) crcs[0] << 32) | crcs[1])
+			^ (((uint64_t) crcs[2] << 32) | crcs[3])) * HASH_PRIME;
+}
+
+#if defined(__x86_64__)
+/*
+ * Function: crc_hardware
+ * Parameter(s): data - four consecutive quarters of 'quarter' bytes
+ * quarter - multiple of 8 bytes
+ * crcs - running CRC32C of each quarter
+ */
+__attribute__((target("sse4.2")))
+void crc_hardware(const unsigned char *data, size_t quarter, uint32_t *crcs) {
+	uint64_t crc0 = crcs[0], crc1 = crcs[1], crc2 = crcs[2], crc3 = crcs[3];
+	uint64_t words[4];
+	size_t offset;
+	for (offset = 0; offset < quarter; offset += sizeof(uint64_t)) {
+		memcpy(&words[0], data + offset, sizeof(uint64_t));
+		memcpy(&words[1], data + quarter + offset, sizeof(uint64_t));
+		memcpy(&words[2], data + 2 * quarter + offset, sizeof(uint64_t));
+		memcpy(&words[3], data + 3 * quarter + offset, sizeof(uint64_t));
+		crc0 = _mm_crc32_u64(crc0, words[0]);
+		crc1 = _mm_crc32_u64(crc1, words[1]);
+		crc2 = _mm_crc32_u64(crc2, words[2]);
+		crc3 = _mm_crc32_u64(crc3, words[3]);
+	}
+	crcs[0] = crc0, crcs[1] = crc1, crcs[2] = crc2, crcs[3] = crc3;
+}
+#endif
+
+/*
+ * Function: crc_table
+ * Parameter(s): data - four consecutive quarters of 'quarter' bytes
+ * quarter - bytes per quarter
+ * crcs - running CRC32C of each quarter
+ * Description: Byte at a time CRC32C, reflected like the instruction.
+ */
+void crc_table(const unsigned char *data, size_t quarter, uint32_t *crcs) {
+	static uint32_t table[256];
+	uint32_t entry;
+	size_t offset;
+	int lane, bit;
+	if (table[1] == 0) {
+		for (lane = 0; lane < 256; lane++) {
+			for (entry = lane, bit = 0; bit < 8; bit++) {
+				entry = entry & 1 ? (entry >> 1) ^ CRC32C_POLYNOMIAL : entry >> 1;
+			}
+			table[lane] = entry;
+		}
+	}
+	for (lane = 0; lane < 4; lane++) {
+		for (offset = 0; offset < quarter; offset++) {
+			crcs[lane] = table[(crcs[lane] ^ data[lane * quarter + offset]) & 0xFF]
+					^ (crcs[lane] >> 8);
+		}
+	}
+}
+
+/*
+ * Function: find_content
+ * Parameter(s): hash - content hash of a block
+ * Returns: A stored block that may hold the same content, NO_BLOCK if none.
+ * Description: Probes the few slots the hash may sit in. Entries are never
+ * removed, so one whose block was freed since, or can take no more owners,
+ * yields nothing. The index is not journaled, after a crash an entry may
+ * be stale or torn, which the same checks catch.
+ */
+uint32_t find_content(uint64_t hash) {
+	uint32_t mask = superblock->index_slots - 1, probe, refs;
+	ContentSlot *slot;
+	for (probe = 0; probe < INDEX_PROBE; probe++) {
+		slot = &content_index[(hash + probe) & mask];
+		if (slot->tag == 0) {
+			break;
+		}
+		if (slot->tag == CONTENT_TAG(hash)) {
+			if (slot->block >= total_blocks) {
+				return NO_BLOCK;
+			}
+			refs = block_refs[slot->block];
+			return (refs & INDEXED_BLOCK) && (refs & MAX_SHARES) < MAX_SHARES ?
+					slot->block : NO_BLOCK;
+		}
+	}
+	return NO_BLOCK;
+}
+
+/*
+ * Function: same_content
+ * Parameter(s): block - stored block
+ * data - block about to be stored
+ * Returns: SET if both hold the same bytes.
+ * Description: In cache mode the stored block is read through the cache,
+ * without keeping it if it was not there already, once the writes still
+ * queued have landed.
+ */
+int same_content(uint32_t block, const unsigned char *data) {
+	int slot, same;
+	if (cache.size == 0) {
+		return !memcmp(block_data(block), data, block_size);
+	}
+	settle_io();
+	slot = cache_read(block, 1);
+	if (slot == NEGATIVE) {
+		return UNSET;
+	}
+	same = !memcmp(cache_buffer(slot), data, block_size);
+	cache_unpin(&slot, 1, SET);
+	return same;
+}
+
+/*
+ * Function: index_content
+ * Parameter(s): hash - content hash of the block
+ * block - newly written file block
+ * Description: Enters the block into the content index. The index is a
+ * cache, not a complete map: the block takes the first of its slots that
+ * is empty, stale or holds the same hash, else the first slot outright.
+ */
+void index_content(uint64_t hash, uint32_t block) {
+	uint32_t mask = superblock->index_slots - 1, probe;
+	ContentSlot *slot, *victim = &content_index[hash & mask];
+	for (probe = 0; probe < INDEX_PROBE; probe++) {
+		slot = &content_index[(hash + probe) & mask];
+		if (slot->tag == 0 || slot->tag == CONTENT_TAG(hash)
+				|| slot->block >= total_blocks
+				|| !(block_refs[slot->block] & INDEXED_BLOCK)) {
+			victim = slot;
+			break;
+		}
+	}
+	victim->tag = CONTENT_TAG(hash);
+	victim->block = block;
+	block_refs[block] |= INDEXED_BLOCK;
+	log_range(&block_refs[block], sizeof(uint16_t));
+}
+
+/*
+ * Function: find_run
+ * Parameter(s): hash - content hash of the first block
+ * data - blocks about to be stored
+ * count - number of blocks
+ * Returns: The first of 'count' consecutive stored blocks holding the same
+ * bytes, NO_BLOCK if there are none.
+ * Description: Only the first block of a packed cluster is in the content
+ * index, the blocks after it are compared where they lie. Each of them
+ * must still be marked shareable: the blocks of a deleted file keep their
+ * bytes but are free.
+ */
+uint32_t find_run(uint64_t hash, const unsigned char *data, uint32_t count) {
+	uint32_t block = find_content(hash), counter, refs;
+	if (block == NO_BLOCK || block + (uint64_t) count > total_blocks) {
+		return NO_BLOCK;
+	}
+	for (counter = 0; counter < count; counter++) {
+		refs = block_refs[block + counter];
+		if (!(refs & INDEXED_BLOCK) || (refs & MAX_SHARES) == MAX_SHARES
+				|| !same_content(block + counter,
+						data + (size_t) counter * block_size)) {
+			return NO_BLOCK;
+		}
+	}
+	return block;
+}
+
+/*
+ * Function: compress_cluster
+ * Parameter(s): source, size - bytes to compress
+ * target - receives the packed form
+ * limit - bytes the packed form may take
+ * Returns: Size of the packed form, 0 if it does not fit in 'limit'.
+ * Description: A greedy LZ77 parse written in the LZ4 block format. Each
+ * sequence is a token holding the literal and match lengths (15 meaning
+ * more length bytes follow), the literals and a two byte match offset; the
+ * last sequence is literals only and, as LZ4 requires, no match starts in
+ * the last 12 bytes. Matches are found through a table of hashed 4 byte
+ * words which is never cleared: positions are stored offset by a base that
+ * moves past each cluster, so older entries read as empty. Every 64 misses
+ * in a row lengthen the search step, which skips quickly over data that
+ * does not compress.
+ */
+size_t compress_cluster(const unsigned char *source, size_t size,
+		unsigned char *target, size_t limit) {
+	static uint32_t table[1 << COMPRESS_HASH_BITS], next_base = 1;
+	const unsigned char *anchor = source, *ip = source, *match, *from;
+	const unsigned char *last_match = source + size - 12;
+	const unsigned char *match_end = source + size - 5;
+	unsigned char *op = target, *op_end = target + limit;
+	uint32_t word, slot, entry, base, misses = 0;
+	uint64_t left, right;
+	size_t literals, length, rest;
+	if (next_base > UINT32_MAX - (uint32_t) size) {
+		memset(table, 0, sizeof(table));
+		next_base = 1;
+	}
+	base = next_base;
+	next_base += size;
+	while (size > 12 && ip < last_match) {
+		memcpy(&word, ip, sizeof(word));
+		slot = word * 2654435761U >> (32 - COMPRESS_HASH_BITS);
+		entry = table[slot];
+		table[slot] = ip - source + base;
+		if (entry < base || ip - source - (entry - base) > MAX_OFFSET
+				|| memcmp(source + (entry - base), ip, MIN_MATCH)) {
+			ip += 1 + (misses++ >> 6);
+			continue;
+		}
+		match = source + (entry - base);
+		while (ip > anchor && match > source && ip[-1] == match[-1]) {
+			ip--, match--;
+		}
+		from = ip + MIN_MATCH;
+		for (; from + 8 <= match_end; from += 8) {
+			memcpy(&left, from, sizeof(left));
+			memcpy(&right, match + (from - ip), sizeof(right));
+			if (left != right) {
+				break;
+			}
+		}
+		while (from < match_end && *from == match[from - ip]) {
+			from++;
+		}
+		length = from - ip - MIN_MATCH;
+		literals = ip - anchor;
+		if ((size_t) (op_end - op) < 1 + literals / 255 + 1 + literals + 2
+				+ length / 255 + 1) {
+			return 0;
+		}
+		*op++ = (literals < 15 ? literals : 15) << 4 | (length < 15 ? length : 15);
+		if (literals >= 15) {
+			for (rest = literals - 15; rest >= 255; rest -= 255) {
+				*op++ = 255;
+			}
+			*op++ = rest;
+		}
+		memcpy(op, anchor, literals);
+		op += literals;
+		*op++ = (ip - match) & 0xFF;
+		*op++ = (ip - match) >> 8;
+		if (length >= 15) {
+			for (rest = length - 15; rest >= 255; rest -= 255) {
+				*op++ = 255;
+			}
+			*op++ = rest;
+		}
+		ip = anchor = from;
+		misses = 0;
+		//-- The word just before the next search is entered as well.
+		if (ip < last_match) {
+			memcpy(&word, ip - 2, sizeof(word));
+			table[word * 2654435761U >> (32 - COMPRESS_HASH_BITS)] =
+					ip - 2 - source + base;
+		}
+	}
+	literals = source + size - anchor;
+	if ((size_t) (op_end - op) < 1 + literals / 255 + 1 + literals) {
+		return 0;
+	}
+	*op++ = (literals < 15 ? literals : 15) << 4;
+	if (literals >= 15) {
+		for (rest = literals - 15; rest >= 255; rest -= 255) {
+			*op++ = 255;
+		}
+		*op++ = rest;
+	}
+	memcpy(op, anchor, literals);
+	return op + literals - target;
+}
+
+/*
+ * Function: decompress_cluster
+ * Parameter(s): source, size - packed form, zero padding after it is fine
+ * target - receives the cluster, and may be overwritten up to
+ * COMPRESS_SLACK bytes past it
+ * length - bytes of the cluster
+ * Returns: 0 on success, -1 if the packed form is damaged.
+ * Description: Literals and matches are copied 16 bytes at a time, letting
+ * the last copy run over into bytes written later or into the slack. A
+ * short sequence, the common case, takes one move for its literals and two
+ * for its match without a loop. A match closer than 8 bytes first has its
+ * pattern spelt out to a period of at least 8. Every length and offset is
+ * checked, damaged data never reads or writes out of bounds.
+ */
+int decompress_cluster(const unsigned char *source, size_t size,
+		unsigned char *target, size_t length) {
+	const unsigned char *ip = source, *end = source + size, *match;
+	unsigned char *op = target, *op_end = target + length;
+	size_t literals, run, offset, period, copied;
+	unsigned int token, byte;
+	while (ip < end) {
+		token = *ip++;
+		literals = token >> 4;
+		//-- Short literals and a short match at least 16 bytes back.
+		if (literals < 15 && (token & 15) < 15 && end - ip >= 18
+				&& literals <= (size_t) (op_end - op)) {
+			memcpy(op, ip, 16);
+			op += literals, ip += literals;
+			offset = ip[0] | ip[1] << 8;
+			run = (token & 15) + MIN_MATCH;
+			if (op == op_end) {
+				return 0;
+			}
+			if (offset >= 16 && offset <= (size_t) (op - target)
+					&& run <= (size_t) (op_end - op)) {
+				ip += 2;
+				memcpy(op, op - offset, 16);
+				memcpy(op + 16, op - offset + 16, 16);
+				op += run;
+				continue;
+			}
+			//-- Anything else is finished the long way.
+			ip -= literals + 1, op -= literals;
+			token = *ip++;
+		}
+		if (literals == 15) {
+			do {
+				if (ip == end) {
+					return -1;
+				}
+				byte = *ip++;
+				literals += byte;
+			} while (byte == 255);
+		}
+		if (literals > (size_t) (end - ip) || literals > (size_t) (op_end - op)) {
+			return -1;
+		}
+		if ((size_t) (end - ip) >= literals + 16) {
+			for (copied = 0; copied < literals; copied += 16) {
+				memcpy(op + copied, ip + copied, 16);
+			}
+		} else {
+			memcpy(op, ip, literals);
+		}
+		op += literals, ip += literals;
+		if (op == op_end) {
+			return 0;
+		}
+		if (end - ip < 2) {
+			return -1;
+		}
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		run = token & 15;
+		if (run == 15) {
+			do {
+				if (ip == end) {
+					return -1;
+				}
+				byte = *ip++;
+				run += byte;
+			} while (byte == 255);
+		}
+		run += MIN_MATCH;
+		if (offset == 0 || offset > (size_t) (op - target)
+				|| run > (size_t) (op_end - op)) {
+			return -1;
+		}
+		match = op - offset;
+		if (offset >= 16) {
+			for (copied = 0; copied < run; copied += 16) {
+				memcpy(op + copied, match + copied, 16);
+			}
+		} else {
+			period = offset;
+			while (period < 8) {
+				period += offset;
+			}
+			for (copied = 0; copied < run && copied < period; copied++) {
+				op[copied] = match[copied];
+			}
+			for (; copied < run; copied += 8) {
+				memcpy(op + copied, op + copied - period, 8);
+			}
+		}
+		op += run;
+	}
+	return -1;
+}
+
+/*
+ * Function: expand_extent
+ * Parameter(s): extent - compressed cluster
+ * target - receives the cluster, with COMPRESS_SLACK bytes to spare
+ * scan - cache mode: the packed blocks are dropped once read
+ * Returns: 0 on success, -2 on a read error or a damaged cluster.
+ * Description: In cache mode the packed blocks are gathered into one
+ * buffer first, the cache holds them a block per slot.
+ */
+int expand_extent(Extent *extent, unsigned char *target, short scan) {
+	static __thread unsigned char *packed;
+	uint32_t stored = STORED_BLOCKS(extent), counter;
+	unsigned char *source = NULL;
+	int slot;
+	if ((uint64_t) EXTENT_BLOCKS(extent) * block_size > MAX_CLUSTER
+			|| stored >= EXTENT_BLOCKS(extent)) {
+		return -2;
+	}
+	if (cache.size == 0) {
+		source = block_data(extent->start);
+	} else if (packed == NULL && (packed = malloc(MAX_CLUSTER)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	//-- The clusters of a file follow each other on disk, so read-ahead may
+	//-- run on past this one.
+	for (counter = 0; source == NULL && counter < stored; counter++) {
+		slot = cache_read(extent->start + counter, MAX_READ_AHEAD);
+		if (slot == NEGATIVE) {
+			return -2;
+		}
+		memcpy(packed + (size_t) counter * block_size, cache_buffer(slot),
+				block_size);
+		cache_unpin(&slot, 1, scan);
+	}
+	return decompress_cluster(source != NULL ? source : packed,
+			(size_t) stored * block_size, target,
+			(size_t) EXTENT_BLOCKS(extent) * block_size) == 0 ? 0 : -2;
+}
+
+/*
+ * Function: export_vector
+ * Parameter(s): fd - output file
+ * vector - regions of the volume to write, consumed by the call
+ * count - number of regions
+ * Returns: 0 on success, -1 on a write error.
+ * Description: Writes the regions in order with writev, picking up after
+ * partial writes.
+ */
+int export_vector(int fd, struct iovec *vector, int count) {
+	ssize_t written;
+	while (count > 0) {
+		written = writev(fd, vector, count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		while (count > 0 && (size_t) written >= vector->iov_len) {
+			written -= vector->iov_len;
+			vector++, count--;
+		}
+		if (count > 0) {
+			vector->iov_base = (char*) vector->iov_base + written;
+			vector->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function: journal_bytes
+ * Parameter(s): metadata - bytes of metadata in front of the journal
+ * Returns: Bytes reserved for the journal.
+ * Description: Room for a record holding every metadata page at once, so
+ * a group commit always fits however much it changed.
+ */
+uint64_t journal_bytes(uint64_t metadata) {
+	uint64_t pages = metadata / JOURNAL_PAGE;
+	return PAGE_ALIGN(sizeof(JournalHeader) + pages * sizeof(uint32_t))
+			+ pages * JOURNAL_PAGE;
+}
+
+/*
+ * Function: open_journal
+ * Description: Sets up dirty page tracking for an image backed volume.
+ */
+void open_journal() {
+	meta_pages = superblock->journal_offset / JOURNAL_PAGE;
+	dirty_map = calloc(WORDS(meta_pages), sizeof(uint64_t));
+	page_list = malloc(PAGE_ALIGN(sizeof(JournalHeader)
+			+ meta_pages * sizeof(uint32_t)));
+	if (dirty_map == NULL || page_list == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	reserved_blocks = MAX_TREE_DEPTH;
+	journaling = SET;
+}
+
+/*
+ * Function: close_journal
+ * Description: Commits what is left, deferred frees included, then marks
+ * the image clean by invalidating the journal record.
+ */
+void close_journal() {
+	JournalHeader empty;
+	commit_journal();
+	commit_journal();
+	memset(&empty, 0, sizeof(empty));
+	if (fdatasync(meta_fd) < 0
+			|| pwrite(meta_fd, &empty, sizeof(empty), superblock->journal_offset)
+					!= sizeof(empty) || fdatasync(meta_fd) < 0) {
+		perror("mfs: journal");
+	}
+	free(dirty_map);
+	free(page_list);
+	free(pending_frees);
+	reserved_blocks = 0;
+	journaling = UNSET;
+}
+
+/*
+ * Function: log_range
+ * Parameter(s): address - start of changed metadata
+ * length - number of bytes changed
+ * Description: Adds the pages holding the bytes to the running transaction.
+ */
+void log_range(const void *address, size_t length) {
+	uint64_t page, last;
+	if (!journaling || length == 0) {
+		return;
+	}
+	page = ((const char*) address - (char*) volume) / JOURNAL_PAGE;
+	last = ((const char*) address + length - 1 - (char*) volume) / JOURNAL_PAGE;
+	if (dirty_count == 0 && pending_count == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &oldest_change);
+	}
+	for (; page <= last; page++) {
+		if (!(dirty_map[page / BITS_PER_WORD] & (1ULL << (page % BITS_PER_WORD)))) {
+			dirty_map[page / BITS_PER_WORD] |= 1ULL << (page % BITS_PER_WORD);
+			dirty_count++;
+		}
+	}
+}
+
+/*
+ * Function: release_blocks
+ * Parameter(s): start - first block
+ * length - number of blocks
+ * Description: Drops a deleted or abandoned file's hold on the blocks.
+ * Shared blocks lose an owner, the others leave the content index and are
+ * freed in runs.
+ */
+void release_blocks(uint32_t start, uint32_t length) {
+	uint32_t block, run;
+	for (block = start; block - start < length; block += run) {
+		if (block_refs[block] & MAX_SHARES) {
+			block_refs[block]--;
+			log_range(&block_refs[block], sizeof(uint16_t));
+			run = 1;
+			continue;
+		}
+		for (run = 0; block + run - start < length
+				&& !(block_refs[block + run] & MAX_SHARES); run++) {
+			if (block_refs[block + run] != 0) {
+				block_refs[block + run] = 0;
+				log_range(&block_refs[block + run], sizeof(uint16_t));
+			}
+		}
+		free_run(block, run);
+	}
+}
+
+/*
+ * Function: free_run
+ * Parameter(s): start - first block
+ * length - number of blocks
+ * Description: Frees blocks no file holds any more. With a journal the
+ * blocks are only freed once the change that dropped them is committed,
+ * otherwise a crash could bring the file back over reused blocks.
+ */
+void free_run(uint32_t start, uint32_t length) {
+	Extent *grown;
+	if (!journaling) {
+		set_block_range(start, length, UNSET);
+		return;
+	}
+	if (pending_count == pending_capacity) {
+		pending_capacity = pending_capacity ? 2 * pending_capacity : 64;
+		grown = realloc(pending_frees, pending_capacity * sizeof(Extent));
+		if (grown == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		pending_frees = grown;
+	}
+	if (dirty_count == 0 && pending_count == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &oldest_change);
+	}
+	pending_frees[pending_count].start = start;
+	pending_frees[pending_count].length = length;
+	pending_count++;
+	pending_blocks += length;
+}
+
+/*
+ * Function: maybe_commit
+ * Description: Group commit, run after every command. Changes are
+ * committed once the oldest of them has waited the commit interval.
+ */
+void maybe_commit() {
+	struct timespec now;
+	if (!journaling || (dirty_count == 0 && pending_count == 0)) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - oldest_change.tv_sec) * 1000
+			+ (now.tv_nsec - oldest_change.tv_nsec) / 1000000 >= commit_interval) {
+		commit_journal();
+	}
+}
+
+/*
+ * Function: commit_journal
+ * Description: Makes all changes since the last commit durable as one
+ * record: file data first, then the changed metadata pages with a checksum
+ * in the journal, then the same pages at home. The home writes are synced
+ * by the next commit before its record replaces this one. Frees waiting on
+ * the commit are applied afterwards and join the next transaction. The
+ * generation moves on, so directory tree nodes written so far are copied
+ * before they change.
+ */
+void commit_journal() {
+	JournalHeader *header = (JournalHeader*) page_list;
+	uint32_t *pages = (uint32_t*) (header + 1);
+	struct iovec vector[IOV_MAX];
+	uint64_t word, bits, page, run, checksum = JOURNAL_SEED;
+	uint64_t offset = superblock->journal_offset, list_size, batch_bytes;
+	int count, failed = 0;
+	if (!journaling || (dirty_count == 0 && pending_count == 0)) {
+		return;
+	}
+	flush_nodes();
+	superblock->generation++;
+	log_range(superblock, sizeof(Superblock));
+	header->page_count = 0;
+	for (word = 0; word < WORDS(meta_pages); word++) {
+		for (bits = dirty_map[word]; bits != 0; bits &= bits - 1) {
+			pages[header->page_count++] = word * BITS_PER_WORD
+					+ __builtin_ctzll(bits);
+		}
+	}
+	list_size = PAGE_ALIGN(sizeof(JournalHeader)
+			+ header->page_count * sizeof(uint32_t));
+	memset((char*) pages + header->page_count * sizeof(uint32_t), 0, list_size
+			- sizeof(JournalHeader) - header->page_count * sizeof(uint32_t));
+	checksum = fnv_checksum(pages, list_size - sizeof(JournalHeader), checksum);
+	for (page = 0; page < header->page_count; page++) {
+		checksum = fnv_checksum((char*) volume + (uint64_t) pages[page]
+				* JOURNAL_PAGE, JOURNAL_PAGE, checksum);
+	}
+	memcpy(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	header->checksum = checksum;
+
+	//-- Data the new metadata points to, and the previous checkpoint, must
+	//-- be on disk before the record.
+	failed |= fdatasync(meta_fd) < 0;
+	vector[0].iov_base = page_list;
+	vector[0].iov_len = list_size;
+	count = 1, batch_bytes = list_size;
+	for (page = 0; page < header->page_count; page++) {
+		vector[count].iov_base = (char*) volume
+				+ (uint64_t) pages[page] * JOURNAL_PAGE;
+		vector[count++].iov_len = JOURNAL_PAGE;
+		batch_bytes += JOURNAL_PAGE;
+		if (count == IOV_MAX || page + 1 == header->page_count) {
+			failed |= !failed && write_vector(meta_fd, vector, count, offset) < 0;
+			offset += batch_bytes;
+			count = 0, batch_bytes = 0;
+		}
+	}
+	failed |= fdatasync(meta_fd) < 0;
+	if (failed) {
+		perror("mfs: journal commit");
+		exit(EXIT_FAILURE);
+	}
+
+	//-- Checkpoint, runs of consecutive pages in one write each.
+	for (page = 0; page < header->page_count; page += run) {
+		for (run = 1; page + run < header->page_count
+				&& pages[page + run] == pages[page] + run; run++)
+			;
+		vector[0].iov_base = (char*) volume + (uint64_t) pages[page]
+				* JOURNAL_PAGE;
+		vector[0].iov_len = run * JOURNAL_PAGE;
+		if (write_vector(meta_fd, vector, 1,
+				(uint64_t) pages[page] * JOURNAL_PAGE) < 0) {
+			perror("mfs: checkpoint");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memset(dirty_map, 0, WORDS(meta_pages) * sizeof(uint64_t));
+	dirty_count = 0;
+
+	count = pending_count, pending_count = 0, pending_blocks = 0;
+	while (count > 0) {
+		count--;
+		set_block_range(pending_frees[count].start, pending_frees[count].length,
+				UNSET);
+	}
+}
+
+/*
+ * Function: write_vector
+ * Parameter(s): fd - file to write
+ * vector - buffers, consumed by the call
+ * count - number of buffers
+ * offset - file position
+ * Returns: 0 on success, -1 on a write error.
+ */
+int write_vector(int fd, struct iovec *vector, int count, uint64_t offset) {
+	ssize_t written;
+	while (count > 0) {
+		written = pwritev(fd, vector, count, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		offset += written;
+		while (count > 0 && (size_t) written >= vector->iov_len) {
+			written -= vector->iov_len;
+			vector++, count--;
+		}
+		if (count > 0) {
+			vector->iov_base = (char*) vector->iov_base + written;
+			vector->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function: fnv_checksum
+ * Parameter(s): data, length - bytes to add
+ * checksum - running value, JOURNAL_SEED to start
+ * Returns: 64 bit FNV-1a over the bytes, continuing the running value.
+ */
+uint64_t fnv_checksum(const void *data, size_t length, uint64_t checksum) {
+	const unsigned char *byte = data;
+	while (length-- > 0) {
+		checksum = (checksum ^ *byte++) * 1099511628211ULL;
+	}
+	return checksum;
+}
+
+/*
+ * Function: replay_journal
+ * Parameter(s): fd - image, not mapped yet
+ * header - the image's superblock
+ * Returns: SET if the image was not closed cleanly, i.e. a record is left
+ * in the journal.
+ * Description: Writes the pages of an intact record to their home location.
+ * A torn record leaves the image at its previous commit, whose checkpoint
+ * was synced before the record was written.
+ */
+int replay_journal(int fd, Superblock *header) {
+	uint64_t metadata_pages = header->journal_offset / JOURNAL_PAGE, list_size;
+	uint64_t page, image_bytes, checksum = JOURNAL_SEED;
+	JournalHeader record;
+	uint32_t *pages, *home;
+	unsigned char *images;
+	if (pread(fd, &record, sizeof(record), header->journal_offset)
+			!= sizeof(record)
+			|| memcmp(record.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC))) {
+		return UNSET;
+	}
+	if (record.page_count == 0 || record.page_count > metadata_pages) {
+		return SET;
+	}
+	list_size = PAGE_ALIGN(sizeof(JournalHeader)
+			+ record.page_count * sizeof(uint32_t));
+	image_bytes = (uint64_t) record.page_count * JOURNAL_PAGE;
+	pages = malloc(list_size);
+	images = malloc(image_bytes);
+	if (pages == NULL || images == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	if (pread(fd, pages, list_size, header->journal_offset)
+			== (ssize_t) list_size
+			&& pread(fd, images, image_bytes, header->journal_offset + list_size)
+					== (ssize_t) image_bytes) {
+		checksum = fnv_checksum((JournalHeader*) pages + 1,
+				list_size - sizeof(JournalHeader), checksum);
+		checksum = fnv_checksum(images, image_bytes, checksum);
+	}
+	if (checksum == record.checksum) {
+		home = (uint32_t*) ((JournalHeader*) pages + 1);
+		for (page = 0; page < record.page_count; page++) {
+			if (pwrite(fd, images + page * JOURNAL_PAGE, JOURNAL_PAGE,
+					(uint64_t) home[page] * JOURNAL_PAGE) != JOURNAL_PAGE) {
+				perror("mfs: journal replay");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (fdatasync(fd) < 0) {
+			perror("mfs: journal replay");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(pages);
+	free(images);
+	return SET;
+}
+
+/*
+ * Function: rebuild_volume
+ * Description: Recovery after an unclean shutdown. Blocks whose free was
+ * still waiting on a commit are lost to the bitmap, so it is rebuilt from
+ * the extent trees of the files and the directory trees, along with the
+ * inode counters. Reference counts are recounted the same way: a commit
+ * taken in the middle of a put can hold blocks and references of a file
+ * that never made it.
+ */
+void rebuild_volume() {
+	uint64_t bitmap_words = WORDS(total_blocks);
+	uint32_t counter;
+	for (counter = 0; counter < total_blocks; counter++) {
+		if (block_refs[counter] & MAX_SHARES) {
+			block_refs[counter] &= INDEXED_BLOCK;
+			log_range(&block_refs[counter], sizeof(uint16_t));
+		}
+	}
+	memset(block_map, 0, bitmap_words * sizeof(uint64_t));
+	memset(full_words, 0, WORDS(bitmap_words) * sizeof(uint64_t));
+	log_range(block_map, bitmap_words * sizeof(uint64_t));
+	log_range(full_words, WORDS(bitmap_words) * sizeof(uint64_t));
+	init_block_map();
+	superblock->inode_count = 0;
+	superblock->inode_high = 0;
+	superblock->logical_blocks = 0;
+	for (counter = next_inode(0, SET); counter < directory_size;
+			counter = next_inode(counter + 1, SET)) {
+		mark_tree(&directory[counter].tree);
+		if (inode_hot[counter].type == REGULAR_FILE) {
+			superblock->logical_blocks += (inode_hot[counter].size
+					+ block_size - 1) / block_size;
+		}
+		if (inode_hot[counter].type == DIRECTORY_FILE
+				&& directory[counter].root != NO_BLOCK) {
+			mark_entries(directory[counter].root);
+		}
+		superblock->inode_count++;
+		superblock->inode_high = counter + 1;
+	}
+	for (counter = 0; counter < total_blocks; counter++) {
+		if (block_refs[counter] != 0 && !(block_map[counter / BITS_PER_WORD]
+				& (1ULL << (counter % BITS_PER_WORD)))) {
+			block_refs[counter] = 0;
+			log_range(&block_refs[counter], sizeof(uint16_t));
+		}
+	}
+	log_range(superblock, sizeof(Superblock));
+}
+
+/*
+ * Function: mark_tree
+ * Parameter(s): node - extent tree node
+ * Description: Marks the blocks below the node used, index blocks included.
+ * A data block found marked already gains an owner.
+ */
+void mark_tree(ExtentHeader *node) {
+	Extent *entries = node_entries(node);
+	uint32_t block;
+	int counter;
+	for (counter = 0; counter < node->count; counter++) {
+		for (block = entries[counter].start; node->depth == 0
+				&& block - entries[counter].start < STORED_BLOCKS(&entries[counter]);
+				block++) {
+			if (block_map[block / BITS_PER_WORD]
+					& (1ULL << (block % BITS_PER_WORD))) {
+				block_refs[block]++;
+				log_range(&block_refs[block], sizeof(uint16_t));
+			}
+		}
+		set_block_range(entries[counter].start,
+				node->depth > 0 ? 1 : STORED_BLOCKS(&entries[counter]), SET);
+		if (node->depth > 0) {
+			mark_tree(tree_node(entries[counter].start));
+		}
+	}
+}
+
+/*
+ * Function: init_block_map
+ * Description: Marks all blocks free. Bits past the last block in the final
+ * bitmap word, and summary bits past the last word, are marked used so the
+ * search never hands them out. The fresh mapping is already zero, so only
+ * those tail words are written.
+ */
+void init_block_map() {
+	uint64_t block, word, bitmap_words = WORDS(total_blocks);
+	for (block = total_blocks; block < bitmap_words * BITS_PER_WORD; block++) {
+		block_map[block / BITS_PER_WORD] |= 1ULL << (block % BITS_PER_WORD);
+	}
+	for (word = bitmap_words; word < WORDS(bitmap_words) * BITS_PER_WORD;
+			word++) {
+		full_words[word / BITS_PER_WORD] |= 1ULL << (word % BITS_PER_WORD);
+	}
+	log_range(&block_map[bitmap_words - 1], sizeof(uint64_t));
+	log_range(&full_words[WORDS(bitmap_words) - 1], sizeof(uint64_t));
+	superblock->free_blocks = total_blocks;
+	superblock->next_fit = 0;
+	log_range(superblock, sizeof(Superblock));
+}
+
+/*
+ * Function: allocate_extent
+ * Parameter(s): wanted - number of blocks still needed by the file
+ * extent - receives the allocated run
+ * Returns: Number of blocks allocated, at most 'wanted'.
+ * Description: Claims a run of contiguous free blocks. The bitmap is walked
+ * from the next-fit cursor (wrapping around once) and the first run of at
+ * least 'wanted' blocks is taken; failing that, the longest run seen. Callers
+ * get 0 back when the disk is full.
+ */
+int allocate_extent(int wanted, Extent *extent) {
+	int ranges[2][2] = { { superblock->next_fit, total_blocks }, { 0,
+			superblock->next_fit } };
+	int range, block, end, best_start = -1, best_length = 0;
+	extent->length = 0;
+	if (superblock->free_blocks == 0) {
+		return 0;
+	}
+	for (range = 0; range < 2 && best_length < wanted; range++) {
+		block = ranges[range][0];
+		while (block < ranges[range][1]) {
+			block = find_block(block, ranges[range][1], UNSET);
+			if (block >= ranges[range][1]) {
+				break;
+			}
+			end = find_block(block, ranges[range][1], SET);
+			if (end - block > best_length) {
+				best_start = block, best_length = end - block;
+				if (best_length >= wanted) {
+					break;
+				}
+			}
+			block = end;
+		}
+	}
+	if (best_length > wanted) {
+		best_length = wanted;
+	}
+	set_block_range(best_start, best_length, SET);
+	superblock->next_fit = (best_start + best_length) % total_blocks;
+	extent->start = best_start;
+	extent->length = best_length;
+	return best_length;
+}
+
+/*
+ * Function: find_block
+ * Parameter(s): from, to - block range to search
+ * state - UNSET to look for a free block, SET for a used one
+ * Returns: First block in [from, to) in the given state, 'to' if none.
+ * Description: Word at a time search with count-trailing-zeros. While looking
+ * for a free block, groups of full words are skipped via the summary level.
+ */
+int find_block(int from, int to, State state) {
+	int word, group_bits = BITS_PER_WORD * BITS_PER_WORD;
+	uint64_t bits;
+	while (from < to) {
+		word = from / BITS_PER_WORD;
+		if (state == UNSET && from % group_bits == 0
+				&& full_words[word / BITS_PER_WORD] == ~0ULL) {
+			from += group_bits;
+			continue;
+		}
+		bits = state == SET ? block_map[word] : ~block_map[word];
+		bits &= ~0ULL << (from % BITS_PER_WORD);
+		if (bits != 0) {
+			from = word * BITS_PER_WORD + __builtin_ctzll(bits);
+			return from < to ? from : to;
+		}
+		from = (word + 1) * BITS_PER_WORD;
+	}
+	return to;
+}
+
+/*
+ * Function: set_block_range
+ * Parameter(s): start - first block
+ * length - number of blocks
+ * state - SET to mark the blocks used, UNSET to release them
+ * Description: Updates the bitmap a word at a time, along with its summary
+ * level and the free count, and logs the change.
+ */
+void set_block_range(int start, int length, State state) {
+	int word, first, count;
+	uint64_t mask;
+	while (length > 0) {
+		word = start / BITS_PER_WORD, first = start % BITS_PER_WORD;
+		count = BITS_PER_WORD - first < length ? BITS_PER_WORD - first : length;
+		mask = (count == BITS_PER_WORD ? ~0ULL : ((1ULL << count) - 1)) << first;
+		if (state == SET) {
+			superblock->free_blocks -= __builtin_popcountll(mask & ~block_map[word]);
+			block_map[word] |= mask;
+			if (block_map[word] == ~0ULL) {
+				full_words[word / BITS_PER_WORD] |= 1ULL << (word % BITS_PER_WORD);
+			}
+		} else {
+			superblock->free_blocks += __builtin_popcountll(mask & block_map[word]);
+			block_map[word] &= ~mask;
+			full_words[word / BITS_PER_WORD] &= ~(1ULL << (word % BITS_PER_WORD));
+		}
+		log_range(&block_map[word], sizeof(uint64_t));
+		log_range(&full_words[word / BITS_PER_WORD], sizeof(uint64_t));
+		start += count, length -= count;
+	}
+	log_range(superblock, sizeof(Superblock));
+}
+
+/*
+ * Function: release_extents
+ * Parameter(s): inode - file whose blocks are given back
+ * Description: Frees every extent of the file along with its index blocks.
+ */
+void release_extents(Inode *inode) {
+	release_node(&inode->tree);
+	init_extent_tree(inode);
+}
+
+/*
+ * Function: init_extent_tree
+ * Parameter(s): inode - file to start with an empty extent map
+ * Description: Makes the inline entries an empty leaf.
+ */
+void init_extent_tree(Inode *inode) {
+	inode->tree.count = 0;
+	inode->tree.max = INLINE_EXTENTS;
+	inode->tree.depth = 0;
+	inode->tree.unused = 0;
+	inode->tree.generation = 0;
+}
+
+/*
+ * Function: node_entries
+ * Parameter(s): node - extent tree node, inline or in a block
+ * Returns: The node's entry array.
+ */
+Extent *node_entries(ExtentHeader *node) {
+	return (Extent*) (node + 1);
+}
+
+/*
+ * Function: tree_node
+ * Parameter(s): block - block holding an index node
+ * Returns: The node stored in the block, its resident copy in cache mode.
+ */
+ExtentHeader *tree_node(uint32_t block) {
+	if (cache.size > 0) {
+		return (ExtentHeader*) node_buffer(block, UNSET);
+	}
+	return (ExtentHeader*) block_data(block);
+}
+
+/*
+ * Function: edit_node
+ * Parameter(s): block - block holding an index node about to change
+ * Returns: The node stored in the block.
+ * Description: Like tree_node, and has cache mode write the node back.
+ */
+ExtentHeader *edit_node(uint32_t block) {
+	ExtentHeader *node = tree_node(block);
+	if (cache.size > 0) {
+		mark_node(block);
+	}
+	return node;
+}
+
+/*
+ * Function: free_node
+ * Parameter(s): block - block of an index node no longer needed
+ * Description: Gives the block back, along with a resident copy.
+ */
+void free_node(uint32_t block) {
+	release_blocks(block, 1);
+	if (cache.size > 0) {
+		forget_node(block);
+	}
+}
+
+/*
+ * Function: append_extent
+ * Parameter(s): inode - file being extended
+ * extent - run mapping the blocks right after the file's current end
+ * Returns: 0 on success, -1 if no block was left for a new index node.
+ * Description: Adds the extent at the right edge of the tree, merging it into
+ * the last one when both are contiguous. When the inline root fills up its
+ * entries move to a block and the root becomes an index one level higher.
+ */
+int append_extent(Inode *inode, Extent *extent) {
+	ExtentHeader *root = &inode->tree, *moved;
+	uint32_t sibling, block;
+	int status = append_to_node(root, extent, &sibling);
+	if (status <= 0) {
+		return status;
+	}
+	if (root->depth + 1 == MAX_TREE_DEPTH || new_tree_node(root->depth, &block)) {
+		release_spine(sibling);
+		return -1;
+	}
+	moved = tree_node(block);
+	moved->count = root->count;
+	memcpy(node_entries(moved), node_entries(root), root->count * sizeof(Extent));
+	root->depth++;
+	root->count = 2;
+	node_entries(root)[0].logical = node_entries(moved)[0].logical;
+	node_entries(root)[0].start = block;
+	node_entries(root)[0].length = 0;
+	node_entries(root)[1].logical = extent->logical;
+	node_entries(root)[1].start = sibling;
+	node_entries(root)[1].length = 0;
+	return 0;
+}
+
+/*
+ * Function: append_to_node
+ * Parameter(s): node - subtree on the right edge of the tree
+ * extent - run to append
+ * sibling - receives the block of a new right sibling of 'node'
+ * Returns: 0 once the extent is placed, 1 when it went into a new sibling
+ * which the parent still has to point to, -1 when out of blocks.
+ */
+int append_to_node(ExtentHeader *node, Extent *extent, uint32_t *sibling) {
+	Extent *entries = node_entries(node), *last = &entries[node->count - 1];
+	uint32_t child;
+	int status;
+	if (node->depth == 0) {
+		//-- Compressed clusters stay entries of their own.
+		if (node->count > 0 && !((last->length | extent->length)
+				& COMPRESSED_EXTENT)
+				&& last->logical + last->length == extent->logical
+				&& last->start + last->length == extent->start
+				&& last->length < COMPRESSED_EXTENT - extent->length) {
+			last->length += extent->length;
+			return 0;
+		}
+		if (node->count < node->max) {
+			entries[node->count++] = *extent;
+			return 0;
+		}
+		if (new_tree_node(0, sibling)) {
+			return -1;
+		}
+		node_entries(tree_node(*sibling))[0] = *extent;
+		tree_node(*sibling)->count = 1;
+		return 1;
+	}
+	status = append_to_node(edit_node(last->start), extent, &child);
+	if (status <= 0) {
+		return status;
+	}
+	if (node->count < node->max) {
+		entries[node->count].logical = extent->logical;
+		entries[node->count].start = child;
+		entries[node->count].length = 0;
+		node->count++;
+		return 0;
+	}
+	if (new_tree_node(node->depth, sibling)) {
+		release_spine(child);
+		return -1;
+	}
+	entries = node_entries(tree_node(*sibling));
+	entries[0].logical = extent->logical;
+	entries[0].start = child;
+	entries[0].length = 0;
+	tree_node(*sibling)->count = 1;
+	return 1;
+}
+
+/*
+ * Function: new_tree_node
+ * Parameter(s): depth - level of the node, 0 for a leaf
+ * block - receives the node's block
+ * Returns: 0 on success, -1 if the disk is full.
+ * Description: Claims one block and lays out an empty node in it.
+ */
+int new_tree_node(int depth, uint32_t *block) {
+	Extent run;
+	ExtentHeader *node;
+	if (allocate_extent(1, &run) == 0) {
+		return -1;
+	}
+	*block = run.start;
+	if (cache.size > 0) {
+		cache_invalidate(run.start, 1);
+		node_buffer(run.start, SET);
+	}
+	node = edit_node(run.start);
+	node->count = 0;
+	node->max = EXTENT_CAPACITY;
+	node->depth = depth;
+	node->unused = 0;
+	node->generation = superblock->generation;
+	return 0;
+}
+
+/*
+ * Function: release_node
+ * Parameter(s): node - root of the subtree to free
+ * Description: Frees the data runs below the node and the blocks of its
+ * child nodes, the node itself is left to the caller. Nodes are only read,
+ * a committed tree stays intact on disk until its blocks are reused.
+ */
+void release_node(ExtentHeader *node) {
+	Extent *entries = node_entries(node);
+	int counter;
+	for (counter = 0; counter < node->count; counter++) {
+		if (node->depth > 0) {
+			release_node(tree_node(entries[counter].start));
+			free_node(entries[counter].start);
+		} else {
+			release_blocks(entries[counter].start,
+					STORED_BLOCKS(&entries[counter]));
+		}
+	}
+}
+
+/*
+ * Function: release_spine
+ * Parameter(s): block - top of a chain of freshly split off nodes
+ * Description: Undoes a failed append. Only the node blocks are freed, the
+ * data run stays with the caller.
+ */
+void release_spine(uint32_t block) {
+	ExtentHeader *node = tree_node(block);
+	if (node->depth > 0) {
+		release_spine(node_entries(node)[0].start);
+	}
+	free_node(block);
+}
+
+/*
+ * Function: edit_extent_node
+ * Parameter(s): block - block of a node about to change, receives the block
+ * of its copy
+ * Returns: The node to change, NULL if no block was left for the copy.
+ * Description: The extent counterpart of edit_entry_node: a node written
+ * before the last commit is copied to a new block and the old one freed once
+ * that commit is durable. The caller points the parent at the copy.
+ */
+ExtentHeader *edit_extent_node(uint32_t *block) {
+	ExtentHeader *node = tree_node(*block), *copy;
+	uint32_t fresh;
+	if (!journaling || node->generation == superblock->generation) {
+		return edit_node(*block);
+	}
+	if (new_tree_node(node->depth, &fresh)) {
+		return NULL;
+	}
+	copy = tree_node(fresh);
+	memcpy(copy, node, block_size);
+	copy->generation = superblock->generation;
+	free_node(*block);
+	*block = fresh;
+	return copy;
+}
+
+/*
+ * Function: splice_extents
+ * Parameter(s): inode - file whose map changes
+ * pieces - runs in logical order, covering blocks of one extent of the file
+ * or following its last block
+ * count - number of pieces, at most MAX_SPLICE
+ * Returns: 0 on success, -1 if the tree would grow too deep or no block was
+ * left for a node.
+ * Description: Maps the blocks the pieces cover to them instead. The rest
+ * of the extent stays mapped on either side of them; its old blocks are left
+ * to the caller. A full inline root moves to a block first and the root
+ * grows by one level. The caller has reserved SPLICE_BLOCKS for the nodes.
+ */
+int splice_extents(Inode *inode, Extent *pieces, int count) {
+	ExtentHeader *root = &inode->tree, *moved;
+	Extent split;
+	uint32_t block;
+	int need = root->depth == 0 ? count + 1 : 1;
+	if (root->count + need > root->max) {
+		if (root->depth + 1 == MAX_TREE_DEPTH
+				|| new_tree_node(root->depth, &block)) {
+			return -1;
+		}
+		moved = tree_node(block);
+		moved->count = root->count;
+		memcpy(node_entries(moved), node_entries(root),
+				root->count * sizeof(Extent));
+		root->depth++;
+		root->count = 1;
+		node_entries(root)[0].logical = moved->count > 0 ?
+				node_entries(moved)[0].logical : pieces[0].logical;
+		node_entries(root)[0].start = block;
+		node_entries(root)[0].length = 0;
+	}
+	return splice_node(root, pieces, count, &split) < 0 ? -1 : 0;
+}
+
+/*
+ * Function: splice_node
+ * Parameter(s): node - subtree holding the blocks the pieces cover, safe to
+ * change
+ * pieces, count - as for splice_extents
+ * split - receives the entry for a new right sibling of 'node'
+ * Returns: 0 once the pieces are placed, 1 when the node split and the
+ * parent still has to take 'split', -1 when out of blocks.
+ * Description: The leaf entry holding the first piece is replaced by what
+ * is left of it before the pieces, the pieces, and what is left after them,
+ * runs that follow on from each other merged.
+ */
+int splice_node(ExtentHeader *node, Extent *pieces, int count, Extent *split) {
+	Extent *entries = node_entries(node), added[MAX_SPLICE + 2], old;
+	Extent *last = &pieces[count - 1];
+	uint32_t logical = pieces[0].logical, end = 0;
+	uint32_t after = last->logical + EXTENT_BLOCKS(last);
+	int position = extent_position(node, logical), total = 0, merged, counter;
+	int replace = 0, right = UNSET;
+	ExtentHeader *child;
+	if (node->depth > 0) {
+		position = position < 0 ? 0 : position;
+		child = edit_extent_node(&entries[position].start);
+		if (child == NULL) {
+			return -1;
+		}
+		counter = splice_node(child, pieces, count, &old);
+		return counter <= 0 ? counter : place_extents(node, position + 1, 0,
+				&old, 1, split);
+	}
+	if (position < 0) {
+		position = 0;
+	} else {
+		old = entries[position];
+		end = old.logical + EXTENT_BLOCKS(&old);
+		//-- Clusters are replaced whole, so only raw runs are cut.
+		if (logical >= end) {
+			added[total++] = old;
+		} else if (logical > old.logical) {
+			added[total] = old;
+			added[total++].length = logical - old.logical;
+		}
+		right = after < end;
+		replace = 1;
+	}
+	memcpy(&added[total], pieces, count * sizeof(Extent));
+	total += count;
+	if (right) {
+		added[total].logical = after;
+		added[total].start = old.start + (after - old.logical);
+		added[total++].length = end - after;
+	}
+	for (counter = 1, merged = 0; counter < total; counter++) {
+		if (!((added[merged].length | added[counter].length)
+				& COMPRESSED_EXTENT)
+				&& added[merged].logical + added[merged].length
+						== added[counter].logical
+				&& added[merged].start + added[merged].length
+						== added[counter].start
+				&& added[merged].length
+						< COMPRESSED_EXTENT - added[counter].length) {
+			added[merged].length += added[counter].length;
+		} else {
+			added[++merged] = added[counter];
+		}
+	}
+	return place_extents(node, position, replace, added, merged + 1, split);
+}
+
+/*
+ * Function: place_extents
+ * Parameter(s): node - node to change
+ * position - first entry replaced
+ * replace - number of entries replaced
+ * added, count - entries put in their place
+ * split - receives the entry for a new right sibling of 'node'
+ * Returns: 0 if the entries fit, 1 if the node was split in half to take
+ * them, -1 if no block was left for the sibling.
+ */
+int place_extents(ExtentHeader *node, int position, int replace,
+		Extent *added, int count, Extent *split) {
+	Extent *entries = node_entries(node), *all;
+	int total = node->count - replace + count, tail, half;
+	uint32_t block;
+	ExtentHeader *sibling;
+	tail = node->count - position - replace;
+	if (total <= node->max) {
+		memmove(&entries[position + count], &entries[position + replace],
+				tail * sizeof(Extent));
+		memcpy(&entries[position], added, count * sizeof(Extent));
+		node->count = total;
+		return 0;
+	}
+	if (new_tree_node(node->depth, &block)) {
+		return -1;
+	}
+	all = malloc(total * sizeof(Extent));
+	if (all == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(all, entries, position * sizeof(Extent));
+	memcpy(&all[position], added, count * sizeof(Extent));
+	memcpy(&all[position + count], &entries[position + replace],
+			tail * sizeof(Extent));
+	half = total / 2;
+	sibling = tree_node(block);
+	memcpy(entries, all, half * sizeof(Extent));
+	node->count = half;
+	memcpy(node_entries(sibling), &all[half], (total - half) * sizeof(Extent));
+	sibling->count = total - half;
+	split->logical = all[half].logical;
+	split->start = block;
+	split->length = 0;
+	free(all);
+	return 1;
+}
+
+/*
+ * Function: lookup_extent
+ * Parameter(s): inode - file to search
+ * logical - block offset within the file
+ * Returns: The leaf extent holding the block, NULL past the end of the file.
+ * Description: Binary searches each level for the last entry starting at or
+ * before the block.
+ */
+Extent *lookup_extent(Inode *inode, uint32_t logical) {
+	ExtentHeader *node = &inode->tree;
+	Extent *entry;
+	int position;
+	while ((position = extent_position(node, logical)) >= 0) {
+		entry = &node_entries(node)[position];
+		if (node->depth == 0) {
+			return logical - entry->logical < EXTENT_BLOCKS(entry) ? entry : NULL;
+		}
+		node = tree_node(entry->start);
+	}
+	return NULL;
+}
+
+/*
+ * Function: extent_position
+ * Parameter(s): node - extent tree node
+ * logical - block offset within the file
+ * Returns: The last entry starting at or before the block, NEGATIVE if there
+ * is none.
+ */
+int extent_position(ExtentHeader *node, uint32_t logical) {
+	Extent *entries = node_entries(node);
+	int low = 0, high = node->count - 1, middle;
+	while (low < high) {
+		middle = (low + high + 1) / 2;
+		if (entries[middle].logical <= logical) {
+			low = middle;
+		} else {
+			high = middle - 1;
+		}
+	}
+	return node->count == 0 || entries[low].logical > logical ? NEGATIVE : low;
+}
+
+/*
+ * Function: first_extent
+ * Parameter(s): inode - file to walk
+ * cursor - walk state
+ * Returns: The file's first extent, NULL for an empty file.
+ */
+Extent *first_extent(Inode *inode, ExtentCursor *cursor) {
+	cursor->level = 0;
+	cursor->nodes[0] = &inode->tree;
+	cursor->positions[0] = -1;
+	return next_extent(cursor);
+}
+
+/*
+ * Function: next_extent
+ * Parameter(s): cursor - walk state
+ * Returns: The extent following the previous one, NULL at the end.
+ * Description: Climbs to the nearest node with entries left and descends its
+ * next child down to the leaf level.
+ */
+Extent *next_extent(ExtentCursor *cursor) {
+	ExtentHeader *node;
+	while (cursor->positions[cursor->level] + 1
+			>= cursor->nodes[cursor->level]->count) {
+		if (cursor->level == 0) {
+			return NULL;
+		}
+		cursor->level--;
+	}
+	cursor->positions[cursor->level]++;
+	node = cursor->nodes[cursor->level];
+	while (node->depth > 0) {
+		node = tree_node(node_entries(node)[cursor->positions[cursor->level]].start);
+		cursor->level++;
+		cursor->nodes[cursor->level] = node;
+		cursor->positions[cursor->level] = 0;
+	}
+	return &node_entries(node)[cursor->positions[cursor->level]];
+}
+
+/*
+ * Function: defragment
+ * Parameter(s): budget - blocks to move at most, all it takes if missing
+ * Description: Moves fragmented files into runs of their own and files
+ * that are whole into the lowest free run they fit, which gathers the free
+ * space towards the end of the volume. Without a budget it makes passes
+ * until nothing moves; a budget makes the work incremental, the next
+ * defrag picks up at the file this one stopped at. Prints the
+ * fragmentation before and after.
+ */
+void defragment(char *budget) {
+	uint64_t limit = UINT64_MAX, moved = 0, pass;
+	uint32_t files = 0;
+	if (budget != NULL && !parse_offset(budget, &limit)) {
+		print_message("defrag error: Usage is defrag [blocks].");
+		return;
+	}
+	if (budget == NULL) {
+		defrag_cursor = 0;
+	}
+	//-- Blocks waiting on a commit are not free yet. Files only ever move
+	//-- down once whole, so passes over the volume come to an end.
+	commit_journal();
+	print_fragmentation("before");
+	do {
+		pass = defrag_step(limit - moved, superblock->inode_high, &files);
+		moved += pass;
+		commit_journal();
+	} while (budget == NULL && pass > 0);
+	print_fragmentation("after");
+	fprintf(output, "defrag: %llu blocks of %u files moved.\n",
+			(unsigned long long) moved, files);
+	flush_output();
+}
+
+/*
+ * Function: defrag_step
+ * Parameter(s): budget - blocks to move, a file started is finished
+ * scan - files to look at at most
+ * files - counts the files moved, may be NULL
+ * Returns: Number of blocks moved.
+ * Description: Walks the inodes from defrag_cursor on, wrapping around. A
+ * file's score is the number of runs it is split into on disk; one scoring
+ * above 1 moves to the lowest free run that takes it whole, one scoring 1
+ * only if that run lies below it. Files sharing blocks with others stay
+ * put, the other owners would have to move along. A commit is made when
+ * only blocks still waiting on one would leave room.
+ */
+uint64_t defrag_step(uint64_t budget, uint32_t scan, uint32_t *files) {
+	uint64_t moved = 0;
+	uint32_t stored, extents, limit, visited;
+	int fragments, index;
+	short shared;
+	Inode *inode;
+	ExtentCursor cursor;
+	Extent target;
+	for (visited = 0; visited < scan && moved < budget; visited++) {
+		if (defrag_cursor >= superblock->inode_high) {
+			defrag_cursor = 0;
+		}
+		//-- Inodes not in use are skipped over in the bitmap.
+		index = next_inode(defrag_cursor, SET);
+		defrag_cursor = index + 1;
+		if ((uint32_t) index >= superblock->inode_high
+				|| inode_hot[index].type != REGULAR_FILE) {
+			continue;
+		}
+		inode = &directory[index];
+		fragments = file_fragments(inode, &stored, &extents, &shared);
+		if (fragments == 0 || shared) {
+			continue;
+		}
+		limit = fragments > 1 ? total_blocks : first_extent(inode, &cursor)->start;
+		//-- The new tree takes at most as many nodes as a tree built by put.
+		if (!reserve_blocks(reserved_blocks + stored + 2 * extents
+				/ EXTENT_CAPACITY + MAX_TREE_DEPTH)
+				|| (!lowest_run(stored, limit, &target) && (pending_count == 0
+				|| (commit_journal(), !lowest_run(stored, limit, &target))))) {
+			continue;
+		}
+		if (relocate_file(index, &target) == 0) {
+			moved += stored;
+			if (files != NULL) {
+				(*files)++;
+			}
+		}
+	}
+	return moved;
+}
+
+/*
+ * Function: file_fragments
+ * Parameter(s): inode - file to look at
+ * stored - receives the blocks the file takes on disk
+ * extents - receives the number of its extents
+ * shared - receives SET if any of its blocks has another owner
+ * Returns: Number of runs of consecutive blocks the file is split into, 0
+ * for an empty file. Compressed clusters packed one after the other count
+ * as one run.
+ */
+int file_fragments(Inode *inode, uint32_t *stored, uint32_t *extents,
+		short *shared) {
+	ExtentCursor cursor;
+	Extent *extent;
+	uint32_t next = NO_BLOCK, counter;
+	int fragments = 0;
+	*stored = 0, *extents = 0, *shared = UNSET;
+	for (extent = first_extent(inode, &cursor); extent != NULL;
+			extent = next_extent(&cursor)) {
+		fragments += extent->start != next;
+		next = extent->start + STORED_BLOCKS(extent);
+		*stored += STORED_BLOCKS(extent);
+		(*extents)++;
+		for (counter = extent->start; counter < next && !*shared; counter++) {
+			*shared = (block_refs[counter] & MAX_SHARES) > 0;
+		}
+	}
+	return fragments;
+}
+
+/*
+ * Function: lowest_run
+ * Parameter(s): wanted - blocks needed
+ * below - block the run must start before
+ * run - receives the run, claimed
+ * Returns: SET if a free run of 'wanted' blocks was found.
+ * Description: First fit from the start of the volume, unlike
+ * allocate_extent, so files settle at the front and the free space behind
+ * them.
+ */
+int lowest_run(uint32_t wanted, uint32_t below, Extent *run) {
+	int block = 0, end;
+	while ((block = find_block(block, below, UNSET)) < (int) below) {
+		end = find_block(block, total_blocks, SET);
+		if ((uint32_t) (end - block) >= wanted) {
+			set_block_range(block, wanted, SET);
+			run->start = block;
+			run->length = wanted;
+			if (cache.size > 0) {
+				cache_invalidate(block, wanted);
+			}
+			return SET;
+		}
+		block = end;
+	}
+	return UNSET;
+}
+
+/*
+ * Function: relocate_file
+ * Parameter(s): index - inode of a file none of whose blocks are shared
+ * target - claimed run as long as the blocks the file takes
+ * Returns: 0 on success, -1 if no block was left for a node, -2 on an I/O
+ * error. The run is given back on failure.
+ * Description: Copies the blocks into the run in logical order and builds a
+ * new extent tree over them, while gets go on reading the old copy; only
+ * the swap takes the file's lock. The old blocks and nodes are freed with
+ * the next commit, so the committed tree stays recoverable until then.
+ */
+int relocate_file(int index, Extent *target) {
+	static unsigned char *buffer;
+	Inode *inode = &directory[index], moved;
+	ExtentCursor cursor;
+	Extent *extent, piece;
+	uint32_t placed = 0, stored, offset, count;
+	uint32_t chunk = DIRECT_CHUNK / block_size;
+	int status = 0;
+	if (buffer == NULL && posix_memalign((void**) &buffer, DIRECT_ALIGN,
+			DIRECT_CHUNK)) {
+		status = -2;
+	}
+	init_extent_tree(&moved);
+	for (extent = first_extent(inode, &cursor); extent != NULL && status == 0;
+			extent = next_extent(&cursor)) {
+		stored = STORED_BLOCKS(extent);
+		for (offset = 0; offset < stored && status == 0; offset += count) {
+			count = stored - offset < chunk ? stored - offset : chunk;
+			status = copy_blocks(extent->start + offset,
+					target->start + placed + offset, count, buffer);
+		}
+		piece = *extent;
+		piece.start = target->start + placed;
+		if (status == 0 && append_extent(&moved, &piece) < 0) {
+			status = -1;
+		}
+		placed += status == 0 ? stored : 0;
+	}
+	if (status < 0) {
+		release_node(&moved.tree);
+		set_block_range(target->start + placed, target->length - placed, UNSET);
+		return status;
+	}
+	pthread_rwlock_wrlock(inode_lock(index));
+	release_node(&inode->tree);
+	memcpy(&inode->tree, &moved.tree,
+			sizeof(ExtentHeader) + sizeof(inode->extents));
+	pthread_rwlock_unlock(inode_lock(index));
+	log_range(inode, sizeof(Inode));
+	return 0;
+}
+
+/*
+ * Function: copy_blocks
+ * Parameter(s): from - first block to copy
+ * to - first block of the copy
+ * count - number of blocks, at most a DIRECT_CHUNK
+ * buffer - staging for cache mode, aligned for direct I/O
+ * Returns: 0 on success, -2 on an I/O error.
+ */
+int copy_blocks(uint32_t from, uint32_t to, uint32_t count,
+		unsigned char *buffer) {
+	if (cache.size == 0) {
+		memcpy(block_data(to), block_data(from), (size_t) count * block_size);
+		return 0;
+	}
+	if (transfer_io(UNSET, image_fd, buffer, (size_t) count * block_size,
+			superblock->data_offset + (uint64_t) from * block_size) < 0) {
+		return -2;
+	}
+	return store_blocks(to, buffer, count);
+}
+
+/*
+ * Function: print_fragmentation
+ * Parameter(s): label - heads the report
+ * Description: Prints how many runs files are split into and how long the
+ * free runs are, each as a histogram over powers of two.
+ */
+void print_fragmentation(const char *label) {
+	uint64_t files[HISTOGRAM_BUCKETS] = { 0 }, runs[HISTOGRAM_BUCKETS] = { 0 };
+	uint64_t *histogram, total_files = 0, total_fragments = 0, free_runs = 0;
+	uint32_t index, stored, extents, length, largest = 0;
+	int fragments, block = 0, end, bucket, pass;
+	short shared;
+	for (index = next_inode(0, SET); index < superblock->inode_high;
+			index = next_inode(index + 1, SET)) {
+		if (inode_hot[index].type != REGULAR_FILE
+				|| (fragments = file_fragments(&directory[index], &stored,
+						&extents, &shared)) == 0) {
+			continue;
+		}
+		for (bucket = 0; bucket < HISTOGRAM_BUCKETS - 1
+				&& fragments >> (bucket + 1) > 0; bucket++)
+			;
+		files[bucket]++;
+		total_files++;
+		total_fragments += fragments;
+	}
+	while ((block = find_block(block, total_blocks, UNSET)) < (int) total_blocks) {
+		end = find_block(block, total_blocks, SET);
+		length = end - block;
+		for (bucket = 0; bucket < HISTOGRAM_BUCKETS - 1
+				&& length >> (bucket + 1) > 0; bucket++)
+			;
+		runs[bucket]++;
+		free_runs++;
+		largest = length > largest ? length : largest;
+		block = end;
+	}
+	fprintf(output, "%s: %llu files in %llu runs, %lld free blocks in %llu "
+			"runs, the longest %u\n", label, (unsigned long long) total_files,
+			(unsigned long long) total_fragments,
+			(long long) superblock->free_blocks,
+			(unsigned long long) free_runs, largest);
+	for (pass = 0; pass < 2; pass++) {
+		histogram = pass == 0 ? files : runs;
+		fprintf(output, "%s", pass == 0 ? "  runs per file: " :
+				"  free run blocks:");
+		for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+			if (bucket == 0) {
+				fprintf(output, " 1:");
+			} else if (bucket == HISTOGRAM_BUCKETS - 1) {
+				fprintf(output, " %d+:", 1 << bucket);
+			} else {
+				fprintf(output, " %d-%d:", 1 << bucket, (2 << bucket) - 1);
+			}
+			fprintf(output, "%llu", (unsigned long long) histogram[bucket]);
+		}
+		fprintf(output, "\n");
+	}
+}
+
+/*
+ * Function: open_cache
+ * Parameter(s): image - path of the disk image
+ * Description: Opens the image again with O_DIRECT for the data region and
+ * sets up the block cache and the index node table. File systems without direct
+ * I/O get the cache over ordinary reads and writes.
+ */
+void open_cache(const char *image) {
+	int slot, fd = open(image, O_RDWR | O_DIRECT);
+	if (fd < 0 && errno == EINVAL) {
+		fprintf(stderr, "%s: No direct I/O, caching over the page cache.\n",
+				image);
+		fd = open(image, O_RDWR);
+	}
+	if (fd < 0) {
+		perror(image);
+		exit(EXIT_FAILURE);
+	}
+	image_fd = fd;
+	cache.size = cache_bytes / block_size;
+	if (cache.size < MIN_CACHE_BLOCKS) {
+		cache.size = MIN_CACHE_BLOCKS;
+	}
+	for (cache.table_size = 2; cache.table_size < 2 * cache.size;
+			cache.table_size *= 2)
+		;
+	cache.slots = calloc(cache.size, sizeof(CacheSlot));
+	cache.table = malloc(cache.table_size * sizeof(int));
+	cache.free_slots = malloc(cache.size * sizeof(int));
+	node_table_size = 64;
+	node_table = calloc(node_table_size, sizeof(NodeSlot));
+	if (cache.slots == NULL || cache.table == NULL || node_table == NULL
+			|| cache.free_slots == NULL
+			|| posix_memalign((void**) &cache.buffers, DIRECT_ALIGN,
+					(size_t) cache.size * block_size)) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (slot = 0; slot < cache.table_size; slot++) {
+		cache.table[slot] = NEGATIVE;
+	}
+	for (slot = cache.size - 1; slot >= 0; slot--) {
+		cache.free_slots[cache.free_count++] = slot;
+	}
+	cache.last_block = UINT32_MAX - 1;
+	cache.window = 1;
+}
+
+/*
+ * Function: close_cache
+ * Description: Writes back dirty index nodes and frees the cache and the
+ * I/O engine of the calling thread.
+ */
+void close_cache() {
+	int slot;
+	close_engine();
+	flush_nodes();
+	for (slot = 0; slot < node_table_size; slot++) {
+		free(node_table[slot].buffer);
+	}
+	free(node_table);
+	free(cache.slots);
+	free(cache.table);
+	free(cache.free_slots);
+	free(cache.buffers);
+	node_table = NULL;
+	cache.size = 0;
+}
+
+/*
+ * Function: block_hash
+ * Parameter(s): block - block number
+ * Returns: Multiplicative hash of the block number.
+ */
+uint32_t block_hash(uint32_t block) {
+	return block * 2654435761u;
+}
+
+/*
+ * Function: cache_lookup
+ * Parameter(s): block - block number
+ * Returns: Cache slot holding the block, NEGATIVE if it is not cached.
+ */
+int cache_lookup(uint32_t block) {
+	int position = block_hash(block) & (cache.table_size - 1), slot;
+	while ((slot = cache.table[position]) != NEGATIVE) {
+		if (cache.slots[slot].block == block) {
+			return slot;
+		}
+		position = (position + 1) & (cache.table_size - 1);
+	}
+	return NEGATIVE;
+}
+
+/*
+ * Function: cache_insert
+ * Parameter(s): slot - free cache slot, its buffer already holds the block
+ * block - block number
+ * Description: Makes the slot valid and hashes it. Blocks start out
+ * unreferenced, only a hit earns them a second pass of the clock hand, so a
+ * single scan does not push hot blocks out.
+ */
+void cache_insert(int slot, uint32_t block) {
+	int position = block_hash(block) & (cache.table_size - 1);
+	while (cache.table[position] != NEGATIVE) {
+		position = (position + 1) & (cache.table_size - 1);
+	}
+	cache.table[position] = slot;
+	cache.slots[slot].block = block;
+	cache.slots[slot].valid = SET;
+	cache.slots[slot].referenced = UNSET;
+	cache.slots[slot].prefetched = UNSET;
+	cache.used++;
+}
+
+/*
+ * Function: cache_remove
+ * Parameter(s): slot - valid cache slot
+ * Description: Drops the slot's block, shifting the rest of its probe run
+ * back like the name index does.
+ */
+void cache_remove(int slot) {
+	int mask = cache.table_size - 1, next, home;
+	int position = block_hash(cache.slots[slot].block) & mask;
+	while (cache.table[position] != slot) {
+		position = (position + 1) & mask;
+	}
+	next = position;
+	while (1) {
+		next = (next + 1) & mask;
+		if (cache.table[next] == NEGATIVE) {
+			break;
+		}
+		home = block_hash(cache.slots[cache.table[next]].block) & mask;
+		if (((next - home) & mask) >= ((next - position) & mask)) {
+			cache.table[position] = cache.table[next];
+			position = next;
+		}
+	}
+	cache.table[position] = NEGATIVE;
+	cache.slots[slot].valid = UNSET;
+	cache.free_slots[cache.free_count++] = slot;
+	cache.used--;
+}
+
+/*
+ * Function: cache_victim
+ * Returns: A free slot, pinned, or NEGATIVE if every slot is pinned.
+ * Description: Empty slots go first. Otherwise CLOCK replacement: referenced
+ * blocks lose their bit and are passed over once, pinned ones are skipped.
+ */
+int cache_victim() {
+	int scanned, slot;
+	for (scanned = 0; scanned < 2 * cache.size && cache.free_count == 0;
+			scanned++) {
+		slot = cache.hand;
+		cache.hand = (cache.hand + 1) % cache.size;
+		if (cache.slots[slot].pins > 0) {
+			continue;
+		}
+		if (cache.slots[slot].valid && cache.slots[slot].referenced) {
+			cache.slots[slot].referenced = UNSET;
+			continue;
+		}
+		if (cache.slots[slot].valid) {
+			cache_remove(slot);
+			cache.evictions++;
+		}
+	}
+	if (cache.free_count == 0) {
+		return NEGATIVE;
+	}
+	slot = cache.free_slots[--cache.free_count];
+	cache.slots[slot].pins = 1;
+	return slot;
+}
+
+/*
+ * Function: cache_read
+ * Parameter(s): block - block to read
+ * run - blocks left in the extent from 'block' on, the read-ahead limit
+ * Returns: Cache slot holding the block, pinned until cache_unpin, or
+ * NEGATIVE on a read error.
+ * Description: A miss right after the previous block doubles the read-ahead
+ * window, any other miss resets it. The missing blocks of the window are
+ * read with one preadv into their cache slots. Misses hold the cache lock
+ * through the read, so a block is never read into two slots at once.
+ */
+int cache_read(uint32_t block, uint32_t run) {
+	struct iovec vector[MAX_READ_AHEAD];
+	int slots[MAX_READ_AHEAD], slot, count, window;
+	ssize_t done;
+	pthread_mutex_lock(&cache_lock);
+	slot = cache_lookup(block);
+	cache.lookups++;
+	if (slot != NEGATIVE) {
+		//-- The first use of a read-ahead block only completes its read and
+		//-- does not count as a hit.
+		if (cache.slots[slot].prefetched) {
+			cache.slots[slot].prefetched = UNSET;
+		} else {
+			cache.slots[slot].referenced = SET;
+			cache.hits++;
+		}
+		cache.slots[slot].pins++;
+		cache.last_block = block;
+		pthread_mutex_unlock(&cache_lock);
+		return slot;
+	}
+	cache.window = block == cache.last_block + 1 ?
+			(cache.window * 2 > MAX_READ_AHEAD ? MAX_READ_AHEAD : cache.window * 2) :
+			1;
+	window = cache.window < (int) run ? cache.window : (int) run;
+	//-- Read-ahead past a cluster may run into the end of the volume.
+	if ((uint64_t) block + window > total_blocks) {
+		window = block < total_blocks ? (int) (total_blocks - block) : 0;
+	}
+	for (count = 0; count < window; count++) {
+		if ((count > 0 && cache_lookup(block + count) != NEGATIVE)
+				|| (slot = cache_victim()) == NEGATIVE) {
+			break;
+		}
+		slots[count] = slot;
+		vector[count].iov_base = cache.buffers + (size_t) slot * block_size;
+		vector[count].iov_len = block_size;
+	}
+	if (count == 0) {
+		pthread_mutex_unlock(&cache_lock);
+		return NEGATIVE;
+	}
+	do {
+		done = preadv(image_fd, vector, count,
+				superblock->data_offset + (uint64_t) block * block_size);
+	} while (done < 0 && errno == EINTR);
+	if (done != (ssize_t) count * block_size) {
+		while (count > 0) {
+			cache.slots[slots[--count]].pins = 0;
+			cache.free_slots[cache.free_count++] = slots[count];
+		}
+		pthread_mutex_unlock(&cache_lock);
+		return NEGATIVE;
+	}
+	for (slot = 0; slot < count; slot++) {
+		cache_insert(slots[slot], block + slot);
+		if (slot > 0) {
+			cache.slots[slots[slot]].pins = 0;
+			cache.slots[slots[slot]].prefetched = SET;
+		}
+	}
+	cache.read_ahead += count - 1;
+	cache.last_block = block;
+	pthread_mutex_unlock(&cache_lock);
+	return slots[0];
+}
+
+/*
+ * Function: cache_buffer
+ * Parameter(s): slot - cache slot
+ * Returns: The slot's block buffer.
+ */
+unsigned char *cache_buffer(int slot) {
+	return cache.buffers + (size_t) slot * block_size;
+}
+
+/*
+ * Function: cache_unpin
+ * Parameter(s): slots - slots returned by cache_read
+ * count - number of slots
+ * scan - SET while streaming a file too big to be worth caching
+ * Description: Lets the clock hand have the slots again. A scan drops the
+ * blocks it brought in itself right away, only blocks that were already
+ * hot stay.
+ */
+void cache_unpin(int *slots, int count, short scan) {
+	CacheSlot *slot;
+	if (count == 0) {
+		return;
+	}
+	pthread_mutex_lock(&cache_lock);
+	while (count > 0) {
+		slot = &cache.slots[slots[--count]];
+		if (--slot->pins == 0 && scan && slot->valid && !slot->referenced) {
+			cache_remove(slots[count]);
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Function: cache_invalidate
+ * Parameter(s): start - first block about to be overwritten
+ * length - number of blocks
+ * Description: Drops cached copies of the blocks, walking whichever is
+ * shorter, the range or the cache.
+ */
+void cache_invalidate(uint32_t start, uint32_t length) {
+	uint32_t block;
+	int slot;
+	pthread_mutex_lock(&cache_lock);
+	if (length < (uint32_t) cache.size) {
+		for (block = start; block - start < length; block++) {
+			if ((slot = cache_lookup(block)) != NEGATIVE) {
+				cache_remove(slot);
+			}
+		}
+	} else {
+		for (slot = 0; slot < cache.size; slot++) {
+			if (cache.slots[slot].valid
+					&& cache.slots[slot].block - start < length) {
+				cache_remove(slot);
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Function: node_buffer
+ * Parameter(s): block - block of an extent tree index node
+ * fresh - SET for a node being created, which is not read from disk
+ * Returns: The node's resident copy.
+ * Description: Index nodes stay resident in cache mode, so pointers into
+ * them remain valid while the tree is walked or split, the table may grow
+ * under them. They are loaded on first use and only leave when their block
+ * is freed.
+ */
+unsigned char *node_buffer(uint32_t block, short fresh) {
+	int position, counter, size;
+	NodeSlot *old;
+	unsigned char *buffer;
+	pthread_mutex_lock(&node_lock);
+	position = block_hash(block) & (node_table_size - 1);
+	while (node_table[position].buffer != NULL) {
+		if (node_table[position].block == block) {
+			buffer = node_table[position].buffer;
+			pthread_mutex_unlock(&node_lock);
+			return buffer;
+		}
+		position = (position + 1) & (node_table_size - 1);
+	}
+	if (2 * (node_count + 1) > node_table_size) {
+		old = node_table, size = node_table_size;
+		node_table_size *= 2;
+		node_table = calloc(node_table_size, sizeof(NodeSlot));
+		if (node_table == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		for (counter = 0; counter < size; counter++) {
+			if (old[counter].buffer != NULL) {
+				position = block_hash(old[counter].block) & (node_table_size - 1);
+				while (node_table[position].buffer != NULL) {
+					position = (position + 1) & (node_table_size - 1);
+				}
+				node_table[position] = old[counter];
+			}
+		}
+		free(old);
+		position = block_hash(block) & (node_table_size - 1);
+		while (node_table[position].buffer != NULL) {
+			position = (position + 1) & (node_table_size - 1);
+		}
+	}
+	if (posix_memalign((void**) &node_table[position].buffer, DIRECT_ALIGN,
+			block_size)) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	if (fresh) {
+		memset(node_table[position].buffer, 0, block_size);
+	} else if (pread(image_fd, node_table[position].buffer, block_size,
+			superblock->data_offset + (uint64_t) block * block_size)
+			!= (ssize_t) block_size) {
+		perror("mfs: index node read");
+		exit(EXIT_FAILURE);
+	}
+	node_table[position].block = block;
+	node_table[position].dirty = UNSET;
+	node_count++;
+	buffer = node_table[position].buffer;
+	pthread_mutex_unlock(&node_lock);
+	return buffer;
+}
+
+/*
+ * Function: mark_node
+ * Parameter(s): block - block of a resident index node
+ * Description: Queues the node for write back at the end of the command.
+ */
+void mark_node(uint32_t block) {
+	int position;
+	pthread_mutex_lock(&node_lock);
+	position = block_hash(block) & (node_table_size - 1);
+	while (node_table[position].block != block) {
+		position = (position + 1) & (node_table_size - 1);
+	}
+	if (!node_table[position].dirty) {
+		node_table[position].dirty = SET;
+		dirty_nodes++;
+	}
+	pthread_mutex_unlock(&node_lock);
+}
+
+/*
+ * Function: forget_node
+ * Parameter(s): block - block of an index node being freed
+ * Description: Drops the resident copy, a pending write back included.
+ */
+void forget_node(uint32_t block) {
+	int mask, next, home, position;
+	pthread_mutex_lock(&node_lock);
+	mask = node_table_size - 1;
+	position = block_hash(block) & mask;
+	while (node_table[position].buffer != NULL
+			&& node_table[position].block != block) {
+		position = (position + 1) & mask;
+	}
+	if (node_table[position].buffer == NULL) {
+		pthread_mutex_unlock(&node_lock);
+		return;
+	}
+	if (node_table[position].dirty) {
+		dirty_nodes--;
+	}
+	free(node_table[position].buffer);
+	next = position;
+	while (1) {
+		next = (next + 1) & mask;
+		if (node_table[next].buffer == NULL) {
+			break;
+		}
+		home = block_hash(node_table[next].block) & mask;
+		if (((next - home) & mask) >= ((next - position) & mask)) {
+			node_table[position] = node_table[next];
+			position = next;
+		}
+	}
+	node_table[position].buffer = NULL;
+	node_count--;
+	pthread_mutex_unlock(&node_lock);
+}
+
+/*
+ * Function: flush_nodes
+ * Description: Writes back the index nodes changed by the last command.
+ */
+void flush_nodes() {
+	int position;
+	if (dirty_nodes == 0) {
+		return;
+	}
+	pthread_mutex_lock(&node_lock);
+	for (position = 0; dirty_nodes > 0 && position < node_table_size;
+			position++) {
+		if (node_table[position].buffer != NULL && node_table[position].dirty) {
+			if (pwrite(image_fd, node_table[position].buffer, block_size,
+					superblock->data_offset
+							+ (uint64_t) node_table[position].block * block_size)
+					!= (ssize_t) block_size) {
+				perror("mfs: index node write");
+			}
+			node_table[position].dirty = UNSET;
+			dirty_nodes--;
+		}
+	}
+	pthread_mutex_unlock(&node_lock);
+}
+
+/*
+ * Function: cache_statistics
+ * Description: Prints the block cache counters.
+ */
+void cache_statistics() {
+	if (cache.size == 0) {
+		fprintf(output, "cache: Off, the volume is memory mapped.\n");
+	} else {
+		pthread_mutex_lock(&cache_lock);
+		fprintf(output, "cache: %d of %d blocks, %llu reads, %llu hits "
+				"(%.1f%%), %llu read ahead, %llu evicted, %d index nodes\n",
+				cache.used, cache.size, (unsigned long long) cache.lookups,
+				(unsigned long long) cache.hits,
+				cache.lookups ? 100.0 * cache.hits / cache.lookups : 0.0,
+				(unsigned long long) cache.read_ahead,
+				(unsigned long long) cache.evictions, node_count);
+		pthread_mutex_unlock(&cache_lock);
+	}
+	if (io_method != NULL) {
+		fprintf(output, "io: %s, %llu requests in %llu submissions\n",
+				io_method, (unsigned long long) io_requests,
+				(unsigned long long) io_submissions);
+	}
+	flush_output();
+}
+
+/*
+ * Function: open_engine
+ * Returns: The I/O engine of the calling thread, started on first use.
+ * Description: Each thread that does big transfers in cache mode has an
+ * engine of its own, so they never contend for a ring. io_uring is tried
+ * first, a pool of threads serves the requests where it is missing.
+ */
+IoEngine *open_engine() {
+	int counter;
+	if (engine != NULL) {
+		return engine;
+	}
+	engine = calloc(1, sizeof(IoEngine));
+	if (engine == NULL || posix_memalign((void**) &engine->buffers,
+			DIRECT_ALIGN, (size_t) IO_SLOTS * IO_CHUNK)) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (counter = IO_QUEUE - 1; counter >= 0; counter--) {
+		engine->free_requests[engine->free_count++] = counter;
+	}
+	if (start_ring(engine) < 0) {
+		start_pool(engine);
+	}
+	if (io_method == NULL) {
+		io_method = engine->ring_fd < 0 ? "thread pool"
+				: engine->fixed_buffers && engine->fixed_file ?
+				"io_uring, registered buffers and image" : "io_uring";
+	}
+	return engine;
+}
+
+/*
+ * Function: start_ring
+ * Parameter(s): io - engine being started
+ * Returns: 0 on success, -1 when the kernel has no io_uring for us.
+ * Description: Sets up a ring of IO_QUEUE entries and maps its queues. The
+ * engine buffers are registered as one fixed buffer and the image as fixed
+ * file 0, which spares the kernel pinning pages and looking up the file
+ * for every request; either may be refused (locked memory limits), the
+ * ring then works without.
+ */
+int start_ring(IoEngine *io) {
+	struct io_uring_params params;
+	struct iovec arena = { io->buffers, (size_t) IO_SLOTS * IO_CHUNK };
+	unsigned char *sq, *cq;
+	int counter;
+	memset(&params, 0, sizeof(params));
+	io->ring_fd = syscall(__NR_io_uring_setup, IO_QUEUE, &params);
+	if (io->ring_fd < 0) {
+		io->ring_fd = NEGATIVE;
+		return -1;
+	}
+	io->ring_sizes[0] = params.sq_off.array + params.sq_entries
+			* sizeof(unsigned);
+	io->ring_sizes[1] = params.cq_off.cqes + params.cq_entries
+			* sizeof(struct io_uring_cqe);
+	io->ring_sizes[2] = params.sq_entries * sizeof(struct io_uring_sqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		//-- Both rings share one mapping.
+		if (io->ring_sizes[1] > io->ring_sizes[0]) {
+			io->ring_sizes[0] = io->ring_sizes[1];
+		}
+		io->ring_sizes[1] = 0;
+	}
+	io->rings[0] = mmap(NULL, io->ring_sizes[0], PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+	io->rings[1] = io->ring_sizes[1] == 0 ? io->rings[0] : mmap(NULL,
+			io->ring_sizes[1], PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			io->ring_fd, IORING_OFF_CQ_RING);
+	io->rings[2] = mmap(NULL, io->ring_sizes[2], PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+	if (io->rings[0] == MAP_FAILED || io->rings[1] == MAP_FAILED
+			|| io->rings[2] == MAP_FAILED) {
+		for (counter = 0; counter < 3; counter++) {
+			if (io->rings[counter] != MAP_FAILED && io->ring_sizes[counter] > 0) {
+				munmap(io->rings[counter], io->ring_sizes[counter]);
+			}
+		}
+		close(io->ring_fd);
+		io->ring_fd = NEGATIVE;
+		return -1;
+	}
+	sq = io->rings[0];
+	cq = io->rings[1];
+	io->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+	io->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+	io->sq_array = (unsigned*) (sq + params.sq_off.array);
+	io->cq_head = (unsigned*) (cq + params.cq_off.head);
+	io->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+	io->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+	io->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+	io->sqes = io->rings[2];
+	io->fixed_buffers = syscall(__NR_io_uring_register, io->ring_fd,
+			IORING_REGISTER_BUFFERS, &arena, 1) == 0;
+	io->fixed_file = syscall(__NR_io_uring_register, io->ring_fd,
+			IORING_REGISTER_FILES, &image_fd, 1) == 0;
+	return 0;
+}
+
+/*
+ * Function: start_pool
+ * Parameter(s): io - engine being started
+ * Description: The fallback of start_ring: IO_THREADS threads taking the
+ * queued requests in order and doing them with pread and pwrite, so a
+ * single caller still has that many transfers going at once.
+ */
+void start_pool(IoEngine *io) {
+	int counter;
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->work, NULL);
+	pthread_cond_init(&io->done, NULL);
+	for (counter = 0; counter < IO_THREADS; counter++) {
+		if (pthread_create(&io->threads[counter], NULL, serve_io, io) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Function: serve_io
+ * Parameter(s): argument - engine the thread serves
+ * Returns: NULL once the engine is closed.
+ */
+void *serve_io(void *argument) {
+	IoEngine *io = argument;
+	IoRequest *request;
+	int index, status;
+	pthread_mutex_lock(&io->lock);
+	while (SET) {
+		while (io->queue_count == 0 && !io->stopping) {
+			pthread_cond_wait(&io->work, &io->lock);
+		}
+		if (io->queue_count == 0) {
+			break;
+		}
+		index = io->queue[io->queue_head];
+		io->queue_head = (io->queue_head + 1) % IO_QUEUE;
+		io->queue_count--;
+		request = &io->requests[index];
+		pthread_mutex_unlock(&io->lock);
+		status = transfer_io(request->write, request->fd, request->buffer,
+				request->length, request->offset);
+		pthread_mutex_lock(&io->lock);
+		complete_io(io, index, status == 0 ? (int64_t) request->length : -EIO);
+		pthread_cond_broadcast(&io->done);
+	}
+	pthread_mutex_unlock(&io->lock);
+	return NULL;
+}
+
+/*
+ * Function: close_engine
+ * Description: Waits for the calling thread's requests, then stops its
+ * engine and frees it.
+ */
+void close_engine() {
+	IoEngine *io = engine;
+	int counter;
+	if (io == NULL) {
+		return;
+	}
+	drain_io();
+	if (io->ring_fd >= 0) {
+		for (counter = 0; counter < 3; counter++) {
+			if (io->ring_sizes[counter] > 0) {
+				munmap(io->rings[counter], io->ring_sizes[counter]);
+			}
+		}
+		close(io->ring_fd);
+	} else {
+		pthread_mutex_lock(&io->lock);
+		io->stopping = SET;
+		pthread_cond_broadcast(&io->work);
+		pthread_mutex_unlock(&io->lock);
+		for (counter = 0; counter < IO_THREADS; counter++) {
+			pthread_join(io->threads[counter], NULL);
+		}
+	}
+	free(io->buffers);
+	free(io);
+	engine = NULL;
+}
+
+/*
+ * Function: io_buffer
+ * Parameter(s): slot - engine buffer, 0 to IO_SLOTS - 1
+ * Returns: The buffer, IO_CHUNK bytes aligned for direct I/O.
+ */
+unsigned char *io_buffer(int slot) {
+	return open_engine()->buffers + (size_t) slot * IO_CHUNK;
+}
+
+/*
+ * Function: queue_io
+ * Parameter(s): write - SET to write the buffer out, UNSET to read into it
+ * fd - file, the image or a host file
+ * buffer, length - bytes to transfer, within one engine buffer
+ * offset - file offset
+ * Returns: 0 once the request is queued, -2 when a buffer outside the
+ * engine failed to transfer.
+ * Description: Queues a transfer on the calling thread's engine, which
+ * submits IO_BATCH requests at a time, or when someone waits. The request
+ * is done by the time its engine buffer is waited for; a buffer the engine
+ * does not own is transferred on the spot.
+ */
+int queue_io(short write, int fd, unsigned char *buffer, size_t length,
+		uint64_t offset) {
+	IoEngine *io = engine;
+	IoRequest *request;
+	struct io_uring_sqe *entry;
+	unsigned tail;
+	int index;
+	if (io == NULL || buffer < io->buffers
+			|| buffer >= io->buffers + (size_t) IO_SLOTS * IO_CHUNK) {
+		return transfer_io(write, fd, buffer, length, offset);
+	}
+	if (io->ring_fd < 0) {
+		pthread_mutex_lock(&io->lock);
+	}
+	while (io->free_count == 0) {
+		if (io->ring_fd >= 0) {
+			reap_io(io, SET);
+		} else {
+			pthread_cond_wait(&io->done, &io->lock);
+		}
+	}
+	index = io->free_requests[--io->free_count];
+	request = &io->requests[index];
+	request->fd = fd;
+	request->write = write;
+	request->slot = (buffer - io->buffers) / IO_CHUNK;
+	request->buffer = buffer;
+	request->length = length;
+	request->offset = offset;
+	io->pending[request->slot]++;
+	io->in_flight++;
+	__atomic_fetch_add(&io_requests, 1, __ATOMIC_RELAXED);
+	if (io->ring_fd < 0) {
+		io->queue[(io->queue_head + io->queue_count++) % IO_QUEUE] = index;
+		__atomic_fetch_add(&io_submissions, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&io->work);
+		pthread_mutex_unlock(&io->lock);
+		return 0;
+	}
+	entry = &io->sqes[index];
+	memset(entry, 0, sizeof(*entry));
+	entry->opcode = io->fixed_buffers ? (write ? IORING_OP_WRITE_FIXED
+			: IORING_OP_READ_FIXED) : (write ? IORING_OP_WRITE : IORING_OP_READ);
+	entry->fd = fd;
+	if (fd == image_fd && io->fixed_file) {
+		entry->fd = 0;
+		entry->flags = IOSQE_FIXED_FILE;
+	}
+	entry->addr = (uintptr_t) buffer;
+	entry->len = length;
+	entry->off = offset;
+	entry->user_data = index;
+	tail = *io->sq_tail;
+	io->sq_array[tail & *io->sq_mask] = index;
+	__atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if (++io->queued >= IO_BATCH) {
+		reap_io(io, UNSET);
+	}
+	return 0;
+}
+
+/*
+ * Function: reap_io
+ * Parameter(s): io - engine with a ring
+ * wait - SET to block until at least one request completes
+ * Description: Submits the queued entries with one system call, which
+ * also waits when asked, and completes whatever the kernel has finished.
+ */
+void reap_io(IoEngine *io, short wait) {
+	unsigned head, tail;
+	int submitted;
+	submitted = syscall(__NR_io_uring_enter, io->ring_fd, io->queued,
+			wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (submitted > 0) {
+		io->queued -= submitted;
+		__atomic_fetch_add(&io_submissions, 1, __ATOMIC_RELAXED);
+	} else if (submitted < 0 && errno != EINTR && errno != EAGAIN
+			&& errno != EBUSY) {
+		perror("io_uring_enter");
+		exit(EXIT_FAILURE);
+	}
+	head = *io->cq_head;
+	tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		complete_io(io, io->cqes[head & *io->cq_mask].user_data,
+				io->cqes[head & *io->cq_mask].res);
+	}
+	__atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function: complete_io
+ * Parameter(s): io - engine of the request
+ * index - request
+ * result - bytes transferred, or minus the error number
+ * Description: Retires a request. A short or interrupted transfer is
+ * finished synchronously, which is rare enough not to matter; anything
+ * else marks the request's buffer failed.
+ */
+void complete_io(IoEngine *io, int index, int64_t result) {
+	IoRequest *request = &io->requests[index];
+	size_t done = result > 0 ? (size_t) result : 0;
+	if ((result >= 0 || result == -EINTR || result == -EAGAIN)
+			&& done < request->length) {
+		result = transfer_io(request->write, request->fd, request->buffer + done,
+				request->length - done, request->offset + done) == 0 ?
+				(int64_t) request->length : -EIO;
+	}
+	if (result != (int64_t) request->length) {
+		io->failed[request->slot] = SET;
+	}
+	io->pending[request->slot]--;
+	io->in_flight--;
+	io->free_requests[io->free_count++] = index;
+}
+
+/*
+ * Function: wait_io
+ * Parameter(s): slot - engine buffer
+ * Returns: 0 when every request on the buffer went through, -2 when one
+ * failed.
+ * Description: Waits until the buffer is free for the next transfer. A
+ * buffer with nothing in flight is free at once, and the queued requests
+ * stay queued, so a caller filling several buffers submits them together.
+ */
+int wait_io(int slot) {
+	IoEngine *io = engine;
+	int status;
+	if (io == NULL) {
+		return 0;
+	}
+	if (io->ring_fd >= 0) {
+		while (io->pending[slot] > 0) {
+			reap_io(io, SET);
+		}
+	} else {
+		pthread_mutex_lock(&io->lock);
+		while (io->pending[slot] > 0) {
+			pthread_cond_wait(&io->done, &io->lock);
+		}
+	}
+	status = io->failed[slot] ? -2 : 0;
+	io->failed[slot] = UNSET;
+	if (io->ring_fd < 0) {
+		pthread_mutex_unlock(&io->lock);
+	}
+	return status;
+}
+
+/*
+ * Function: submit_io
+ * Description: Hands the calling thread's queued requests to the kernel
+ * without waiting for any, before it turns to other work.
+ */
+void submit_io() {
+	IoEngine *io = engine;
+	if (io != NULL && io->ring_fd >= 0 && io->queued > 0) {
+		reap_io(io, UNSET);
+	}
+}
+
+/*
+ * Function: settle_io
+ * Description: Waits for every request of the calling thread, leaving the
+ * failures to be picked up by whoever waits for their buffers.
+ */
+void settle_io() {
+	IoEngine *io = engine;
+	if (io == NULL) {
+		return;
+	}
+	if (io->ring_fd >= 0) {
+		while (io->in_flight > 0) {
+			reap_io(io, SET);
+		}
+		return;
+	}
+	pthread_mutex_lock(&io->lock);
+	while (io->in_flight > 0) {
+		pthread_cond_wait(&io->done, &io->lock);
+	}
+	pthread_mutex_unlock(&io->lock);
+}
+
+/*
+ * Function: drain_io
+ * Returns: 0 when every request of the calling thread went through, -2
+ * when one failed.
+ */
+int drain_io() {
+	int slot, status = 0;
+	settle_io();
+	for (slot = 0; slot < IO_SLOTS && engine != NULL; slot++) {
+		status = wait_io(slot) < 0 ? -2 : status;
+	}
+	return status;
+}
+
+/*
+ * Function: transfer_io
+ * Parameter(s): write - SET to write, UNSET to read
+ * fd, buffer, length, offset - as for pwrite and pread
+ * Returns: 0 on success, -2 on an error or an early end of file.
+ */
+int transfer_io(short write, int fd, unsigned char *buffer, size_t length,
+		uint64_t offset) {
+	ssize_t done;
+	while (length > 0) {
+		done = write ? pwrite(fd, buffer, length, offset)
+				: pread(fd, buffer, length, offset);
+		if (done < 0 && errno == EINTR) {
+			continue;
+		}
+		if (done <= 0) {
+			return -2;
+		}
+		buffer += done;
+		length -= done;
+		offset += done;
+	}
+	return 0;
+}
+
+/*
+ * Function: stream_file
+ * Parameter(s): inode - file to copy out
+ * output_file - destination
+ * Returns: 0 on success, -1 on a write error, -2 on a read error or a
+ * damaged cluster.
+ * Description: get for a file too big to be worth caching. Its extents are
+ * read from the image straight into the engine buffers, up to IO_CHUNK
+ * bytes each, with all buffers in flight at once. The oldest read is
+ * written out as soon as it is in, and its buffer reused once the write is
+ * done, so reads of the volume and writes of the output overlap. A
+ * compressed cluster is read packed into the upper half of a buffer and
+ * expanded into the lower.
+ */
+int stream_file(Inode *inode, int output_file) {
+	uint64_t remaining = HOT(inode)->size, position = 0, from;
+	uint64_t start[IO_SLOTS];
+	uint32_t offset = 0, blocks, packed[IO_SLOTS], expanded[IO_SLOTS];
+	size_t bytes[IO_SLOTS], length;
+	int head = 0, reading = 0, slot, status = 0;
+	unsigned char *buffer;
+	ExtentCursor cursor;
+	Extent *extent = first_extent(inode, &cursor);
+	open_engine();
+	while (status == 0) {
+		//-- Free buffers take the next pieces of the file.
+		while (reading < IO_SLOTS && extent != NULL && remaining > 0) {
+			slot = (head + reading) % IO_SLOTS;
+			if (wait_io(slot) < 0) {
+				status = -1;
+				break;
+			}
+			buffer = io_buffer(slot);
+			blocks = EXTENT_BLOCKS(extent) - offset;
+			from = extent->start + offset;
+			expanded[slot] = 0;
+			if (extent->length & COMPRESSED_EXTENT) {
+				if ((uint64_t) blocks * block_size > MAX_CLUSTER
+						|| STORED_BLOCKS(extent) >= blocks) {
+					status = -2;
+					break;
+				}
+				packed[slot] = STORED_BLOCKS(extent) * block_size;
+				expanded[slot] = blocks * block_size;
+				buffer += IO_CHUNK / 2;
+				length = packed[slot];
+			} else {
+				blocks = blocks < IO_CHUNK / block_size ? blocks
+						: IO_CHUNK / block_size;
+				length = (size_t) blocks * block_size;
+			}
+			bytes[slot] = remaining < (uint64_t) blocks * block_size ? remaining
+					: (uint64_t) blocks * block_size;
+			start[slot] = position;
+			position += bytes[slot];
+			remaining -= bytes[slot];
+			queue_io(UNSET, image_fd, buffer, length, superblock->data_offset
+					+ from * block_size);
+			reading++;
+			offset += blocks;
+			if (offset == EXTENT_BLOCKS(extent)) {
+				extent = next_extent(&cursor);
+				offset = 0;
+			}
+		}
+		if (reading == 0 || status < 0) {
+			break;
+		}
+		//-- The oldest read goes out next.
+		slot = head;
+		buffer = io_buffer(slot);
+		if (wait_io(slot) < 0 || (expanded[slot] > 0 && decompress_cluster(
+				buffer + IO_CHUNK / 2, packed[slot], buffer, expanded[slot]) != 0)) {
+			status = -2;
+			break;
+		}
+		queue_io(SET, output_file, buffer, bytes[slot], start[slot]);
+		head = (head + 1) % IO_SLOTS;
+		reading--;
+	}
+	if (drain_io() < 0 && status == 0) {
+		status = -1;
+	}
+	return status;
+}
+
+/*
+ * Function: make_key
+ * Parameter(s): key - receives the search key
+ * name - file name
+ * index - inode of the file, 0 or UINT32_MAX to search below or above all
+ * files of that name
+ */
+void make_key(DirectoryEntry *key, const char *name, uint32_t index) {
+	//-- Zero padded, so prefixes compare like the names they start.
+	memset(key->prefix, 0, NAME_PREFIX);
+	memcpy(key->prefix, name, strnlen(name, NAME_PREFIX));
+	key->inode = index;
+	key->child = 0;
+}
+
+/*
+ * Function: compare_entry
+ * Parameter(s): key, name - search key and the full name it was made from
+ * entry - directory tree entry
+ * Returns: Less than, equal to or greater than 0 as the key sorts before, at
+ * or after the entry.
+ * Description: Entries sort by name, then by inode. The stored prefix
+ * decides unless both names fill it, then the entry's name is read from its
+ * inode.
+ */
+int compare_entry(const DirectoryEntry *key, const char *name,
+		const DirectoryEntry *entry) {
+	int order = memcmp(key->prefix, entry->prefix, NAME_PREFIX);
+	//-- An entry torn by a change a lockless search raced may point anywhere.
+	if (order == 0 && key->prefix[NAME_PREFIX - 1] != '\0') {
+		order = entry->inode < directory_size ?
+				strcmp(name, directory[entry->inode].file_name) : 1;
+	}
+	if (order == 0) {
+		order = (key->inode > entry->inode) - (key->inode < entry->inode);
+	}
+	return order;
+}
+
+/*
+ * Function: floor_entry
+ * Parameter(s): node - directory tree node
+ * key, name - search key
+ * Returns: Position of the last entry at or before the key, -1 if the key
+ * sorts before all of them.
+ */
+int floor_entry(EntryHeader *node, const DirectoryEntry *key,
+		const char *name) {
+	DirectoryEntry *entries = directory_entries(node);
+	int low = 0, high = entry_count(node) - 1, middle;
+	while (low <= high) {
+		middle = (low + high) / 2;
+		if (compare_entry(key, name, &entries[middle]) >= 0) {
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+	return high;
+}
+
+/*
+ * Function: entry_count
+ * Parameter(s): node - directory tree node
+ * Returns: The node's number of entries, 0 if the count is beyond what a
+ * block holds, as in a node a lockless search read while it changed.
+ */
+int entry_count(EntryHeader *node) {
+	return node->count <= ENTRY_CAPACITY ? node->count : 0;
+}
+
+/*
+ * Function: directory_entries
+ * Parameter(s): node - directory tree node
+ * Returns: The node's entry array.
+ */
+DirectoryEntry *directory_entries(EntryHeader *node) {
+	return (DirectoryEntry*) (node + 1);
+}
+
+/*
+ * Function: entry_node
+ * Parameter(s): block - block holding a directory tree node
+ * Returns: The node, its resident copy in cache mode. A block past the end
+ * of the volume, read by a lockless search from a node that was changing,
+ * gives an empty node.
+ */
+EntryHeader *entry_node(uint32_t block) {
+	static EntryHeader empty;
+	if (block >= total_blocks) {
+		return &empty;
+	}
+	return (EntryHeader*) tree_node(block);
+}
+
+/*
+ * Function: edit_entry_node
+ * Parameter(s): block - block of a node about to change, receives the block
+ * of its copy
+ * Returns: The node to change.
+ * Description: A node written before the last commit is part of the tree
+ * the journal can recover, so it is never changed in place. It is copied to
+ * a new block, which later changes up to the next commit reuse, and freed
+ * once that commit is durable. The caller points the parent at the copy and
+ * has reserved the block.
+ */
+EntryHeader *edit_entry_node(uint32_t *block) {
+	EntryHeader *node = entry_node(*block), *copy;
+	uint32_t fresh;
+	if (!journaling || node->generation == superblock->generation) {
+		return (EntryHeader*) edit_node(*block);
+	}
+	new_entry_node(node->depth, &fresh);
+	copy = entry_node(fresh);
+	memcpy(copy, node, block_size);
+	copy->generation = superblock->generation;
+	free_node(*block);
+	*block = fresh;
+	return copy;
+}
+
+/*
+ * Function: new_entry_node
+ * Parameter(s): depth - level of the node, 0 for a leaf
+ * block - receives the node's block
+ * Returns: 0 on success, -1 if the disk is full.
+ */
+int new_entry_node(int depth, uint32_t *block) {
+	Extent run;
+	EntryHeader *node;
+	if (allocate_extent(1, &run) == 0) {
+		return -1;
+	}
+	*block = run.start;
+	if (cache.size > 0) {
+		cache_invalidate(run.start, 1);
+		node_buffer(run.start, SET);
+	}
+	node = (EntryHeader*) edit_node(run.start);
+	node->count = 0;
+	node->max = ENTRY_CAPACITY;
+	node->depth = depth;
+	node->unused = 0;
+	node->generation = superblock->generation;
+	return 0;
+}
+
+/*
+ * Function: reserve_blocks
+ * Parameter(s): count - blocks a directory change may need
+ * Returns: SET if they are free, committing first to free deleted blocks if
+ * need be.
+ * Description: Directory changes check up front, so the tree is never left
+ * half split.
+ */
+int reserve_blocks(int64_t count) {
+	if (superblock->free_blocks < count && pending_count > 0) {
+		commit_journal();
+	}
+	return superblock->free_blocks >= count;
+}
+
+/*
+ * Function: directory_insert
+ * Parameter(s): parent - inode of the directory
+ * index - inode of the new entry, its name already set
+ * Returns: 0 on success, -1 if the disk is full.
+ * Description: Adds the entry to the directory's tree. A root split grows
+ * the tree by one level.
+ */
+int directory_insert(int parent, int index) {
+	Inode *folder = &directory[parent];
+	DirectoryEntry key, split, *entries;
+	EntryHeader *root;
+	uint32_t block;
+	int depth = folder->root == NO_BLOCK ? 0 : entry_node(folder->root)->depth;
+	//-- A split and, with a journal, a copy per level, a new root, and the
+	//-- blocks held back for deletes.
+	if (depth + 2 > MAX_TREE_DEPTH || !reserve_blocks((journaling ? 2 : 1)
+			* (depth + 1) + 1 + reserved_blocks)) {
+		return -1;
+	}
+	make_key(&key, directory[index].file_name, index);
+	inode_hot[index].name_hash = name_hash(directory[index].file_name);
+	log_range(&inode_hot[index], sizeof(InodeHot));
+	begin_directory_change();
+	if (folder->root == NO_BLOCK) {
+		new_entry_node(0, &folder->root);
+	}
+	if (insert_entry(&folder->root, &key, directory[index].file_name, &split)
+			> 0) {
+		new_entry_node(depth + 1, &block);
+		root = (EntryHeader*) edit_node(block);
+		entries = directory_entries(root);
+		entries[0] = directory_entries(entry_node(folder->root))[0];
+		entries[0].child = folder->root;
+		entries[1] = split;
+		root->count = 2;
+		folder->root = block;
+	}
+	inode_hot[parent].size++;
+	end_directory_change();
+	log_range(folder, sizeof(Inode));
+	log_range(&inode_hot[parent], sizeof(InodeHot));
+	return 0;
+}
+
+/*
+ * Function: insert_entry
+ * Parameter(s): block - subtree root, receives the block of its copy
+ * key, name - entry to insert
+ * split - receives the first key and block of a new right sibling
+ * Returns: 0 once the entry is placed, 1 when a new sibling needs a place
+ * in the parent.
+ * Description: Index entries carry the first key of their subtree, so the
+ * one leading to the changed child is refreshed on the way back.
+ */
+int insert_entry(uint32_t *block, DirectoryEntry *key, const char *name,
+		DirectoryEntry *split) {
+	EntryHeader *node = edit_entry_node(block);
+	DirectoryEntry *entries = directory_entries(node), added;
+	int position = floor_entry(node, key, name), status;
+	if (node->depth == 0) {
+		return place_entry(node, position + 1, key, split);
+	}
+	if (position < 0) {
+		position = 0;
+	}
+	status = insert_entry(&entries[position].child, key, name, &added);
+	memcpy(entries[position].prefix, directory_entries(entry_node(
+			entries[position].child))[0].prefix, NAME_PREFIX);
+	entries[position].inode = directory_entries(entry_node(
+			entries[position].child))[0].inode;
+	if (status == 0) {
+		return 0;
+	}
+	return place_entry(node, position + 1, &added, split);
+}
+
+/*
+ * Function: place_entry
+ * Parameter(s): node - node being changed
+ * position - where the entry goes
+ * entry - entry to add
+ * split - receives the first key and block of a new right sibling
+ * Returns: 0 if the entry fit, 1 if the node was split in half.
+ */
+int place_entry(EntryHeader *node, int position, DirectoryEntry *entry,
+		DirectoryEntry *split) {
+	EntryHeader *target = node, *sibling = NULL;
+	DirectoryEntry *entries;
+	uint32_t block;
+	int half;
+	if (node->count == node->max) {
+		new_entry_node(node->depth, &block);
+		sibling = (EntryHeader*) edit_node(block);
+		half = node->count / 2;
+		sibling->count = node->count - half;
+		memcpy(directory_entries(sibling), &directory_entries(node)[half],
+				sibling->count * sizeof(DirectoryEntry));
+		node->count = half;
+		if (position > half) {
+			target = sibling;
+			position -= half;
+		}
+	}
+	entries = directory_entries(target);
+	memmove(&entries[position + 1], &entries[position],
+			(target->count - position) * sizeof(DirectoryEntry));
+	entries[position] = *entry;
+	target->count++;
+	if (sibling == NULL) {
+		return 0;
+	}
+	*split = directory_entries(sibling)[0];
+	split->child = block;
+	return 1;
+}
+
+/*
+ * Function: directory_remove
+ * Parameter(s): parent - inode of the directory
+ * index - inode of the entry
+ * Returns: 0 on success, -1 if no block was left to copy the tree.
+ * Description: Takes the entry out of the directory's tree. Emptied nodes
+ * are freed and a root left with a single child hands over to it. Copying
+ * the path may use the blocks held back from files.
+ */
+int directory_remove(int parent, int index) {
+	Inode *folder = &directory[parent];
+	DirectoryEntry key;
+	EntryHeader *root = entry_node(folder->root);
+	uint32_t block;
+	if (journaling && !reserve_blocks(root->depth + 1)) {
+		return -1;
+	}
+	make_key(&key, directory[index].file_name, index);
+	begin_directory_change();
+	if (remove_entry(&folder->root, &key, directory[index].file_name)) {
+		free_node(folder->root);
+		folder->root = NO_BLOCK;
+	}
+	while (folder->root != NO_BLOCK && (root = entry_node(folder->root))->depth
+			> 0 && root->count == 1) {
+		block = directory_entries(root)[0].child;
+		free_node(folder->root);
+		folder->root = block;
+	}
+	inode_hot[parent].size--;
+	end_directory_change();
+	log_range(folder, sizeof(Inode));
+	log_range(&inode_hot[parent], sizeof(InodeHot));
+	return 0;
+}
+
+/*
+ * Function: begin_directory_change
+ * Description: Starts a change to a directory tree: waits out listings
+ * and locked searches, and makes the sequence number odd so lockless
+ * searches running meanwhile start over.
+ */
+void begin_directory_change() {
+	pthread_rwlock_wrlock(&directory_lock);
+	__atomic_store_n(&directory_sequence, directory_sequence + 1,
+			__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Function: end_directory_change
+ * Description: Publishes the change, the sequence number is even again.
+ */
+void end_directory_change() {
+	__atomic_store_n(&directory_sequence, directory_sequence + 1,
+			__ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&directory_lock);
+}
+
+/*
+ * Function: remove_entry
+ * Parameter(s): block - subtree root, receives the block of its copy
+ * key, name - entry to remove, known to be in the subtree
+ * Returns: 1 if the subtree is left empty, else 0.
+ */
+int remove_entry(uint32_t *block, DirectoryEntry *key, const char *name) {
+	EntryHeader *node = edit_entry_node(block), *child;
+	DirectoryEntry *entries = directory_entries(node);
+	int position = floor_entry(node, key, name);
+	if (node->depth > 0) {
+		if (!remove_entry(&entries[position].child, key, name)) {
+			child = entry_node(entries[position].child);
+			memcpy(entries[position].prefix,
+					directory_entries(child)[0].prefix, NAME_PREFIX);
+			entries[position].inode = directory_entries(child)[0].inode;
+			return 0;
+		}
+		free_node(entries[position].child);
+	}
+	memmove(&entries[position], &entries[position + 1],
+			(node->count - position - 1) * sizeof(DirectoryEntry));
+	node->count--;
+	return node->count == 0;
+}
+
+/*
+ * Function: seek_entry
+ * Parameter(s): root - block of the directory tree's root
+ * key, name - search key
+ * cursor - receives the path to the entry
+ * Returns: The last entry at or before the key, NULL if the key sorts first.
+ * next_entry continues from the position either way.
+ */
+DirectoryEntry *seek_entry(uint32_t root, DirectoryEntry *key,
+		const char *name, EntryCursor *cursor) {
+	EntryHeader *node = entry_node(root);
+	int position;
+	cursor->level = 0;
+	while (1) {
+		position = floor_entry(node, key, name);
+		cursor->nodes[cursor->level] = node;
+		cursor->positions[cursor->level] = position;
+		if (node->depth == 0 || cursor->level + 1 == MAX_TREE_DEPTH) {
+			break;
+		}
+		if (position < 0) {
+			cursor->positions[cursor->level] = position = 0;
+		}
+		node = entry_node(directory_entries(node)[position].child);
+		cursor->level++;
+	}
+	return position < 0 ? NULL : &directory_entries(node)[position];
+}
+
+/*
+ * Function: next_entry
+ * Parameter(s): cursor - position in a directory tree
+ * Returns: The following entry in name order, NULL past the last one.
+ */
+DirectoryEntry *next_entry(EntryCursor *cursor) {
+	EntryHeader *node;
+	while (++cursor->positions[cursor->level]
+			>= entry_count(cursor->nodes[cursor->level])) {
+		if (cursor->level == 0) {
+			return NULL;
+		}
+		cursor->level--;
+	}
+	node = cursor->nodes[cursor->level];
+	while (node->depth > 0 && cursor->level + 1 < MAX_TREE_DEPTH) {
+		node = entry_node(directory_entries(node)[cursor->positions[
+				cursor->level]].child);
+		cursor->nodes[++cursor->level] = node;
+		cursor->positions[cursor->level] = 0;
+	}
+	return &directory_entries(node)[cursor->positions[cursor->level]];
+}
+
+/*
+ * Function: directory_find
+ * Parameter(s): parent - inode of the directory
+ * name - file name
+ * last - SET for the newest entry of the name, UNSET for the oldest (put
+ * does not reject duplicate names)
+ * Returns: Inode of the entry, NEGATIVE if there is none.
+ * Description: Duplicates sort by inode, so either one is a single descent
+ * of the directory's tree. A name which fits the entry's prefix is matched
+ * there; a longer one only reads the inode's name when its hash agrees.
+ */
+int directory_find(int parent, const char *name, short last) {
+	DirectoryEntry key, *entry;
+	EntryCursor cursor;
+	if (directory[parent].root == NO_BLOCK) {
+		return NEGATIVE;
+	}
+	make_key(&key, name, last ? UINT32_MAX : 0);
+	entry = seek_entry(directory[parent].root, &key, name, &cursor);
+	if (!last) {
+		entry = next_entry(&cursor);
+	}
+	if (entry == NULL || entry->inode >= directory_size
+			|| memcmp(entry->prefix, key.prefix, NAME_PREFIX)) {
+		return NEGATIVE;
+	}
+	if (key.prefix[NAME_PREFIX - 1] != '\0'
+			&& (inode_hot[entry->inode].name_hash != name_hash(name)
+			|| strcmp(directory[entry->inode].file_name, name))) {
+		return NEGATIVE;
+	}
+	return entry->inode;
+}
+
+/*
+ * Function: resolve_path
+ * Parameter(s): path - absolute, or relative to the current directory
+ * buffer - holds the components while the leaf is in use
+ * leaf - receives the last component, NULL when the path itself names a
+ * directory ('/', '.', '..' or empty)
+ * Returns: Inode of the directory holding the leaf, or of the named
+ * directory, NEGATIVE if a directory on the way does not exist.
+ */
+int resolve_path(const char *path, char *buffer, char **leaf) {
+	int folder = path[0] == '/' ? ROOT_DIRECTORY : (int) *working_directory;
+	char *component, *next, *state;
+	snprintf(buffer, BUFFER_SIZE, "%s", path);
+	*leaf = NULL;
+	component = strtok_r(buffer, "/", &state);
+	while (component != NULL) {
+		next = strtok_r(NULL, "/", &state);
+		if (!strcmp(component, "..")) {
+			folder = directory[folder].parent;
+		} else if (strcmp(component, ".")) {
+			if (next == NULL) {
+				*leaf = component;
+				break;
+			}
+			folder = directory_find(folder, component, SET);
+			if (folder < 0 || inode_hot[folder].type != DIRECTORY_FILE) {
+				return NEGATIVE;
+			}
+		}
+		component = next;
+	}
+	return folder;
+}
+
+/*
+ * Function: lookup_path
+ * Parameter(s): path - absolute, or relative to the current directory
+ * last - SET for the newest file of the name, UNSET for the oldest
+ * Returns: Inode of the file or directory, NEGATIVE if there is none.
+ * Description: A mapped volume is searched without a lock. A search which
+ * saw the sequence number move may have read a tree half changed and
+ * starts over; after LOOKUP_RETRIES, and always in cache mode, which loads
+ * nodes as it goes, it runs under the directory lock.
+ */
+int lookup_path(const char *path, short last) {
+	uint32_t sequence;
+	int index, attempt;
+	for (attempt = 0; cache.size == 0 && attempt < LOOKUP_RETRIES; attempt++) {
+		sequence = __atomic_load_n(&directory_sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1) {
+			continue;
+		}
+		index = search_path(path, last);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&directory_sequence, __ATOMIC_RELAXED) == sequence) {
+			return index;
+		}
+	}
+	pthread_rwlock_rdlock(&directory_lock);
+	index = search_path(path, last);
+	pthread_rwlock_unlock(&directory_lock);
+	return index;
+}
+
+/*
+ * Function: search_path
+ * Parameter(s): path - absolute, or relative to the current directory
+ * last - SET for the newest file of the name, UNSET for the oldest
+ * Returns: Inode of the file or directory, NEGATIVE if there is none.
+ * Description: The search itself, callers keep the directories still.
+ */
+int search_path(const char *path, short last) {
+	char buffer[BUFFER_SIZE], *leaf;
+	int folder = resolve_path(path, buffer, &leaf);
+	if (folder < 0 || leaf == NULL) {
+		return folder;
+	}
+	return directory_find(folder, leaf, last);
+}
+
+/*
+ * Function: check_name
+ * Parameter(s): name - name of a new file or directory
+ * Returns: NULL if the name is valid, else the reason it is not.
+ * Description: Names are alphanumeric characters and periods, checked with
+ * a regex compiled once. '.' and '..' are taken by paths.
+ */
+const char *check_name(const char *name) {
+	static regex_t regex;
+	static short regex_ready = UNSET;
+	if (strlen(name) > (size_t) MAX_FILE_NAME) {
+		return "File name too long.";
+	}
+	if (!regex_ready) {
+		if (regcomp(&regex, FILE_NAME_REGEX, REG_EXTENDED | REG_NOSUB) != 0) {
+			return "Failed to compile regex";
+		}
+		regex_ready = SET;
+	}
+	if (regexec(&regex, name, (size_t) 0, NULL, 0) || !strcmp(name, ".")
+			|| !strcmp(name, "..")) {
+		return "Invalid file name.";
+	}
+	return NULL;
+}
+
+/*
+ * Function: mark_entries
+ * Parameter(s): block - directory tree node
+ * Description: Marks the node and the nodes below it used.
+ */
+void mark_entries(uint32_t block) {
+	EntryHeader *node = entry_node(block);
+	int counter;
+	set_block_range(block, 1, SET);
+	for (counter = 0; node->depth > 0 && counter < node->count; counter++) {
+		mark_entries(directory_entries(node)[counter].child);
+	}
+}
+
+/*
+ * Function: make_directory
+ * Parameter(s): path - directory to create
+ * Description: Creates an empty directory. Unlike files, a directory's name
+ * must be unique within its parent.
+ */
+void make_directory(char *path) {
+	char buffer[BUFFER_SIZE], message[BUFFER_SIZE + 32], *leaf;
+	const char *problem;
+	int parent, index;
+	Inode *inode;
+	InodeHot *hot;
+	if (path == NULL) {
+		print_message("mkdir error: Directory name missing.");
+		return;
+	}
+	parent = resolve_path(path, buffer, &leaf);
+	if (parent < 0) {
+		print_message("mkdir error: Directory not found.");
+		return;
+	}
+	if (leaf == NULL || directory_find(parent, leaf, SET) >= 0) {
+		print_message("mkdir error: File exists.");
+		return;
+	}
+	if ((problem = check_name(leaf)) != NULL) {
+		snprintf(message, sizeof(message), "mkdir error: %s", problem);
+		print_message(message);
+		return;
+	}
+	index = get_new_file_entry();
+	if (index == -1) {
+		print_message("mkdir error: Directory limit reached.");
+		return;
+	}
+	inode = &directory[index];
+	hot = &inode_hot[index];
+	memcpy(inode->file_name, leaf, strlen(leaf) + 1);
+	init_extent_tree(inode);
+	hot->size = 0;
+	hot->time_created = time(NULL);
+	hot->type = DIRECTORY_FILE;
+	inode->parent = parent;
+	inode->root = NO_BLOCK;
+	set_inode_used(index, SET);
+	if (directory_insert(parent, index) < 0) {
+		print_message("mkdir error: Not enough disk space.");
+		inode->file_name[0] = '\0';
+		hot->time_created = 0;
+		hot->type = REGULAR_FILE;
+		set_inode_used(index, UNSET);
+		return;
+	}
+	superblock->inode_count++;
+	if ((uint32_t) index >= superblock->inode_high) {
+		superblock->inode_high = index + 1;
+	}
+	log_range(inode, sizeof(Inode));
+	log_range(hot, sizeof(InodeHot));
+	log_range(superblock, sizeof(Superblock));
+}
+
+/*
+ * Function: remove_directory
+ * Parameter(s): path - directory to remove
+ * Description: Removes an empty directory other than the root and the
+ * current one of the shell or of any client.
+ */
+void remove_directory(char *path) {
+	int index = path == NULL ? NEGATIVE : lookup_path(path, SET);
+	if (index < 0 || inode_hot[index].type != DIRECTORY_FILE) {
+		print_message("rmdir error: Directory not found.");
+		return;
+	}
+	if (index == ROOT_DIRECTORY || directory_in_use(index)) {
+		print_message("rmdir error: Directory in use.");
+		return;
+	}
+	if (inode_hot[index].size > 0) {
+		print_message("rmdir error: Directory not empty.");
+		return;
+	}
+	if (directory_remove(directory[index].parent, index) < 0) {
+		print_message("rmdir error: Not enough disk space.");
+		return;
+	}
+	inode_hot[index].time_created = 0;
+	inode_hot[index].type = REGULAR_FILE;
+	set_inode_used(index, UNSET);
+	directory[index].file_name[0] = '\0';
+	superblock->inode_count--;
+	log_range(&directory[index], sizeof(Inode));
+	log_range(&inode_hot[index], sizeof(InodeHot));
+	log_range(superblock, sizeof(Superblock));
+}
+
+/*
+ * Function: directory_in_use
+ * Parameter(s): index - inode of a directory
+ * Returns: SET if it is the current directory of the shell or a session.
+ * Description: Sessions only change directory under the update lock, which
+ * the caller holds.
+ */
+int directory_in_use(int index) {
+	Session *session;
+	int used = (uint32_t) index == shell_directory;
+	pthread_mutex_lock(&session_lock);
+	for (session = sessions; session != NULL && !used;
+			session = session->next) {
+		used = (uint32_t) index == session->directory;
+	}
+	pthread_mutex_unlock(&session_lock);
+	return used;
+}
+
+/*
+ * Function: change_directory
+ * Parameter(s): path - new current directory, the root if missing
+ */
+void change_directory(char *path) {
+	int index = path == NULL ? ROOT_DIRECTORY : lookup_path(path, SET);
+	if (index < 0 || inode_hot[index].type != DIRECTORY_FILE) {
+		print_message("cd error: Directory not found.");
+		return;
+	}
+	*working_directory = index;
+}
+
+/*
+ * Function: print_directory
+ * Description: Prints the path of the current directory.
+ */
+void print_directory() {
+	uint32_t index, depth = 0, counter, *chain;
+	for (index = *working_directory; index != ROOT_DIRECTORY;
+			index = directory[index].parent) {
+		depth++;
+	}
+	chain = malloc((depth + 1) * sizeof(uint32_t));
+	if (chain == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	counter = depth;
+	for (index = *working_directory; index != ROOT_DIRECTORY;
+			index = directory[index].parent) {
+		chain[--counter] = index;
+	}
+	if (depth == 0) {
+		fprintf(output, "/");
+	}
+	for (counter = 0; counter < depth; counter++) {
+		fprintf(output, "/%s", directory[chain[counter]].file_name);
+	}
+	fprintf(output, "\n");
+	free(chain);
+	flush_output();
+}
+
+/*
+ * Function: set_compression
+ * Parameter(s): state - "on" or "off", missing to only show the setting
+ * Description: Turns compression of the files put from now on on or off,
+ * the files stored already keep their form.
+ */
+void set_compression(char *state) {
+	if (state != NULL && strcmp(state, "on") && strcmp(state, "off")) {
+		print_message("compress error: Expected on or off.");
+		return;
+	}
+	if (state != NULL) {
+		superblock->compression = !strcmp(state, "on");
+		log_range(superblock, sizeof(Superblock));
+	}
+	fprintf(output, "compress: %s.\n", superblock->compression ? "On" : "Off");
+	flush_output();
+}
+
+/*
+ * Function: show_prompt
+ * Parameter(s): new_line - prints a new line ahead of the prompt if set
+ * Description: Shows the shell prompt, batch mode has none.
+ */
+void show_prompt(short new_line) {
+	if (batch_script != NULL) {
+		return;
+	}
+	if (new_line) {
+		fprintf(output, "\n%s", PROMPT);
+	} else {
+		fprintf(output, "%s", PROMPT);
+	}
+	flush_output();
+}
+
+/*
+ * Function: print_message
+ * Description: Util function to print formatted messages. In batch mode
+ * they are error reports and go to stderr, tagged with the script line.
+ */
+void print_message(char *message) {
+	if (batch_script != NULL) {
+		fprintf(stderr, "%s:%d: %s\n", batch_script, batch_line, message);
+		++batch_errors;
+		return;
+	}
+	fprintf(output, "%s%s\n", PROMPT, message);
+	flush_output();
+}
+
+/*
+ * Function: flush_output
+ * Description: Flushes the output after each interactive command. Batch
+ * mode leaves it to main, every BATCH_FLUSH lines and at the end, a server
+ * to serve_line, once the client's command is done.
+ */
+void flush_output() {
+	if (batch_script == NULL && socket_path == NULL) {
+		fflush(output);
+	}
+}
+
+/*
+ * Function: split_string
+ * Parameter(s): string - command line submitted by User
+ * args - storage passed from calling function to store split items
+ * Description: Splits the command line passed to function, based on space
+ * between words. This helps in extracting the command and its arguments.
+ * The rest of the line after a '<' is data for write and append, spaces
+ * and all.
+ */
+void split_string(char *string, char *args[]) {
+	char *token, *state, *data = strchr(string, '<');
+	int counter = 0;
+
+	//-- Whatever follows '<' is data, the last argument, taken as it is.
+	if (data != NULL) {
+		*data++ = '\0';
+		data += *data == ' ';
+	}
+	token = strtok_r(string, TOKENT_SPLR, &state);
+	while (token != NULL && counter < ARGS_SUPPORTED - (data != NULL)) {
+		args[counter] = token;
+		token = strtok_r(NULL, TOKENT_SPLR, &state);
+		++counter;
+	}
+	if (data != NULL) {
+		args[counter++] = data;
+	}
+
+	//-- Array to store tokens have a predefined size. If there aren't
+	//-- enough tokens to fill up the array, left space is filled up with NULL
+	while (counter < ARGS_SUPPORTED) {
+		args[counter] = NULL;
+		++counter;
+	}
+}
+
+/*
+ * Function: is_empty
+ * Parameter(s): string - string to be validated
+ * Returns: Validation status
+ * Description: Validates if the passed string is empty or not.
+ */
+int is_empty(const char *string) {
+	while (*string != '\0') {
+		if (!isspace(*string)) {
+			return 0;
+		}
+		string++;
+	}
+	return 1;
+}
+
+/*
+ * Function: init_locks
+ * Description: Sets up the reader-writer locks. Writers go first, so a
+ * stream of gets does not hold a delete off, nor listings a put.
+ */
+void init_locks() {
+	pthread_rwlockattr_t attributes;
+	int counter;
+	pthread_rwlockattr_init(&attributes);
+	pthread_rwlockattr_setkind_np(&attributes,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&directory_lock, &attributes);
+	for (counter = 0; counter < INODE_LOCKS; counter++) {
+		pthread_rwlock_init(&inode_locks[counter].lock, &attributes);
+	}
+	pthread_rwlockattr_destroy(&attributes);
+}
+
+/*
+ * Function: run_server
+ * Returns: EXIT_FAILURE if the socket cannot be set up, else it does not
+ * return.
+ * Description: Listens on the Unix socket and hands clients to a pool of
+ * workers sharing one epoll instance. Every socket is armed one shot, so a
+ * client is served by one worker at a time and its commands run in order.
+ * The main thread waits for SIGINT, SIGTERM or SIGHUP and then shuts the
+ * volume down. A socket left by an earlier server is replaced.
+ */
+int run_server() {
+	struct sockaddr_un address;
+	struct epoll_event event;
+	struct stat status;
+	pthread_t thread;
+	sigset_t signals;
+	int counter, signal_number;
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	if (worker_count == 0) {
+		worker_count = processors > MIN_WORKERS ?
+				(processors < MAX_WORKERS ? processors : MAX_WORKERS) : MIN_WORKERS;
+	}
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "%s: Socket path too long.\n", socket_path);
+		return EXIT_FAILURE;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, socket_path, strlen(socket_path) + 1);
+	if (lstat(socket_path, &status) == 0 && S_ISSOCK(status.st_mode)) {
+		unlink(socket_path);
+	}
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0
+			|| bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) < 0
+			|| listen(listen_fd, SOMAXCONN) < 0
+			|| (poll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror(socket_path);
+		return EXIT_FAILURE;
+	}
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = NULL;
+	if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+		perror("epoll_ctl");
+		return EXIT_FAILURE;
+	}
+	//-- Workers leave the signals to the main thread. A client gone while
+	//-- output is written to it is noticed on its next read.
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	for (counter = 0; counter < worker_count; counter++) {
+		if (pthread_create(&thread, NULL, serve_clients, NULL) != 0) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+		pthread_detach(thread);
+	}
+	fprintf(stdout, "mfs: Serving %s with %d workers.\n", socket_path,
+			worker_count);
+	fflush(stdout);
+	while (sigwait(&signals, &signal_number) != 0)
+		;
+	stop_server();
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Function: serve_clients
+ * Parameter(s): unused - thread argument
+ * Returns: Nothing, workers run until the server stops.
+ * Description: Worker thread. Takes whichever socket is ready: the
+ * listening one to accept clients, or a client's to run its commands.
+ * While clients are quiet, changes waiting on a commit are committed once
+ * their commit interval is up, and with -a the volume is defragmented a
+ * step at a time.
+ */
+void *serve_clients(void *unused) {
+	struct epoll_event event;
+	int timeout = journaling && commit_interval > 0 ? commit_interval : -1;
+	(void) unused;
+	if (compact_option && (timeout < 0 || timeout > DEFRAG_INTERVAL)) {
+		timeout = DEFRAG_INTERVAL;
+	}
+	while (1) {
+		if (epoll_wait(poll_fd, &event, 1, timeout) <= 0) {
+			if (pthread_mutex_trylock(&update_lock) == 0) {
+				if (compact_option) {
+					defrag_step(DEFRAG_STEP, DEFRAG_SCAN, NULL);
+					flush_nodes();
+				}
+				maybe_commit();
+				pthread_mutex_unlock(&update_lock);
+			}
+			continue;
+		}
+		if (event.data.ptr == NULL) {
+			accept_clients();
+		} else {
+			serve_session(event.data.ptr);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function: accept_clients
+ * Description: Opens a session for each waiting client, starting in the
+ * root directory, and greets it with the prompt.
+ */
+void accept_clients() {
+	struct epoll_event event;
+	Session *session;
+	int fd;
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		session = calloc(1, sizeof(Session));
+		if (session == NULL || (session->input = malloc(BUFFER_SIZE)) == NULL
+				|| (session->output = fdopen(fd, "w")) == NULL) {
+			perror("mfs: session");
+			if (session != NULL) {
+				free(session->input);
+			}
+			free(session);
+			close(fd);
+			continue;
+		}
+		session->directory = ROOT_DIRECTORY;
+		pthread_mutex_lock(&session_lock);
+		session->next = sessions;
+		sessions = session;
+		pthread_mutex_unlock(&session_lock);
+		fprintf(session->output, "%s", PROMPT);
+		fflush(session->output);
+		event.events = EPOLLIN | EPOLLONESHOT;
+		event.data.ptr = session;
+		if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			perror("epoll_ctl");
+			close_session(session);
+		}
+	}
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = NULL;
+	epoll_ctl(poll_fd, EPOLL_CTL_MOD, listen_fd, &event);
+}
+
+/*
+ * Function: serve_session
+ * Parameter(s): session - client whose socket is readable
+ * Description: Runs every complete line the client has sent, as the shell
+ * does, with the session's directory and output. A line too long for the
+ * buffer is cut like fgets cuts it. At end of input the last line runs
+ * even without a newline and the session closes.
+ */
+void serve_session(Session *session) {
+	struct epoll_event event;
+	char *end;
+	size_t length;
+	ssize_t bytes;
+	int fd = fileno(session->output);
+	output = session->output;
+	working_directory = &session->directory;
+	while (1) {
+		bytes = recv(fd, session->input + session->filled,
+				BUFFER_SIZE - 1 - session->filled, MSG_DONTWAIT);
+		if (bytes < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes <= 0) {
+			break;
+		}
+		session->filled += bytes;
+		while (session->filled > 0 && ((end = memchr(session->input, '\n',
+				session->filled)) != NULL
+				|| session->filled == (size_t) BUFFER_SIZE - 1)) {
+			length = end != NULL ? (size_t) (end - session->input) + 1 :
+					session->filled;
+			session->input[end != NULL ? length - 1 : length] = '\0';
+			serve_line(session, session->input);
+			session->filled -= length;
+			memmove(session->input, session->input + length, session->filled);
+		}
+	}
+	if (bytes == 0 && session->filled > 0) {
+		session->input[session->filled] = '\0';
+		session->filled = 0;
+		serve_line(session, session->input);
+	}
+	output = stdout;
+	working_directory = &shell_directory;
+	if (bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		close_session(session);
+		return;
+	}
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = session;
+	if (epoll_ctl(poll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+		perror("epoll_ctl");
+		close_session(session);
+	}
+}
+
+/*
+ * Function: serve_line
+ * Parameter(s): session - client that sent the line
+ * line - command line from the client, without its newline
+ * Description: Runs the command and sends its output back, ending with
+ * the prompt, which tells the client the command is done. The output is
+ * gathered in memory and only sent once the command has let go of its
+ * locks, so a client which stops reading holds up no one but its worker.
+ */
+void serve_line(Session *session, char *line) {
+	char *shell_args[ARGS_SUPPORTED], *reply = NULL;
+	size_t length = 0;
+	output = open_memstream(&reply, &length);
+	if (output == NULL) {
+		output = session->output;
+	}
+	if (!is_empty(line)) {
+		split_string(line, shell_args);
+		execute_command(shell_args);
+	}
+	show_prompt(0);
+	if (output != session->output) {
+		fclose(output);
+		fwrite(reply, 1, length, session->output);
+		free(reply);
+		output = session->output;
+	}
+	fflush(output);
+}
+
+/*
+ * Function: close_session
+ * Parameter(s): session - client to disconnect
+ */
+void close_session(Session *session) {
+	Session **link;
+	pthread_mutex_lock(&session_lock);
+	for (link = &sessions; *link != session; link = &(*link)->next)
+		;
+	*link = session->next;
+	pthread_mutex_unlock(&session_lock);
+	epoll_ctl(poll_fd, EPOLL_CTL_DEL, fileno(session->output), NULL);
+	fclose(session->output);
+	free(session->input);
+	free(session);
+}
+
+/*
+ * Function: stop_server
+ * Description: Waits for the command changing the volume, if any, then
+ * commits and marks the image clean like close_volume. The volume stays
+ * mapped: gets still running end with the process.
+ */
+void stop_server() {
+	pthread_mutex_lock(&update_lock);
+	flush_nodes();
+	if (journaling) {
+		close_journal();
+	}
+	unlink(socket_path);
+	fflush(stdout);
+	_exit(EXIT_SUCCESS);
 }